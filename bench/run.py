@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""Benchmark runner for clox
+
+Builds the release configuration, runs every benchmark from this directory several times and reports median and
+minimal wall time, number of executed instructions and peak heap. Results can be saved as JSON and compared against
+a saved baseline, failing when any benchmark's fastest run got slower than the threshold allows. Fastest run is
+compared rather than median, as it's the one least disturbed by whatever else the machine does.
+
+    $ bench/run.py [-n RUNS] [--json FILE] [--baseline FILE] [--threshold PERCENT] [--no-build] [name ...]
+"""
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+CLOX = os.path.join(REPO_DIR, "clox")
+
+
+def build():
+    """Build optimized clox with the repo's build script"""
+    subprocess.run([os.path.join(REPO_DIR, "build.sh"), "-r"], cwd=REPO_DIR, check=True, stdout=subprocess.DEVNULL)
+
+
+def benchmarks(names):
+    """List benchmark scripts, all of them when no names are given"""
+    available = sorted(f[:-4] for f in os.listdir(BENCH_DIR) if f.endswith(".lox"))
+    for name in names:
+        if name not in available:
+            sys.exit("Unknown benchmark '%s', available: %s" % (name, ", ".join(available)))
+    return names or available
+
+
+def check_output(name, output):
+    """Fail when benchmark printed something else than its .expected file, a fast wrong answer proves nothing"""
+    expected_path = os.path.join(BENCH_DIR, name + ".expected")
+    if not os.path.exists(expected_path):
+        return
+    with open(expected_path) as expected:
+        if output != expected.read():
+            sys.exit("Benchmark '%s' printed unexpected output:\n%s" % (name, output))
+
+
+def run(name, runs):
+    """Run benchmark, returning its timings and counters"""
+    script = os.path.join(BENCH_DIR, name + ".lox")
+    times = []
+    for _ in range(runs):
+        start = time.perf_counter()
+        result = subprocess.run([CLOX, script], capture_output=True, text=True)
+        times.append(time.perf_counter() - start)
+        if result.returncode != 0:
+            sys.exit("Benchmark '%s' failed with exit code %d:\n%s" % (name, result.returncode, result.stderr))
+        check_output(name, result.stdout)
+
+    # Counters come from one more run with profiling and GC statistics, which would skew the timed ones
+    result = subprocess.run([CLOX, "--gc-stats", "--profile=" + os.devnull, script], capture_output=True, text=True)
+    instructions = re.search(r"^profile: (\d+) instructions", result.stderr, re.M)
+    peak = re.search(r"^gc heap: [\d.]+ KB, peak ([\d.]+) KB", result.stderr, re.M)
+    return {
+        "median": statistics.median(times),
+        "min": min(times),
+        "instructions": int(instructions.group(1)) if instructions else None,
+        "peakBytes": int(float(peak.group(1)) * 1024) if peak else None,
+    }
+
+
+def change(new, old):
+    """Relative change in percent, None when there is nothing to compare"""
+    if new is None or not old:
+        return None
+    return (new - old) / old * 100
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run clox benchmarks")
+    parser.add_argument("names", nargs="*", help="benchmarks to run, all by default")
+    parser.add_argument("-n", "--runs", type=int, default=5, help="timed runs of every benchmark")
+    parser.add_argument("--json", metavar="FILE", help="write results as JSON, to be used as a baseline later")
+    parser.add_argument("--baseline", metavar="FILE", help="compare against results written with --json")
+    parser.add_argument("--threshold", type=float, default=5.0, metavar="PERCENT",
+                        help="slowdown of minimal time over baseline that fails the run")
+    parser.add_argument("--no-build", action="store_true", help="use clox binary as it is")
+    args = parser.parse_args()
+
+    if not args.no_build:
+        build()
+    baseline = {}
+    if args.baseline:
+        with open(args.baseline) as file:
+            baseline = json.load(file)["benchmarks"]
+
+    results = {}
+    regressions = []
+    print("%-14s %10s %10s %14s %12s%s" % ("benchmark", "median s", "min s", "instructions", "peak KB",
+                                          "   median / min vs baseline" if baseline else ""))
+    for name in benchmarks(args.names):
+        result = results[name] = run(name, args.runs)
+        line = "%-14s %10.4f %10.4f %14s %12.1f" % (name, result["median"], result["min"],
+                                                    result["instructions"], (result["peakBytes"] or 0) / 1024)
+        if name in baseline:
+            old = baseline[name]
+            time_change = change(result["min"], old["min"])
+            line += "   %+7.2f%% / %+7.2f%%" % (change(result["median"], old["median"]), time_change)
+            instruction_change = change(result["instructions"], old.get("instructions"))
+            if instruction_change:
+                line += " (instructions %+.2f%%)" % instruction_change
+            if time_change > args.threshold:
+                regressions.append(name)
+                line += "  SLOWER"
+        print(line)
+
+    if args.json:
+        with open(args.json, "w") as file:
+            json.dump({"runs": args.runs, "benchmarks": results}, file, indent=2)
+            file.write("\n")
+    if regressions:
+        sys.exit("Slower than baseline by more than %.1f%%: %s" % (args.threshold, ", ".join(regressions)))
+
+
+if __name__ == "__main__":
+    main()
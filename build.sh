@@ -1,11 +1,37 @@
 #!/bin/bash
+
+FLAGS=""
+BUILD="CLox"
  
-while getopts "g" opt; do
+while getopts "grsnwqj" opt; do
   case $opt in
     g)
-      gcc -g -o clox src/main.c src/chunk.c src/memory.c src/debug.c src/value.c src/vm.c src/compiler.c src/scanner.c src/object.c src/table.c
-      echo "CLox debug build successful"
-      exit
+      FLAGS="$FLAGS -g"
+      BUILD="$BUILD debug"
+      ;;
+    r)
+      FLAGS="$FLAGS -O2" # Optimized build, the one benchmarks measure
+      BUILD="$BUILD release"
+      ;;
+    s)
+      FLAGS="$FLAGS -DNO_COMPUTED_GOTO" # Portable switch dispatch instead of computed goto
+      BUILD="$BUILD switch-dispatch"
+      ;;
+    n)
+      FLAGS="$FLAGS -DNO_OPTIMIZE" # Emit bytecode without optimization pass
+      BUILD="$BUILD unoptimized"
+      ;;
+    w)
+      FLAGS="$FLAGS -DNO_INCREMENTAL_GC" # Stop-the-world garbage collector instead of incremental one
+      BUILD="$BUILD stop-the-world-gc"
+      ;;
+    q)
+      FLAGS="$FLAGS -DNO_QUICKEN" # Run bytecode as compiled, without rewriting instructions into specialized forms
+      BUILD="$BUILD unquickened"
+      ;;
+    j)
+      FLAGS="$FLAGS -DNO_JIT" # Only interpret, for platforms that forbid executable memory
+      BUILD="$BUILD interpreter-only"
       ;;
     \?)
       echo "Invalid option: -$OPTARG" >&2
@@ -13,5 +39,5 @@ while getopts "g" opt; do
   esac
 done
 
-gcc -o clox src/main.c src/chunk.c src/memory.c src/debug.c src/value.c src/vm.c src/compiler.c src/scanner.c src/object.c src/table.c
-echo "CLox build successful"
\ No newline at end of file
+gcc $FLAGS -o clox src/main.c src/chunk.c src/memory.c src/debug.c src/value.c src/vm.c src/compiler.c src/jit.c src/optimizer.c src/output.c src/bytecode.c src/list.c src/native.c src/profiler.c src/scanner.c src/object.c src/table.c -lm || exit 1
+echo "$BUILD build successful"
@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define BYTECODE_MMAP // Map cache file instead of reading it into a buffer
+#endif
+
+#include "bytecode.h"
+#include "memory.h"
+#include "vm.h"
+
+/* Header at the start of the cache file, followed by payload with global names and the script function tree
+*
+*   Fields:
+*   - uint32_t magic: BYTECODE_MAGIC
+*   - uint32_t version: BYTECODE_VERSION of the VM that wrote the file
+*   - uint64_t sourceHash: of the whole source file
+*   - int64_t sourceTime: modification time of the source file
+*   - uint64_t payloadHash: of everything after the header, so damaged file is never executed
+*   - uint64_t payloadSize: number of bytes after the header
+*/
+typedef struct {
+    uint32_t magic; // BYTECODE_MAGIC
+    uint32_t version; // BYTECODE_VERSION of the VM that wrote the file
+    uint64_t sourceHash; // of the whole source file
+    int64_t sourceTime; // modification time of the source file
+    uint64_t payloadHash; // of everything after the header, so damaged file is never executed
+    uint64_t payloadSize; // number of bytes after the header
+} BytecodeHeader;
+
+// Kind of value stored in constants table, written before the value itself
+typedef enum {
+    CONSTANT_NUMBER,    // 8 bytes of double
+    CONSTANT_STRING,    // String, see writeString()
+    CONSTANT_FUNCTION,  // Nested function, see writeFunction()
+    CONSTANT_NIL,
+    CONSTANT_TRUE,
+    CONSTANT_FALSE
+} ConstantTag;
+
+/* Growable buffer the payload is written to
+*
+*   Fields:
+*   - uint8_t* bytes: written so far
+*   - size_t count: of written bytes
+*   - size_t capacity: of bytes array
+*/
+typedef struct {
+    uint8_t* bytes; // written so far
+    size_t count; // of written bytes
+    size_t capacity; // of bytes array
+} Writer;
+
+/* Cursor over the mapped payload
+*
+*   Fields:
+*   - const uint8_t* current: next byte to read
+*   - const uint8_t* end: of the payload
+*   - bool failed: whether read went past the end or payload didn't make sense
+*/
+typedef struct {
+    const uint8_t* current; // next byte to read
+    const uint8_t* end; // of the payload
+    bool failed; // whether read went past the end or payload didn't make sense
+} Reader;
+
+/* Calculate hash of bytes using 64-bit FNV-1a algorithm
+*   Arguments:
+*   - const uint8_t* bytes: to hash
+*   - size_t length: of bytes
+*
+*   Return calculated hash
+*/
+static uint64_t hashBytes(const uint8_t* bytes, size_t length) {
+    uint64_t hash = 14695981039346656037u; // 64-bit FNV offset basis
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211u; // 64-bit FNV prime
+    }
+    return hash;
+}
+
+/* Get path of the cache file belonging to source file
+*   Arguments:
+*   - const char* path: of the source file
+*
+*   Return allocated path with "c" appended, freed by caller
+*/
+static char* cachePath(const char* path) {
+    size_t length = strlen(path);
+    char* cache = (char*)malloc(length + 2);
+    if (cache == NULL) exit(1);
+    memcpy(cache, path, length);
+    cache[length] = 'c';
+    cache[length + 1] = '\0';
+    return cache;
+}
+
+/* Append bytes to the payload
+*   Arguments:
+*   - Writer* writer: to append to
+*   - const void* bytes: to append
+*   - size_t length: of bytes
+*/
+static void writeBytes(Writer* writer, const void* bytes, size_t length) {
+    if (writer->capacity < writer->count + length) {
+        while (writer->capacity < writer->count + length) writer->capacity = GROW_CAPACITY(writer->capacity);
+        // C allocator, as writing allocates no objects and shouldn't trigger GC
+        writer->bytes = (uint8_t*)realloc(writer->bytes, writer->capacity);
+        if (writer->bytes == NULL) exit(1);
+    }
+    memcpy(writer->bytes + writer->count, bytes, length);
+    writer->count += length;
+}
+
+// Append single byte to the payload
+static void writeByte(Writer* writer, uint8_t byte) {
+    writeBytes(writer, &byte, 1);
+}
+
+// Append 32-bit number to the payload
+static void writeNumber(Writer* writer, uint32_t number) {
+    writeBytes(writer, &number, sizeof(number));
+}
+
+/* Append string to the payload as length, hash, interned flag and characters
+*   Arguments:
+*   - Writer* writer: to append to
+*   - ObjString* string: to write
+*/
+static void writeString(Writer* writer, ObjString* string) {
+    writeNumber(writer, (uint32_t)string->length);
+    writeNumber(writer, string->hash); // Loading doesn't hash again, 0 for long strings not hashed yet
+    writeByte(writer, string->interned ? 1 : 0);
+    writeBytes(writer, string->chars, string->length);
+}
+
+/* Append function with its chunk and all nested functions to the payload
+*   Arguments:
+*   - Writer* writer: to append to
+*   - ObjFunction* function: to write
+*/
+static void writeFunction(Writer* writer, ObjFunction* function) {
+    writeNumber(writer, (uint32_t)function->arity);
+    writeNumber(writer, (uint32_t)function->upvalueCount);
+    writeNumber(writer, (uint32_t)function->maxSlots);
+    writeByte(writer, function->name != NULL ? 1 : 0);
+    if (function->name != NULL) writeString(writer, function->name);
+
+    Chunk* chunk = &function->chunk;
+    writeNumber(writer, (uint32_t)chunk->count);
+    writeBytes(writer, chunk->code, chunk->count);
+    writeNumber(writer, (uint32_t)chunk->lineCount);
+    for (int i = 0; i < chunk->lineCount; i++) {
+        writeNumber(writer, (uint32_t)chunk->lines[i].offset);
+        writeNumber(writer, (uint32_t)chunk->lines[i].line);
+    }
+    writeNumber(writer, (uint32_t)chunk->cacheCount); // Caches are written empty, only their number matters
+
+    writeNumber(writer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_NUMBER(value)) {
+            double number = AS_NUMBER(value);
+            writeByte(writer, CONSTANT_NUMBER);
+            writeBytes(writer, &number, sizeof(number));
+        } else if (IS_STRING(value)) {
+            writeByte(writer, CONSTANT_STRING);
+            writeString(writer, AS_STRING(value));
+        } else if (IS_FUNCTION(value)) {
+            writeByte(writer, CONSTANT_FUNCTION);
+            writeFunction(writer, AS_FUNCTION(value));
+        } else if (IS_BOOL(value)) {
+            writeByte(writer, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+        } else {
+            writeByte(writer, CONSTANT_NIL);
+        }
+    }
+}
+
+/* Write compiled script to bytecode cache file next to the source, path with "c" appended
+*   Arguments:
+*   - const char* path: of the source file
+*   - const char* source: code the function was compiled from
+*   - size_t length: of source code
+*   - ObjFunction* function: compiled script
+*
+*   Return whether file was written
+*/
+bool writeBytecode(const char* path, const char* source, size_t length, ObjFunction* function) {
+    struct stat sourceStat;
+    if (stat(path, &sourceStat) != 0) return false;
+
+    Writer writer = {NULL, 0, 0};
+
+    // Bytecode addresses globals by slot, so names of all slots are stored to check loading VM gives the same ones
+    ObjString** names = (ObjString**)calloc(vm.globalCount > 0 ? vm.globalCount : 1, sizeof(ObjString*));
+    if (names == NULL) exit(1);
+    for (int i = 0; i < vm.globalSlots.capacity; i++) {
+        ObjString* key = vm.globalSlots.keys[i];
+        if (key != NULL) names[(int)AS_NUMBER(vm.globalSlots.values[i])] = key;
+    }
+    writeNumber(&writer, (uint32_t)vm.globalCount);
+    for (int i = 0; i < vm.globalCount; i++) {
+        writeString(&writer, names[i]);
+    }
+    free(names);
+    writeFunction(&writer, function);
+
+    BytecodeHeader header;
+    header.magic = BYTECODE_MAGIC;
+    header.version = BYTECODE_VERSION;
+    header.sourceHash = hashBytes((const uint8_t*)source, length);
+    header.sourceTime = (int64_t)sourceStat.st_mtime;
+    header.payloadHash = hashBytes(writer.bytes, writer.count);
+    header.payloadSize = writer.count;
+
+    // Written aside and renamed, so running scripts never see half written cache
+    char* cache = cachePath(path);
+    char* temporary = (char*)malloc(strlen(cache) + 5);
+    if (temporary == NULL) exit(1);
+    sprintf(temporary, "%s.tmp", cache);
+
+    FILE* file = fopen(temporary, "wb");
+    bool written = file != NULL;
+    if (written) {
+        written = fwrite(&header, sizeof(header), 1, file) == 1;
+        if (written && writer.count > 0) written = fwrite(writer.bytes, writer.count, 1, file) == 1;
+        written = fclose(file) == 0 && written;
+        written = written && rename(temporary, cache) == 0;
+        if (!written) remove(temporary);
+    }
+
+    free(temporary);
+    free(cache);
+    free(writer.bytes);
+    return written;
+}
+
+/* Take bytes from the payload
+*   Arguments:
+*   - Reader* reader: to read from
+*   - size_t length: number of bytes
+*
+*   Return pointer to the bytes in the mapped file, NULL when payload is shorter
+*/
+static const uint8_t* readBytes(Reader* reader, size_t length) {
+    if (reader->failed || (size_t)(reader->end - reader->current) < length) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->current;
+    reader->current += length;
+    return bytes;
+}
+
+// Read single byte from the payload, 0 when payload is shorter
+static uint8_t readByte(Reader* reader) {
+    const uint8_t* bytes = readBytes(reader, 1);
+    return bytes != NULL ? bytes[0] : 0;
+}
+
+// Read 32-bit number from the payload, 0 when payload is shorter
+static uint32_t readNumber(Reader* reader) {
+    uint32_t number = 0;
+    const uint8_t* bytes = readBytes(reader, sizeof(number));
+    if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+    return number;
+}
+
+/* Read string from the payload, taking the stored hash instead of hashing characters again
+*   Arguments:
+*   - Reader* reader: to read from
+*
+*   Return interned or new string, NULL when payload is shorter
+*/
+static ObjString* readString(Reader* reader) {
+    int length = (int)readNumber(reader);
+    uint32_t hash = readNumber(reader);
+    bool interned = readByte(reader) != 0;
+    const uint8_t* chars = readBytes(reader, length);
+    if (chars == NULL) return NULL;
+    return copyHashedString((const char*)chars, length, hash, interned);
+}
+
+/* Read function with its chunk and all nested functions from the payload
+*   Function is left on VM's stack on failure, caller resets the stack
+*   Arguments:
+*   - Reader* reader: to read from
+*
+*   Return new function, NULL when payload doesn't hold valid function
+*/
+static ObjFunction* readFunction(Reader* reader) {
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function)); // Reachable while its name and constants are allocated
+    function->arity = (int)readNumber(reader);
+    function->upvalueCount = (int)readNumber(reader);
+    function->maxSlots = (int)readNumber(reader);
+    if (readByte(reader) != 0) {
+        ObjString* name = readString(reader);
+        if (name == NULL) return NULL;
+        writeBarrier(OBJ_VAL(name)); // Function can be already blackened
+        function->name = name;
+    }
+
+    Chunk* chunk = &function->chunk;
+    int count = (int)readNumber(reader);
+    const uint8_t* code = readBytes(reader, count);
+    if (code == NULL) return NULL;
+    chunk->code = ALLOCATE(uint8_t, count);
+    memcpy(chunk->code, code, count);
+    chunk->count = count;
+    chunk->capacity = count;
+
+    int lineCount = (int)readNumber(reader);
+    if (readBytes(reader, 0) == NULL || (count > 0 && lineCount == 0)
+        || (size_t)(reader->end - reader->current) / (2 * sizeof(uint32_t)) < (size_t)lineCount) return NULL;
+    chunk->lines = ALLOCATE(LineStart, lineCount);
+    chunk->lineCapacity = lineCount;
+    for (int i = 0; i < lineCount; i++) {
+        chunk->lines[i].offset = (int)readNumber(reader);
+        chunk->lines[i].line = (int)readNumber(reader);
+        chunk->lineCount++;
+    }
+
+    int cacheCount = (int)readNumber(reader);
+    if (reader->failed || cacheCount > count) return NULL; // Every cache belongs to an instruction
+    for (int i = 0; i < cacheCount; i++) {
+        addInlineCache(chunk);
+    }
+
+    int constantCount = (int)readNumber(reader);
+    if (reader->failed || constantCount > count + 1) return NULL; // Every constant is referenced by the code
+    for (int i = 0; i < constantCount; i++) {
+        switch (readByte(reader)) {
+            case CONSTANT_NUMBER: {
+                double number;
+                const uint8_t* bytes = readBytes(reader, sizeof(number));
+                if (bytes == NULL) return NULL;
+                memcpy(&number, bytes, sizeof(number));
+                addConstant(chunk, NUMBER_VAL(number));
+                break;
+            }
+            case CONSTANT_STRING: {
+                ObjString* string = readString(reader);
+                if (string == NULL) return NULL;
+                addConstant(chunk, OBJ_VAL(string));
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction* nested = readFunction(reader);
+                if (nested == NULL) return NULL;
+                addConstant(chunk, OBJ_VAL(nested));
+                break;
+            }
+            case CONSTANT_NIL: addConstant(chunk, NIL_VAL); break;
+            case CONSTANT_TRUE: addConstant(chunk, BOOL_VAL(true)); break;
+            case CONSTANT_FALSE: addConstant(chunk, BOOL_VAL(false)); break;
+            default: return NULL;
+        }
+        if (reader->failed) return NULL;
+    }
+
+    pop();
+    return function;
+}
+
+/* Check header and load payload of the cache file
+*   Arguments:
+*   - const uint8_t* data: whole file
+*   - size_t size: of the file
+*   - const char* source: code of the source file
+*   - size_t length: of source code
+*   - int64_t sourceTime: modification time of the source file
+*
+*   Return script function, NULL when file doesn't match the source
+*/
+static ObjFunction* loadBytecode(const uint8_t* data, size_t size, const char* source, size_t length, int64_t sourceTime) {
+    BytecodeHeader header;
+    if (size < sizeof(header)) return NULL;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != BYTECODE_MAGIC || header.version != BYTECODE_VERSION) return NULL;
+    if (header.sourceTime != sourceTime || header.payloadSize != size - sizeof(header)) return NULL;
+    if (header.sourceHash != hashBytes((const uint8_t*)source, length)) return NULL;
+    if (header.payloadHash != hashBytes(data + sizeof(header), header.payloadSize)) return NULL;
+
+    Reader reader = {data + sizeof(header), data + size, false};
+    Value* stackTop = vm.stackTop;
+
+    // Slots are given out in order of the first use, so the same names have to end up in the same slots
+    int globalCount = (int)readNumber(&reader);
+    for (int i = 0; i < globalCount; i++) {
+        ObjString* name = readString(&reader);
+        if (name == NULL || !name->interned || globalSlot(name) != i) return NULL;
+    }
+
+    ObjFunction* function = readFunction(&reader);
+    if (function == NULL || reader.current != reader.end) {
+        vm.stackTop = stackTop; // Drop functions left by failed read
+        return NULL;
+    }
+    return function;
+}
+
+/* Load compiled script from bytecode cache file next to the source, if the file matches the source
+*   Arguments:
+*   - const char* path: of the source file
+*   - const char* source: code of the source file
+*   - size_t length: of source code
+*
+*   Return script function, NULL when there is no valid cache and source has to be compiled
+*/
+ObjFunction* readBytecode(const char* path, const char* source, size_t length) {
+    struct stat sourceStat;
+    if (stat(path, &sourceStat) != 0) return NULL;
+
+    char* cache = cachePath(path);
+    ObjFunction* function = NULL;
+#ifdef BYTECODE_MMAP
+    int file = open(cache, O_RDONLY);
+    free(cache);
+    if (file < 0) return NULL;
+    struct stat cacheStat;
+    if (fstat(file, &cacheStat) == 0 && cacheStat.st_size > 0) {
+        // Pages are only read, strings and code are copied out before unmapping
+        void* data = mmap(NULL, (size_t)cacheStat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (data != MAP_FAILED) {
+            function = loadBytecode((const uint8_t*)data, (size_t)cacheStat.st_size, source, length, (int64_t)sourceStat.st_mtime);
+            munmap(data, (size_t)cacheStat.st_size);
+        }
+    }
+    close(file);
+#else
+    FILE* file = fopen(cache, "rb");
+    free(cache);
+    if (file == NULL) return NULL;
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    uint8_t* data = size > 0 ? (uint8_t*)malloc(size) : NULL;
+    if (data != NULL && fread(data, 1, size, file) == (size_t)size) {
+        function = loadBytecode(data, (size_t)size, source, length, (int64_t)sourceStat.st_mtime);
+    }
+    free(data);
+    fclose(file);
+#endif
+    return function;
+}
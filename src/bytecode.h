@@ -0,0 +1,30 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "object.h"
+
+#define BYTECODE_MAGIC 0x42584c43 // "CLXB" read as little-endian number, files from machine with other byte order don't match
+#define BYTECODE_VERSION 4 // Version of the cache format, has to be bumped whenever opcodes or layout of the file change
+
+/* Write compiled script to bytecode cache file next to the source, path with "c" appended
+*   Arguments:
+*   - const char* path: of the source file
+*   - const char* source: code the function was compiled from
+*   - size_t length: of source code
+*   - ObjFunction* function: compiled script
+*
+*   Return whether file was written
+*/
+bool writeBytecode(const char* path, const char* source, size_t length, ObjFunction* function);
+
+/* Load compiled script from bytecode cache file next to the source, if the file matches the source
+*   Arguments:
+*   - const char* path: of the source file
+*   - const char* source: code of the source file
+*   - size_t length: of source code
+*
+*   Return script function, NULL when there is no valid cache and source has to be compiled
+*/
+ObjFunction* readBytecode(const char* path, const char* source, size_t length);
+
+#endif
@@ -12,8 +12,13 @@ void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray(&chunk->constants); //Initialize constants array
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
 }
 
 /* Free chunk's memory
@@ -22,8 +27,9 @@ void initChunk(Chunk* chunk) {
 */
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity); //Free opcodes array
-    FREE_ARRAY(int, chunk->lines, chunk->capacity); //Free array of lines numbers
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity); //Free line runs
     freeValueArray(&chunk->constants); //Free constants array
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity); //Free inline caches
     initChunk(chunk);
 }
 
@@ -38,12 +44,43 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    // Start new run only when line changes, consecutive bytes mostly share it
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+    LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
+}
+
+/* Find source line of bytecode
+*   Arguments:
+*   - Chunk* chunk: containing the bytecode
+*   - int offset: of the byte
+*
+*   Return line from which byte originates
+*/
+int getLine(Chunk* chunk, int offset) {
+    // Binary search for the last run starting at or before offset
+    int start = 0;
+    int end = chunk->lineCount - 1;
+    while (start < end) {
+        int mid = start + (end - start + 1) / 2;
+        if (chunk->lines[mid].offset <= offset) {
+            start = mid;
+        } else {
+            end = mid - 1;
+        }
+    }
+    return chunk->lines[start].line;
 }
 
 /* Add constant to chunk
@@ -53,7 +90,35 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 */
 int addConstant(Chunk* chunk, Value value) {
     push(value); //Storing value on stack temporarly to preserve it from garbage collector during array writing
+    writeBarrier(value); // Function owning the chunk can be already blackened
     writeValueArray(&chunk->constants, value); //Add value to chunk's constant table
     pop();
     return chunk->constants.count - 1;
+}
+
+/* Add empty inline cache to chunk
+*   Arguments:
+*   - Chunk* chunk: pointer to Chunk to write
+*
+*   Return index of the cache
+*/
+int addInlineCache(Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) { //Grow capacity if too low to add next cache
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+        // Class and shape ids start from 1, so nothing matches empty entry
+        cache->entries[i].shapeId = 0;
+        cache->entries[i].classId = 0;
+        cache->entries[i].slot = 0;
+        cache->entries[i].method = NULL;
+        cache->entries[i].transition = NULL;
+    }
+    cache->fieldIndex = 0;
+    cache->next = 0;
+    return chunk->cacheCount++;
 }
\ No newline at end of file
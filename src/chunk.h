@@ -36,27 +36,37 @@ typedef enum {
     Stack out:  value
     */
     OP_GET_LOCAL,
+    /*Chunk:    OP_GET_LOCAL_0 ... OP_GET_LOCAL_3
+    Stack in:
+    Stack out:  value
+    Short forms of OP_GET_LOCAL for the first four frame slots
+    */
+    OP_GET_LOCAL_0,
+    OP_GET_LOCAL_1,
+    OP_GET_LOCAL_2,
+    OP_GET_LOCAL_3,
     /*Chunk:    OP_SET_LOCAL, frame slot addr
     Stack in:   value
     Stack out:  value
     Value also set at the frame slot addr
     */
     OP_SET_LOCAL,
-    /*Chunk:    OP_GET_GLOBAL, global name pointer
+    /*Chunk:    OP_GET_GLOBAL, global slot (2 bytes)
     Stack in:
     Stack out:  value
+    Error if slot is not defined yet
     */
     OP_GET_GLOBAL,
-    /*Chunk:    OP_DEFINE_GLOBAL, global name pointer
+    /*Chunk:    OP_DEFINE_GLOBAL, global slot (2 bytes)
     Stack in:   value
     Stack out:
-    Value set in globals table
+    Value set in global slot
     */
     OP_DEFINE_GLOBAL,
-    /*Chunk:    OP_SET_GLOBAL, global name pointer
+    /*Chunk:    OP_SET_GLOBAL, global slot (2 bytes)
     Stack in:   value
     Stack out:  value
-    Value set in globals table only if previously defined
+    Value set in global slot only if previously defined
     */
     OP_SET_GLOBAL,
     /*Chunk:    OP_GET_UPVALUE, closure upvalues slot addr
@@ -70,12 +80,12 @@ typedef enum {
     Upvalue location set in current closure upvalues table
     */
     OP_SET_UPVALUE,
-    /*Chunk:    OP_GET_PROPERTY, property name pointer
+    /*Chunk:    OP_GET_PROPERTY, property name pointer, inline cache index (2 bytes)
     Stack in:   instance pointer
     Stack out:  field/bound method pointer
     */
     OP_GET_PROPERTY,
-    /*Chunk:    OP_SET_PROPERTY, property name pointer
+    /*Chunk:    OP_SET_PROPERTY, property name pointer, inline cache index (2 bytes)
     Stack in:   instance pointer, value
     Stack out:  value
     Property set in instance fields table
@@ -86,6 +96,22 @@ typedef enum {
     Stack out:  bound method pointer
     */
     OP_GET_SUPER,
+    /*Chunk:    OP_BUILD_LIST, elements count
+    Stack in:   value1 ... valueN
+    Stack out:  list pointer
+    */
+    OP_BUILD_LIST,
+    /*Chunk:    OP_GET_INDEX
+    Stack in:   list pointer, number index
+    Stack out:  value
+    */
+    OP_GET_INDEX,
+    /*Chunk:    OP_SET_INDEX
+    Stack in:   list pointer, number index, value
+    Stack out:  value
+    Value set at the index of list
+    */
+    OP_SET_INDEX,
     /*Chunk:    OP_EQUAL
     Stack in:   value, value
     Stack out:  bool value
@@ -149,6 +175,12 @@ typedef enum {
     Increment instruction pointer by offset if value false
     */
     OP_JUMP_IF_FALSE,
+    /*Chunk:    OP_JUMP_IF_FALSE_POP, offset
+    Stack in:   value
+    Stack out:
+    Increment instruction pointer by offset if value false
+    */
+    OP_JUMP_IF_FALSE_POP,
     /*Chunk:    OP_LOOP, offset
     Stack in:   
     Stack out:
@@ -161,7 +193,13 @@ typedef enum {
     If function then move instruction pointer to the callee chunk and start executing
     */
     OP_CALL,
-    /*Chunk:    OP_INVOKE, method name pointer, arguments count
+    /*Chunk:    OP_TAIL_CALL, arguments count
+    Stack in:   callee pointer, arg1 ... argN
+    Stack out:  result
+    OP_CALL in return position. Function callee replaces the current callframe, followed OP_RETURN handles other callees
+    */
+    OP_TAIL_CALL,
+    /*Chunk:    OP_INVOKE, method name pointer, arguments count, inline cache index (2 bytes)
     Stack in:   instance, arg1 ... argN
     Stack out:  result
     */
@@ -203,24 +241,154 @@ typedef enum {
     Stack in:   class, method closure
     Stack out:  class
     */
-    OP_METHOD
+    OP_METHOD,
+    /*Chunk:    OP_ADD_LOCAL_LOCAL, frame slot addr, frame slot addr
+    Stack in:
+    Stack out:  number value or string pointer
+    Fused OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD
+    */
+    OP_ADD_LOCAL_LOCAL,
+    /*Chunk:    OP_INCREMENT_LOCAL, frame slot addr, number constant addr
+    Stack in:
+    Stack out:
+    Fused OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP of the same slot
+    */
+    OP_INCREMENT_LOCAL,
+    /*Chunk:    OP_LESS_LOCAL_CONSTANT_JUMP, frame slot addr, number constant addr, offset
+    Stack in:
+    Stack out:
+    Fused OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE_POP
+    */
+    OP_LESS_LOCAL_CONSTANT_JUMP,
+    /*Chunk:    OP_GREATER_LOCAL_CONSTANT_JUMP, frame slot addr, number constant addr, offset
+    Stack in:
+    Stack out:
+    Fused OP_GET_LOCAL, OP_CONSTANT, OP_GREATER, OP_JUMP_IF_FALSE_POP
+    */
+    OP_GREATER_LOCAL_CONSTANT_JUMP,
+    /*Chunk:    OP_GET_METHOD, property name pointer, inline cache index (2 bytes)
+    Stack in:   instance
+    Stack out:  instance, method or field value, field value
+    Property read into local that is only ever called, so method is not bound
+    */
+    OP_GET_METHOD,
+    /*Chunk:    OP_CALL_LOCAL, frame slot addr, arguments count
+    Stack in:   receiver or callee, arguments
+    Stack out:  result
+    Call value of local holding property read with OP_GET_METHOD, with the value below arguments as slot 0
+    */
+    OP_CALL_LOCAL,
+    /*Chunk:    OP_GET_BOUND_METHOD, property name pointer, inline cache index (2 bytes)
+    Stack in:   instance
+    Stack out:  instance, bound method or field value, field value
+    OP_GET_METHOD patched by compiler once the local turned out to be used other than as a callee
+    */
+    OP_GET_BOUND_METHOD,
+    /*Chunk:    OP_ADD_NUMBER
+    Stack in:   number value, number value
+    Stack out:  number value
+    OP_ADD quickened by the run loop after it added numbers, turns back into OP_ADD when operands aren't numbers.
+    Quickened opcodes are never emitted by compiler nor written to bytecode cache
+    */
+    OP_ADD_NUMBER,
+    /*Chunk:    OP_EQUAL_NUMBER
+    Stack in:   number value, number value
+    Stack out:  bool value
+    OP_EQUAL quickened after it compared numbers, turns back into OP_EQUAL when operands aren't numbers
+    */
+    OP_EQUAL_NUMBER,
+    /*Chunk:    OP_GET_FIELD, property name pointer, inline cache index (2 bytes)
+    Stack in:   instance pointer
+    Stack out:  field value
+    OP_GET_PROPERTY quickened once its inline cache saw a single receiver shape, holding field.
+    Reads field at the slot of the first cache entry, turns back into OP_GET_PROPERTY for any other receiver
+    */
+    OP_GET_FIELD,
+    /*Chunk:    OP_INVOKE_METHOD, method name pointer, arguments count, inline cache index (2 bytes)
+    Stack in:   instance, arg1 ... argN
+    Stack out:  result
+    OP_INVOKE quickened once its inline cache saw a single receiver shape and class, calling method.
+    Calls method of the first cache entry, turns back into OP_INVOKE for any other receiver
+    */
+    OP_INVOKE_METHOD,
+    /*Chunk:    OP_WIDE, opcode, index (2 bytes), remaining operands
+    Stack in:   as opcode
+    Stack out:  as opcode
+    Prefix widening constant, frame slot, upvalue or name index of the next instruction past 255, for OP_CLOSURE every captured index too
+    */
+    OP_WIDE
 } OpCode;
 
+#define OP_COUNT (OP_WIDE + 1) // Number of opcodes, size of tables indexed by opcode
+
+#define INLINE_CACHE_SIZE 4 // Number of classes remembered by one polymorphic inline cache
+
+/* Inline cache entry for one receiver shape
+*
+*   Fields:
+*   - uint32_t shapeId: of the receiver, 0 for instance in dictionary mode
+*   - uint32_t classId: of the receiver when method was resolved, 0 for empty entry or field
+*   - int slot: of the field in the shape
+*   - Obj* method: resolved method closure, NULL when entry holds field
+*   - struct Shape* transition: shape after field was added by OP_SET_PROPERTY, NULL when field existed
+*/
+typedef struct {
+    uint32_t shapeId; // of the receiver, 0 for instance in dictionary mode
+    uint32_t classId; // of the receiver when method was resolved, 0 for empty entry or field
+    int slot; // of the field in the shape
+    Obj* method; // resolved method closure, NULL when entry holds field
+    struct Shape* transition; // shape after field was added by OP_SET_PROPERTY, NULL when field existed
+} InlineCacheEntry;
+
+/* Inline cache of single property access or method invocation site
+*
+*   Fields:
+*   - InlineCacheEntry entries[INLINE_CACHE_SIZE]: one per receiver shape seen by the site
+*   - int fieldIndex: entry index in dictionary mode instance's table where field was found last time
+*   - int next: entry to be replaced when all are taken
+*/
+typedef struct {
+    InlineCacheEntry entries[INLINE_CACHE_SIZE]; // one per receiver shape seen by the site
+    int fieldIndex; // entry index in dictionary mode instance's table where field was found last time
+    int next; // entry to be replaced when all are taken
+} InlineCache;
+
+/* Start of run of bytecode compiled from the same source line
+*
+*   Fields:
+*   - int offset: of the first byte in the run
+*   - int line: source code line of the whole run
+*/
+typedef struct {
+    int offset; // of the first byte in the run
+    int line; // source code line of the whole run
+} LineStart;
+
 /* Chunk struct
 *
 *   Fields:
 *   - int count: of bytes within chunk
 *   - int capacity
 *   - uint8_t* code: pointer to array of opcodes
-*   - int* lines: pointer to array of lines corresponding to opcodes
+*   - int lineCount: number of line runs
+*   - int lineCapacity
+*   - LineStart* lines: pointer to run-length encoded lines of opcodes, ordered by offset
 *   - ValueArray constants
+*   - int cacheCount: number of inline caches
+*   - int cacheCapacity
+*   - InlineCache* caches: pointer to array of inline caches referenced by opcodes
 */
 typedef struct {
     int count; // of bytes within chunk
     int capacity;
     uint8_t* code; // pointer to array of opcodes
-    int* lines; // pointer to array of lines corresponding to opcodes
+    int lineCount; // number of line runs
+    int lineCapacity;
+    LineStart* lines; // pointer to run-length encoded lines of opcodes, ordered by offset
     ValueArray constants;
+    int cacheCount; // number of inline caches
+    int cacheCapacity;
+    InlineCache* caches; // pointer to array of inline caches referenced by opcodes
 } Chunk;
 
 /* Init chunk that will hold the programs
@@ -243,6 +411,15 @@ void freeChunk(Chunk* chunk);
 */
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 
+/* Find source line of bytecode
+*   Arguments:
+*   - Chunk* chunk: containing the bytecode
+*   - int offset: of the byte
+*
+*   Return line from which byte originates
+*/
+int getLine(Chunk* chunk, int offset);
+
 /* Add constant to chunk
 *   Arguments:
 *   - Chunk* chunk: pointer to Chunk to write
@@ -250,5 +427,13 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line);
 */
 int addConstant(Chunk* chunk, Value value);
 
+/* Add empty inline cache to chunk
+*   Arguments:
+*   - Chunk* chunk: pointer to Chunk to write
+*
+*   Return index of the cache
+*/
+int addInlineCache(Chunk* chunk);
+
 #endif
 
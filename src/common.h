@@ -6,12 +6,40 @@
 #include <stdint.h>
 
 #define NAN_BOXING //Use NaN boxing for holding Value, for optimization purpose but might not work on all architectures
-#define DEBUG_PRINT_CODE //Print opcodes when compiling
-#define DEBUG_TRACE_EXECUTION //Print opcodes and stack when VM running
+
+//Use threaded dispatch (computed goto) in VM's run loop. Requires GCC/Clang "labels as values", build with -DNO_COMPUTED_GOTO for portable switch dispatch
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+//Run optimization pass over every compiled chunk. Build with -DNO_OPTIMIZE to disassemble bytecode exactly as compiler emitted it
+#ifndef NO_OPTIMIZE
+#define OPTIMIZE_CODE
+#endif
+//Rewrite generic instructions in place into forms specialized for operand types they see. Build with -DNO_QUICKEN to run bytecode as compiled
+#ifndef NO_QUICKEN
+#define QUICKENING
+#endif
+//Compile hot functions to machine code on x86-64 and AArch64 Unix-likes, except Apple arm64 needing MAP_JIT, for NaN-boxed values only. Build with -DNO_JIT to only interpret
+#if defined(NAN_BOXING) && !defined(NO_JIT) && (defined(__unix__) || defined(__APPLE__)) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || (defined(__aarch64__) && !defined(__APPLE__)))
+#define BASELINE_JIT
+#endif
+//Collect garbage incrementally with tri-color marking and write barriers to bound GC pauses. Build with -DNO_INCREMENTAL_GC for stop-the-world mark-sweep
+#ifndef NO_INCREMENTAL_GC
+#define INCREMENTAL_GC
+#endif
 
 //#define DEBUG_STRESS_GC //Run garbage collector every time the memory is reallocated
 //#define DEBUG_LOG_GC //Print garbage collector debug messages
 
+//Storage of variables that every thread has its own copy of, so threads can run separate VMs
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif
\ No newline at end of file
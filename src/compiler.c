@@ -5,11 +5,10 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
-
-#ifdef DEBUG_PRINT_CODE
+#include "vm.h"
 #include "debug.h"
-#endif
 
 /* Struct for parsing of tokenized source code
 *
@@ -38,7 +37,7 @@ typedef enum {
     PREC_TERM,          // + -
     PREC_FACTOR,        // * /
     PREC_UNARY,         // ! -
-    PREC_CALL,          // . ()
+    PREC_CALL,          // . () []
     PREC_PRIMARY
 } Precedence;
 
@@ -64,21 +63,25 @@ typedef struct {
 *   - Token name: of the variable
 *   - int depth: of the scope variable is in
 *   - bool isCaptured: whether is captured by upvalue
+*   - bool holdsMethod: whether variable holds unbound method and is only ever called, with receiver in the slot below
+*   - int methodOffset: of OP_GET_METHOD initializing variable holding unbound method
 */
 typedef struct {
     Token name; // of the variable
     int depth;  // of the scope variable is in
     bool isCaptured; // whether is captured by upvalue
+    bool holdsMethod; // whether variable holds unbound method and is only ever called, with receiver in the slot below
+    int methodOffset; // of OP_GET_METHOD initializing variable holding unbound method
 } Local;
 
 /* Local variable struct
 *
 *   Fields:
-*   - uint8_t index: which local slot the upvalue is capturing
+*   - uint16_t index: which local slot the upvalue is capturing
 *   - bool isLocal: whether upvalue in local scope or referencing other upvalue required
 */
 typedef struct {
-    uint8_t index; //  which local slot the upvalue is capturing
+    uint16_t index; //  which local slot the upvalue is capturing
     bool isLocal; // whether upvalue in local scope or referencing other upvalue required
 } Upvalue;
 
@@ -95,10 +98,14 @@ typedef enum {
 *   - struct Compiler* enclosing: compiler
 *   - ObjFunction* function: that compiler is working on
 *   - FunctionType type: of the function that compiler is working on
-*   - Local locals[UINT8_COUNT]: locals array
+*   - Local* locals: locals array
 *   - int localCount: length of locals array
-*   - Upvalue upvalues[UINT8_COUNT]: upvalues array
+*   - int localCapacity: allocated length of locals array
+*   - Upvalue* upvalues: upvalues array
+*   - int upvalueCapacity: allocated length of upvalues array
 *   - int scopeDepth: compiler's scope depth, 0 for script
+*   - int methodCallSlot: slot of local holding unbound method that was just read as callee, -1 otherwise
+*   - int lastCall: offset of the last emitted OP_CALL, which becomes tail call when return follows right after it
 */
 typedef struct Compiler
 {
@@ -106,10 +113,14 @@ typedef struct Compiler
     ObjFunction* function; // that compiler is working on
     FunctionType type; // of the function that compiler is working on
 
-    Local locals[UINT8_COUNT]; // locals array
+    Local* locals; // locals array
     int localCount; // length of locals array
-    Upvalue upvalues[UINT8_COUNT]; // upvalues array
+    int localCapacity; // allocated length of locals array
+    Upvalue* upvalues; // upvalues array
+    int upvalueCapacity; // allocated length of upvalues array
     int scopeDepth; // compiler's scope depth, 0 for script
+    int methodCallSlot; // slot of local holding unbound method that was just read as callee, -1 otherwise
+    int lastCall; // offset of the last emitted OP_CALL, which becomes tail call when return follows right after it
 } Compiler;
 
 /* Compiler struct for compiling class
@@ -123,9 +134,9 @@ typedef struct ClassCompiler {
     bool hasSuperclass; // whether class has superclass
 } ClassCompiler;
 
-Parser parser; // Global parser
-Compiler* current = NULL; // Global pointer to current compiler
-ClassCompiler* currentClass = NULL; // Global pointer to current class compiler
+THREAD_LOCAL Parser parser; // Parser of the calling thread
+THREAD_LOCAL Compiler* current = NULL; // Pointer to current compiler of the calling thread
+THREAD_LOCAL ClassCompiler* currentClass = NULL; // Pointer to current class compiler of the calling thread
 
 //Returns chunk of currently compiled function
 static Chunk* currentChunk() {
@@ -260,26 +271,41 @@ static int emitJump(uint8_t instruction) {
 //Emit bytes for return statement without expressions
 static void emitReturn() {
     if (current->type == TYPE_INITIALIZER) {
-        emitBytes(OP_GET_LOCAL, 0); //Load slot 0 that contains instance
+        emitByte(OP_GET_LOCAL_0); //Load slot 0 that contains instance
     } else {
         emitByte(OP_NIL); //Load nil onto the stack
     }
     emitByte(OP_RETURN);
 }
 
+/* Emit opcode with constant, frame slot or upvalue index operand, prefixed with OP_WIDE when index doesn't fit in a byte
+*   Arguments:
+*   - uint8_t instruction: to be emitted
+*   - int index: operand of the instruction
+*/
+static void emitIndexed(uint8_t instruction, int index) {
+    if (index > UINT8_MAX) {
+        emitBytes(OP_WIDE, instruction);
+        emitByte((index >> 8) & 0xff); // Emit higher bits of index
+        emitByte(index & 0xff); // Emit lower bits of index
+    } else {
+        emitBytes(instruction, (uint8_t)index);
+    }
+}
+
 /* Add value to the current chunk constants table
 *   Arguments:
 *   - Value value: to be addded to the table
 *   
 *   Return constant index in table
 */
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    if (constant > UINT16_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
-    return (uint8_t)constant;
+    return constant;
 }
 
 /* Emit bytes for constants handling
@@ -287,7 +313,29 @@ static uint8_t makeConstant(Value value) {
 *   - Value value: to be emitted
 */
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitIndexed(OP_CONSTANT, makeConstant(value));
+}
+
+// Emit two bytes operand with index of new inline cache for property access or invocation site
+static void emitCache() {
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+
+    emitByte((cache >> 8) & 0xff); // Emit higher bits of cache index
+    emitByte(cache & 0xff); // Emit lower bits of cache index
+}
+
+/* Emit global variable instruction with two bytes slot operand
+*   Arguments:
+*   - uint8_t instruction: to be emitted
+*   - uint16_t slot: of the global
+*/
+static void emitGlobal(uint8_t instruction, uint16_t slot) {
+    emitByte(instruction);
+    emitByte((slot >> 8) & 0xff); // Emit higher bits of slot
+    emitByte(slot & 0xff); // Emit lower bits of slot
 }
 
 /* Patch jump instruction
@@ -315,8 +363,14 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->enclosing = current; // Set current compiler as enclosing compiler
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalueCapacity = 0;
     compiler->scopeDepth = 0;
+    compiler->methodCallSlot = -1;
+    compiler->lastCall = -1;
     compiler->function = newFunction(); // Create new function object
     current = compiler; // Set current compiler to just initialized one
 
@@ -326,9 +380,12 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     }
 
     // Claim slot 0 of locals array to optionally store "this" instance if inside a method
+    current->localCapacity = GROW_CAPACITY(0);
+    current->locals = GROW_ARRAY(Local, NULL, 0, current->localCapacity);
     Local* local = &current->locals[current->localCount++]; 
     local->depth = 0;
     local->isCaptured = false;
+    local->holdsMethod = false;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -345,13 +402,16 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
-    #ifdef DEBUG_PRINT_CODE
-        if (!parser.hadError) {
-            disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
-            printf("\n");
-        }
+    #ifdef OPTIMIZE_CODE
+        if (!parser.hadError) optimizeChunk(currentChunk()); // Fold constants, thread jumps and remove dead code
     #endif
+    if (!parser.hadError) function->maxSlots = maxStackDepth(currentChunk(), function->arity + 1); // Checked by VM on every call
+    if (vm.dumpBytecode && !parser.hadError) {
+        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+        printf("\n");
+    }
 
+    FREE_ARRAY(Local, current->locals, current->localCapacity); // Upvalues are still read by function() to emit OP_CLOSURE
     current = current->enclosing; // Go back to enclosing compiler
     return function;
 }
@@ -403,9 +463,25 @@ static void parsePrecedence(Precedence precedence);
 *
 *   Return index in constants table
 */
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
     //Copy string from source code and allocate in in the constants table
-    return makeConstant(OBJ_VAL(copyString(name->start,name->length)));
+    return makeConstant(OBJ_VAL(internString(name->start,name->length)));
+}
+
+/* Resolve identifier to global slot, reserving it if global was not seen yet
+*   Arguments:
+*   - Token* name: of the global variable
+*
+*   Return slot index in VM's global values
+*/
+static uint16_t globalIdentifier(Token* name) {
+    // Slot stays the same for the name across compilations, so REPL lines and late bound globals share it
+    int slot = globalSlot(internString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
 }
 
 /* Check if identifiers equal
@@ -445,15 +521,30 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1; // Local wasn't found, maybe check the globals
 }
 
+/* Let variable that held unbound method hold bound one from now on, once it's used other than as a callee.
+*   Its OP_GET_METHOD is patched in place, calls compiled before still pass the receiver through the slot below,
+*   and calling bound method puts the same receiver there
+*   Arguments:
+*   - Compiler* compiler: with the variable
+*   - int slot: of the variable
+*/
+static void bindMethod(Compiler* compiler, int slot) {
+    Local* local = &compiler->locals[slot];
+    uint8_t* code = &compiler->function->chunk.code[local->methodOffset];
+    if (*code == OP_WIDE) code++;
+    *code = OP_GET_BOUND_METHOD;
+    local->holdsMethod = false;
+}
+
 /* Add upvalue to compiler's upvalues array
 *   Arguments:
 *   - Compiler* compiler: to add upvalue to
-*   - uint8_t index: of the variable on the stack
+*   - uint16_t index: of the variable on the stack
 *   - bool isLocal: whether variable is in direct enclosing or upvalues indirection will be necessary
 *
 *   Return slot within upvalues array
 */
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, uint16_t index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     // Check if upvalue previously added. Return it if so.
@@ -464,10 +555,15 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
         }
     }
 
-    if (upvalueCount == UINT8_COUNT) {
+    if (upvalueCount == UINT16_COUNT) {
         error("Too many closure variables in function.");
         return 0;
     }
+    if (upvalueCount == compiler->upvalueCapacity) {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+    }
 
     // Add at the end of upvalues array and increment count
     compiler->upvalues[upvalueCount].isLocal = isLocal;
@@ -487,16 +583,17 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 
     int local = resolveLocal(compiler->enclosing, name); // Try to find in direct parent enclosing
     if (local != -1) {
+        if (compiler->enclosing->locals[local].holdsMethod) bindMethod(compiler->enclosing, local); // Closure can use it any way
         compiler->enclosing->locals[local].isCaptured = true; // Indicate that upvalue needs to be hoisted onto the heap when clearing stack
         // If found in direct parent enclosing then upvalue indirection is not needed
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(compiler, (uint16_t)local, true);
     }
 
     // Recursively walk enclosing in search of upvalue
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
         // If found in direct higher enclosing then upvalue indirection is needed
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, (uint16_t)upvalue, false);
     }
 
     return -1;
@@ -507,14 +604,20 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 *   - Token* name: of the variable to add
 */
 static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount == UINT16_COUNT) {
         error("Too many local variables in function.");
         return;
     }
+    if (current->localCount == current->localCapacity) {
+        int oldCapacity = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(oldCapacity);
+        current->locals = GROW_ARRAY(Local, current->locals, oldCapacity, current->localCapacity);
+    }
     Local* local = &current->locals[current->localCount++];
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->holdsMethod = false;
 }
 
 // Declare local variable in current compiler, with just scanned identifier as a name
@@ -544,13 +647,13 @@ static void declareVariable() {
 *   Arguments:
 *   - const char* errorMessage: when no identifier found
 *
-*   Return index of name in constants table for globals
+*   Return slot of the global variable
 */
-static uint8_t parseVariable(const char* errorMessage) {
+static uint16_t parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
     declareVariable(); // Declare local variable, global variable will be declared on runtime
     if (current->scopeDepth > 0) return 0; // Local will have name in compiler's locals table
-    return identifierConstant(&parser.previous);
+    return globalIdentifier(&parser.previous);
 }
 
 // Set the current scope depth to the top local variable
@@ -561,9 +664,9 @@ static void markInitialized() {
 
 /* Define global variable
 *   Arguments:
-*   - uint8_t global: index of variable name in globals table
+*   - uint16_t global: slot of the global variable
 */
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
     if (current->scopeDepth > 0) {
         /*If it is local there is no special things to do.
         It is already the last temporary remaining on stack.
@@ -572,7 +675,7 @@ static void defineVariable(uint8_t global) {
         return;
     }
     // If reached then define global
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 /*Parse arguments list
@@ -652,8 +755,16 @@ static void binary(bool canAssign) {
 *   - bool canAssign: whether token used in contex where assignment available
 */
 static void call(bool canAssign) {
+    int methodSlot = current->methodCallSlot; // Taken before arguments, which can have calls of their own
+    current->methodCallSlot = -1;
     uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+    if (methodSlot != -1) {
+        emitIndexed(OP_CALL_LOCAL, methodSlot);
+        emitByte(argCount);
+    } else {
+        current->lastCall = currentChunk()->count;
+        emitBytes(OP_CALL, argCount);
+    }
 }
 
 /* Parse dot infix token
@@ -662,20 +773,61 @@ static void call(bool canAssign) {
 */
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL)) {
         // Property setter
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitIndexed(OP_SET_PROPERTY, name);
+        emitCache();
     } else if (match(TOKEN_LEFT_PAREN)) {
         // Method call
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+        emitIndexed(OP_INVOKE, name);
         emitByte(argCount);
+        emitCache();
     } else {
         // Property getter
-        emitBytes(OP_GET_PROPERTY, name);
+        emitIndexed(OP_GET_PROPERTY, name);
+        emitCache();
+    }
+}
+
+/* Parse list literal [...]
+*   Arguments:
+*   - bool canAssign: whether token used in contex where assignment available
+*/
+static void list(bool canAssign) {
+    int count = 0;
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            if (check(TOKEN_RIGHT_BRACKET)) break; // Trailing comma
+            expression();
+            if (count == UINT16_MAX) {
+                error("Can't have more than 65535 elements in list literal.");
+            }
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emitIndexed(OP_BUILD_LIST, count);
+}
+
+/* Parse subscript infix token
+*   Arguments:
+*   - bool canAssign: whether token used in contex where assignment available
+*/
+static void subscript(bool canAssign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        // Element setter
+        expression();
+        emitByte(OP_SET_INDEX);
+    } else {
+        // Element getter
+        emitByte(OP_GET_INDEX);
     }
 }
 
@@ -702,12 +854,22 @@ static void grouping(bool canAssign) {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
 }
 
+#define NUMBER_LEXEME_MAX 63 // Longer number literals are copied to the heap for parsing
+
 /* Parse number token and add it to constants table
 *   Arguments:
 *   - bool canAssign: whether token used in contex where assignment available
 */
 static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
+    // Lexeme is copied out, as source doesn't have to be terminated and strtod would read past the token
+    char buffer[NUMBER_LEXEME_MAX + 1];
+    int length = parser.previous.length;
+    char* text = length <= NUMBER_LEXEME_MAX ? buffer : (char*)malloc(length + 1);
+    if (text == NULL) exit(1);
+    memcpy(text, parser.previous.start, length);
+    text[length] = '\0';
+    double value = strtod(text, NULL);
+    if (text != buffer) free(text);
     emitConstant(NUMBER_VAL(value));
 }
 
@@ -728,7 +890,13 @@ static void string(bool canAssign) {
 static void namedVariable(Token name, bool canAssign) {
     uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name); // Try finding in current compiler
-    if (arg != -1) { // Found in local compiler
+    if (arg != -1 && current->locals[arg].holdsMethod && !check(TOKEN_LEFT_PAREN)) bindMethod(current, arg); // Not a callee
+    if (arg != -1 && current->locals[arg].holdsMethod) { // Only ever called, push receiver and let call() use the method
+        current->methodCallSlot = arg;
+        arg--;
+        getOp = OP_GET_LOCAL;
+        setOp = OP_SET_LOCAL;
+    } else if (arg != -1) { // Found in local compiler
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
     } else if ((arg = resolveUpvalue(current, &name)) != -1) { // Try finding in enclosing functions
@@ -736,7 +904,7 @@ static void namedVariable(Token name, bool canAssign) {
         setOp = OP_SET_UPVALUE;
     } else {
         // Try finding in global scope
-        arg = identifierConstant(&name);
+        arg = globalIdentifier(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
@@ -744,9 +912,14 @@ static void namedVariable(Token name, bool canAssign) {
     // If can assign and next token equal then set operation, get operation otherwise
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        if (setOp == OP_SET_GLOBAL) emitGlobal(setOp, (uint16_t)arg);
+        else emitIndexed(setOp, arg);
+    } else if (getOp == OP_GET_LOCAL && arg <= 3) {
+        emitByte(OP_GET_LOCAL_0 + arg); // Short form without operand for the first slots
+    } else if (getOp == OP_GET_GLOBAL) {
+        emitGlobal(getOp, (uint16_t)arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitIndexed(getOp, arg);
     }
 }
 
@@ -783,19 +956,19 @@ static void super_(bool canAssign) {
     }
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     namedVariable(syntheticToken("this"), false); // Create "this" token to add as a variable to point to instance
     if (match(TOKEN_LEFT_PAREN)) {
         // Super call right away
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false); // Create "super" token to add as a variable to point to superclass
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitIndexed(OP_SUPER_INVOKE, name);
         emitByte(argCount);
     } else {
         // Super get and allocate on heap
         namedVariable(syntheticToken("super"), false); // Create "super" token to add as a variable to point to superclass
-        emitBytes(OP_GET_SUPER, name);
+        emitIndexed(OP_GET_SUPER, name);
     }
 
 }
@@ -836,6 +1009,8 @@ ParseRule rules[] = { // When parse rule not specified comment is added what fun
     [TOKEN_RIGHT_PAREN]     = {NULL, NULL, PREC_NONE}, // Consumed when necessary
     [TOKEN_LEFT_BRACE]      = {NULL, NULL, PREC_NONE}, // Parsed with statement()
     [TOKEN_RIGHT_BRACE]     = {NULL, NULL, PREC_NONE}, // Consumed when necessary
+    [TOKEN_LEFT_BRACKET]    = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET]   = {NULL, NULL, PREC_NONE}, // Consumed when necessary
     [TOKEN_COMMA]           = {NULL, NULL, PREC_NONE}, // Consumed when necessary
     [TOKEN_DOT]             = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS]           = {unary, binary, PREC_TERM},
@@ -948,7 +1123,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            uint16_t constant = parseVariable("Expect parameter name.");
             defineVariable(constant); // Define parameter
         } while (match(TOKEN_COMMA));
     }
@@ -959,21 +1134,31 @@ static void function(FunctionType type) {
 
     ObjFunction* function = endCompiler();
 
-    // Handle upvalues
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    // Handle upvalues, with all indexes widened when the constant or any captured slot doesn't fit in a byte
+    int constant = makeConstant(OBJ_VAL(function));
+    bool wide = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
+    }
+    if (wide) emitByte(OP_WIDE);
+    emitByte(OP_CLOSURE);
+    if (wide) emitByte((constant >> 8) & 0xff); // Emit higher bits of constant
+    emitByte(constant & 0xff);
 
     // Pass information gathered during variable resolving to the VM
     // Upvalues indicated here are upvalues from enclosings and needs to be saved onto the heap
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0); // Whether upvalue is in direct enclosing scope or higher
-        emitByte(compiler.upvalues[i].index); // Local or upvalue index to capture
+        if (wide) emitByte((compiler.upvalues[i].index >> 8) & 0xff); // Emit higher bits of index
+        emitByte(compiler.upvalues[i].index & 0xff); // Local or upvalue index to capture
     }
+    FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
 }
 
 // Parse class method
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
 
     FunctionType type = TYPE_METHOD;
 
@@ -983,7 +1168,7 @@ static void method() {
     }
     function(type);
 
-    emitBytes(OP_METHOD, constant);
+    emitIndexed(OP_METHOD, constant);
 }
 
 // Parse class declaration statement
@@ -991,10 +1176,10 @@ static void classDeclaration() {
     // Declare and define class variable
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitIndexed(OP_CLASS, nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : globalIdentifier(&className));
 
     // Create class compiler
     ClassCompiler classCompiler;
@@ -1040,18 +1225,66 @@ static void classDeclaration() {
 
 // Parse function declaration statement
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    uint16_t global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
 
+/* Check if local variable being declared is initialized with plain `receiver.name;`, which can be kept unbound
+*   as long as the variable is only called. Looks three tokens ahead with a copy of scanner state
+*   Arguments:
+*   - Token* name: of the variable, initializer starts at parser.current
+*
+*   Return whether variable can start holding unbound method
+*/
+static bool isMethodInitializer(Token* name) {
+    if (parser.current.type != TOKEN_IDENTIFIER && parser.current.type != TOKEN_THIS) return false;
+    if (identifiersEqual(&parser.current, name)) return false; // Let the usual path report the error
+
+    Scanner state = saveScanner();
+    bool isMethod = scanToken().type == TOKEN_DOT && scanToken().type == TOKEN_IDENTIFIER
+        && scanToken().type == TOKEN_SEMICOLON;
+    restoreScanner(state);
+    return isMethod;
+}
+
+/* Compile `receiver.name` initializer of variable holding unbound method
+*   Variable declared last is turned into hidden slot for the receiver, and variable itself goes above it
+*   Arguments:
+*   - Token name: of the variable
+*/
+static void methodVariable(Token name) {
+    advance();
+    if (parser.previous.type == TOKEN_THIS) {
+        this_(false);
+    } else {
+        namedVariable(parser.previous, false);
+    }
+    consume(TOKEN_DOT, "Expect '.' after receiver.");
+    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    int offset = currentChunk()->count;
+    emitIndexed(OP_GET_METHOD, identifierConstant(&parser.previous));
+    emitCache();
+
+    current->locals[current->localCount - 1].name = syntheticToken(""); // Never resolved by name
+    addLocal(name);
+    current->locals[current->localCount - 1].holdsMethod = true;
+    current->locals[current->localCount - 1].methodOffset = offset;
+    current->locals[current->localCount - 2].depth = current->scopeDepth; // Receiver initialized with variable
+}
+
 // Parse variable declaration statement
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    uint16_t global = parseVariable("Expect variable name.");
+    Token name = parser.previous;
 
     if (match(TOKEN_EQUAL)) {
-        expression();
+        if (current->scopeDepth > 0 && isMethodInitializer(&name)) {
+            methodVariable(name);
+        } else {
+            expression();
+        }
     } else {
         emitByte(OP_NIL); // Default varaible value
     }
@@ -1092,9 +1325,8 @@ static void forStatement() {
         expression(); // Condition expression
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        //Jump out of the loop if codition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Pop condition result
+        //Jump out of the loop if codition is false. Condition result is popped either way
+        exitJump = emitJump(OP_JUMP_IF_FALSE_POP);
     }
     
     // Parse increment if exist
@@ -1116,7 +1348,6 @@ static void forStatement() {
 
     if (exitJump != -1) { // Patch looping condition if exist
         patchJump(exitJump);
-        emitByte(OP_POP); // Pop condition expression result
     }
 
     endScope();
@@ -1128,14 +1359,12 @@ static void ifStatement() {
     expression(); // Condition
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
     
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // Pop condition if true
+    int thenJump = emitJump(OP_JUMP_IF_FALSE_POP); // Condition is popped in both branches
     statement(); // Statement to evaluate when condition true
 
     int elseJump = emitJump(OP_JUMP); // Remember else position to patch later
 
     patchJump(thenJump); 
-    emitByte(OP_POP); // Pop condition if false
 
     if (match(TOKEN_ELSE)) statement(); // Evaluate else statements if exist
     patchJump(elseJump);
@@ -1162,6 +1391,9 @@ static void returnStatement() {
         }
         expression(); // Evaluate what should be returned and leave it on the stack
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        if (current->lastCall != -1 && current->lastCall == currentChunk()->count - 2) {
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL; // Returned call's result is returned as it is, so callee can take the frame
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -1173,15 +1405,12 @@ static void whileStatement() {
     expression(); // Parse condition
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE); // Jump over loop body if condition false
-    emitByte(OP_POP); // Pop condition expression result within loop
+    int exitJump = emitJump(OP_JUMP_IF_FALSE_POP); // Jump over loop body if condition false, popping condition result either way
 
     statement();
     emitLoop(loopStart); // Jump to start of the loop
 
     patchJump(exitJump); // Patch where execution should resume after loop
-
-    emitByte(OP_POP); // Pop condition expression result at the end of the loop
 }
 
 // Synchronize parser after error happened by skipping without errors to the next synchronization token
@@ -1246,12 +1475,13 @@ static void statement() {
 
 /* Compile source code to opcodes
 *   Arguments:
-*   - const char* source: pointer to the source code
+*   - const char* source: pointer to the source code, doesn't have to be null-terminated
+*   - size_t length: of source code
 *
 *   Return script function that can be run by VM
 */
-ObjFunction* compile(const char* source) {
-    initScanner(source);
+ObjFunction* compile(const char* source, size_t length) {
+    initScanner(source, length);
     Compiler compiler;
     initCompiler(&compiler, TYPE_SCRIPT);
 
@@ -6,11 +6,12 @@
 
 /* Compile source code to opcodes
 *   Arguments:
-*   - const char* source: pointer to the source code
+*   - const char* source: pointer to the source code, doesn't have to be null-terminated
+*   - size_t length: of source code
 *
 *   Return script function that can be run by VM
 */
-ObjFunction* compile(const char* source);
+ObjFunction* compile(const char* source, size_t length);
 
 // Mark functions on compile stack to not be sweeped by garbage collector
 void markCompilerRoots();
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 /* Debug print all instructions in a chunk
 *   Arguments:
@@ -34,6 +35,22 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+/* Debug print global variable instruction
+*   Arguments:
+*   - const char* name: of the instruction
+*   - Chunk* chunk: from which instruction originate
+*   - int offset: of the instruction
+*
+*   Return offset incremented by 3
+*/
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)((chunk->code[offset+1] << 8) | chunk->code[offset+2]);
+    printf("%-16s %4d '", name, slot);
+    printValue(OBJ_VAL(globalName(slot))); // Get name the slot was reserved for
+    printf("'\n");
+    return offset + 3;
+}
+
 /* Debug print invoke instruction
 *   Arguments:
 *   - const char* name: of the instruction
@@ -51,6 +68,41 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 3;
 }
 
+/* Debug print property access instruction
+*   Arguments:
+*   - const char* name: of the instruction
+*   - Chunk* chunk: from which instruction originate
+*   - int offset: of the instruction
+*
+*   Return offset incremented by 4
+*/
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 4;
+}
+
+/* Debug print cached invoke instruction
+*   Arguments:
+*   - const char* name: of the instruction
+*   - Chunk* chunk: from which instruction originate
+*   - int offset: of the instruction
+*
+*   Return offset incremented by 5
+*/
+static int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 5;
+}
+
 /* Debug print simple instruction
 *   Arguments:
 *   - const char* name: of the instruction
@@ -96,6 +148,138 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+/* Debug print instruction with two frame slots operands
+*   Arguments:
+*   - const char* name: of the instruction
+*   - Chunk* chunk: from which instruction originate
+*   - int offset: of the instruction
+*
+*   Return offset incremented by 3
+*/
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+/* Debug print call of local instruction
+*   Arguments:
+*   - const char* name: of the instruction
+*   - Chunk* chunk: from which instruction originate
+*   - int offset: of the instruction
+*
+*   Return offset incremented by 3
+*/
+static int localCallInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    printf("%-16s (%d args) %4d\n", name, argCount, slot);
+    return offset + 3;
+}
+
+/* Debug print instruction with frame slot and constant operands
+*   Arguments:
+*   - const char* name: of the instruction
+*   - Chunk* chunk: from which instruction originate
+*   - int offset: of the instruction
+*
+*   Return offset incremented by 3
+*/
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+/* Debug print instruction with frame slot, constant and jump offset operands
+*   Arguments:
+*   - const char* name: of the instruction
+*   - Chunk* chunk: from which instruction originate
+*   - int offset: of the instruction
+*
+*   Return offset incremented by 5
+*/
+static int localConstantJumpInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' %d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
+/* Debug print instruction prefixed by OP_WIDE, with two bytes index followed by the opcode's other operands
+*   Arguments:
+*   - Chunk* chunk: from which instruction originate
+*   - int offset: of the OP_WIDE prefix
+*
+*   Return offset of the next instruction
+*/
+static int wideInstruction(Chunk* chunk, int offset) {
+    uint8_t instruction = chunk->code[offset + 1];
+    int index = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    offset += 4;
+
+    const char* name;
+    bool isConstant = true; // Whether index refers to constants table rather than to frame or upvalue slot
+    switch (instruction) {
+    case OP_CONSTANT:       name = "OP_CONSTANT"; break;
+    case OP_GET_LOCAL:      name = "OP_GET_LOCAL"; isConstant = false; break;
+    case OP_SET_LOCAL:      name = "OP_SET_LOCAL"; isConstant = false; break;
+    case OP_GET_UPVALUE:    name = "OP_GET_UPVALUE"; isConstant = false; break;
+    case OP_SET_UPVALUE:    name = "OP_SET_VALUE"; isConstant = false; break;
+    case OP_GET_PROPERTY:   name = "OP_GET_PROPERTY"; break;
+    case OP_SET_PROPERTY:   name = "OP_SET_PROPERTY"; break;
+    case OP_GET_SUPER:      name = "OP_GET_SUPER"; break;
+    case OP_BUILD_LIST:     name = "OP_BUILD_LIST"; isConstant = false; break;
+    case OP_INVOKE:         name = "OP_INVOKE"; break;
+    case OP_SUPER_INVOKE:   name = "OP_SUPER_INVOKE"; break;
+    case OP_CLOSURE:        name = "OP_CLOSURE"; break;
+    case OP_CLASS:          name = "OP_CLASS"; break;
+    case OP_METHOD:         name = "OP_METHOD"; break;
+    case OP_GET_METHOD:     name = "OP_GET_METHOD"; break;
+    case OP_GET_BOUND_METHOD: name = "OP_GET_BOUND_METHOD"; break;
+    case OP_CALL_LOCAL:     name = "OP_CALL_LOCAL"; isConstant = false; break;
+    default:
+        printf("Unknown wide opcode %d\n", instruction);
+        return offset;
+    }
+
+    printf("OP_WIDE %-16s %5d", name, index);
+    if (isConstant) {
+        printf(" '");
+        printValue(chunk->constants.values[index]);
+        printf("'");
+    }
+    if (instruction == OP_INVOKE || instruction == OP_SUPER_INVOKE || instruction == OP_CALL_LOCAL) {
+        printf(" (%d args)", chunk->code[offset++]);
+    }
+    if (instruction == OP_GET_PROPERTY || instruction == OP_SET_PROPERTY || instruction == OP_GET_METHOD
+        || instruction == OP_GET_BOUND_METHOD || instruction == OP_INVOKE) {
+        printf(" cache %d", (chunk->code[offset] << 8) | chunk->code[offset + 1]);
+        offset += 2;
+    }
+    printf("\n");
+
+    if (instruction == OP_CLOSURE) {
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[index]);
+        // Loop through upvalues, every capture index is widened too
+        for (int j = 0; j < function->upvalueCount; j++) {
+            int isLocal = chunk->code[offset++];
+            int capture = (chunk->code[offset] << 8) | chunk->code[offset + 1];
+            offset += 2;
+            printf("%04d      |                     %s %d\n", offset - 3, isLocal ? "local" : "upvalue", capture);
+        }
+    }
+    return offset;
+}
+
 /* Debug print one instruction
 *   Arguments:
 *   - Chunk* chunk: from which instruction originate
@@ -105,10 +289,11 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 */
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset-1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("  | ");
     } else {
-        printf("%3d ", chunk->lines[offset]);
+        printf("%3d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
@@ -121,15 +306,22 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_FALSE:          return simpleInstruction("OP_FALSE", offset);
     case OP_POP:            return simpleInstruction("OP_POP", offset);
     case OP_GET_LOCAL:      return byteInstruction("OP_GET_LOCAL", chunk, offset);
+    case OP_GET_LOCAL_0:    return simpleInstruction("OP_GET_LOCAL_0", offset);
+    case OP_GET_LOCAL_1:    return simpleInstruction("OP_GET_LOCAL_1", offset);
+    case OP_GET_LOCAL_2:    return simpleInstruction("OP_GET_LOCAL_2", offset);
+    case OP_GET_LOCAL_3:    return simpleInstruction("OP_GET_LOCAL_3", offset);
     case OP_SET_LOCAL:      return byteInstruction("OP_SET_LOCAL", chunk, offset);
-    case OP_GET_GLOBAL:     return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-    case OP_DEFINE_GLOBAL:  return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-    case OP_SET_GLOBAL:     return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL:     return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL:  return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL:     return globalInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_UPVALUE:    return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:    return byteInstruction("OP_SET_VALUE", chunk, offset);
-    case OP_GET_PROPERTY:   return constantInstruction("OP_GET_PROPERTY", chunk, offset);
-    case OP_SET_PROPERTY:   return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+    case OP_GET_PROPERTY:   return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+    case OP_SET_PROPERTY:   return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_GET_SUPER:      return constantInstruction("OP_GET_SUPER", chunk, offset);
+    case OP_BUILD_LIST:     return byteInstruction("OP_BUILD_LIST", chunk, offset);
+    case OP_GET_INDEX:      return simpleInstruction("OP_GET_INDEX", offset);
+    case OP_SET_INDEX:      return simpleInstruction("OP_SET_INDEX", offset);
     case OP_EQUAL:          return simpleInstruction("OP_EQUAL", offset);
     case OP_GREATER:        return simpleInstruction("OP_GREATER", offset);
     case OP_LESS:           return simpleInstruction("OP_LESS", offset);
@@ -142,9 +334,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_PRINT:          return simpleInstruction("OP_PRINT", offset);
     case OP_JUMP:           return jumpInstruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:  return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE_POP: return jumpInstruction("OP_JUMP_IF_FALSE_POP", 1, chunk, offset);
     case OP_LOOP:           return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:           return byteInstruction("OP_CALL", chunk, offset);
-    case OP_INVOKE:         return invokeInstruction("OP_INVOKE", chunk, offset);
+    case OP_TAIL_CALL:      return byteInstruction("OP_TAIL_CALL", chunk, offset);
+    case OP_INVOKE:         return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:   return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
     case OP_CLOSURE: {
         offset++; // Move offset behind opcode itself
@@ -167,8 +361,91 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_CLASS:      return constantInstruction("OP_CLASS", chunk, offset);
     case OP_INHERIT:    return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:     return constantInstruction("OP_METHOD", chunk, offset);
+    case OP_ADD_LOCAL_LOCAL:    return twoByteInstruction("OP_ADD_LOCAL_LOCAL", chunk, offset);
+    case OP_INCREMENT_LOCAL:    return localConstantInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+    case OP_LESS_LOCAL_CONSTANT_JUMP:       return localConstantJumpInstruction("OP_LESS_LOCAL_CONSTANT_JUMP", chunk, offset);
+    case OP_GREATER_LOCAL_CONSTANT_JUMP:    return localConstantJumpInstruction("OP_GREATER_LOCAL_CONSTANT_JUMP", chunk, offset);
+    case OP_GET_METHOD:     return propertyInstruction("OP_GET_METHOD", chunk, offset);
+    case OP_CALL_LOCAL:     return localCallInstruction("OP_CALL_LOCAL", chunk, offset);
+    case OP_GET_BOUND_METHOD: return propertyInstruction("OP_GET_BOUND_METHOD", chunk, offset);
+    case OP_ADD_NUMBER:     return simpleInstruction("OP_ADD_NUMBER", offset);
+    case OP_EQUAL_NUMBER:   return simpleInstruction("OP_EQUAL_NUMBER", offset);
+    case OP_GET_FIELD:      return propertyInstruction("OP_GET_FIELD", chunk, offset);
+    case OP_INVOKE_METHOD:  return cachedInvokeInstruction("OP_INVOKE_METHOD", chunk, offset);
+    case OP_WIDE:           return wideInstruction(chunk, offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
     }
-}
\ No newline at end of file
+}
+// Name of every opcode, indexed by OpCode
+static const char* opcodeNames[OP_COUNT] = {
+    [OP_CONSTANT]                       = "OP_CONSTANT",
+    [OP_NIL]                            = "OP_NIL",
+    [OP_TRUE]                           = "OP_TRUE",
+    [OP_FALSE]                          = "OP_FALSE",
+    [OP_POP]                            = "OP_POP",
+    [OP_GET_LOCAL]                      = "OP_GET_LOCAL",
+    [OP_GET_LOCAL_0]                    = "OP_GET_LOCAL_0",
+    [OP_GET_LOCAL_1]                    = "OP_GET_LOCAL_1",
+    [OP_GET_LOCAL_2]                    = "OP_GET_LOCAL_2",
+    [OP_GET_LOCAL_3]                    = "OP_GET_LOCAL_3",
+    [OP_SET_LOCAL]                      = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL]                     = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL]                  = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL]                     = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE]                    = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE]                    = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY]                   = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY]                   = "OP_SET_PROPERTY",
+    [OP_GET_SUPER]                      = "OP_GET_SUPER",
+    [OP_BUILD_LIST]                     = "OP_BUILD_LIST",
+    [OP_GET_INDEX]                      = "OP_GET_INDEX",
+    [OP_SET_INDEX]                      = "OP_SET_INDEX",
+    [OP_EQUAL]                          = "OP_EQUAL",
+    [OP_GREATER]                        = "OP_GREATER",
+    [OP_LESS]                           = "OP_LESS",
+    [OP_ADD]                            = "OP_ADD",
+    [OP_SUBTRACT]                       = "OP_SUBTRACT",
+    [OP_MULTIPLY]                       = "OP_MULTIPLY",
+    [OP_DIVIDE]                         = "OP_DIVIDE",
+    [OP_NOT]                            = "OP_NOT",
+    [OP_NEGATE]                         = "OP_NEGATE",
+    [OP_PRINT]                          = "OP_PRINT",
+    [OP_JUMP]                           = "OP_JUMP",
+    [OP_JUMP_IF_FALSE]                  = "OP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_FALSE_POP]              = "OP_JUMP_IF_FALSE_POP",
+    [OP_LOOP]                           = "OP_LOOP",
+    [OP_CALL]                           = "OP_CALL",
+    [OP_TAIL_CALL]                      = "OP_TAIL_CALL",
+    [OP_INVOKE]                         = "OP_INVOKE",
+    [OP_SUPER_INVOKE]                   = "OP_SUPER_INVOKE",
+    [OP_CLOSURE]                        = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE]                  = "OP_CLOSE_UPVALUE",
+    [OP_RETURN]                         = "OP_RETURN",
+    [OP_CLASS]                          = "OP_CLASS",
+    [OP_INHERIT]                        = "OP_INHERIT",
+    [OP_METHOD]                         = "OP_METHOD",
+    [OP_ADD_LOCAL_LOCAL]                = "OP_ADD_LOCAL_LOCAL",
+    [OP_INCREMENT_LOCAL]                = "OP_INCREMENT_LOCAL",
+    [OP_LESS_LOCAL_CONSTANT_JUMP]       = "OP_LESS_LOCAL_CONSTANT_JUMP",
+    [OP_GREATER_LOCAL_CONSTANT_JUMP]    = "OP_GREATER_LOCAL_CONSTANT_JUMP",
+    [OP_GET_METHOD]                     = "OP_GET_METHOD",
+    [OP_CALL_LOCAL]                     = "OP_CALL_LOCAL",
+    [OP_GET_BOUND_METHOD]               = "OP_GET_BOUND_METHOD",
+    [OP_ADD_NUMBER]                     = "OP_ADD_NUMBER",
+    [OP_EQUAL_NUMBER]                   = "OP_EQUAL_NUMBER",
+    [OP_GET_FIELD]                      = "OP_GET_FIELD",
+    [OP_INVOKE_METHOD]                  = "OP_INVOKE_METHOD",
+    [OP_WIDE]                           = "OP_WIDE",
+};
+
+/* Get name of opcode
+*   Arguments:
+*   - uint8_t opcode: to name
+*
+*   Return name like "OP_ADD", "OP_UNKNOWN" for byte that isn't an opcode
+*/
+const char* opcodeName(uint8_t opcode) {
+    return opcode < OP_COUNT && opcodeNames[opcode] != NULL ? opcodeNames[opcode] : "OP_UNKNOWN";
+}
@@ -19,4 +19,12 @@ void disassembleChunk(Chunk* chunk, const char* name);
 */
 int disassembleInstruction(Chunk* chunk, int offset);
 
+/* Get name of opcode
+*   Arguments:
+*   - uint8_t opcode: to name
+*
+*   Return name like "OP_ADD", "OP_UNKNOWN" for byte that isn't an opcode
+*/
+const char* opcodeName(uint8_t opcode);
+
 #endif
\ No newline at end of file
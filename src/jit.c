@@ -0,0 +1,990 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "vm.h"
+
+#ifdef BASELINE_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Machine code keeps interpreter's stack layout: templates load and store the same NaN-boxed values at the same
+slots, so at any instruction boundary execution can move between interpreter and machine code. Instruction the code
+doesn't run, and every guard that fails, exits to the interpreter at the start of the instruction, which executes it
+with all its slow paths, errors and GC. Code never calls out or allocates, so it can't observe anything moving
+*/
+
+/* Branch whose target is known only after all instructions are emitted
+*
+*   Fields:
+*   - uint32_t position: of the branch displacement (x86-64) or of the branch instruction (AArch64) in code
+*   - int target: bytecode offset of the instruction branch goes to
+*   - bool exit: whether branch goes to exit stub of the target instead of its code
+*   - bool conditional: whether branch is conditional, AArch64 encodes it with shorter displacement
+*/
+typedef struct {
+    uint32_t position; // of the branch displacement (x86-64) or of the branch instruction (AArch64) in code
+    int target; // bytecode offset of the instruction branch goes to
+    bool exit; // whether branch goes to exit stub of the target instead of its code
+    bool conditional; // whether branch is conditional, AArch64 encodes it with shorter displacement
+} Fixup;
+
+/* Machine code of function being compiled
+*
+*   Fields:
+*   - Chunk* chunk: compiled bytecode
+*   - uint8_t* code: emitted machine code
+*   - size_t count: of bytes in code
+*   - size_t capacity: of code
+*   - Fixup* fixups: branches to patch once code is emitted
+*   - int fixupCount: number of fixups
+*   - int fixupCapacity: capacity of fixups
+*   - uint32_t* labels: code offset of every instruction, by its bytecode offset
+*   - uint32_t* exits: code offset of exit stub of every instruction, by its bytecode offset
+*   - uint32_t* entries: code offset of every instruction the interpreter can enter, becomes JitCode's entries
+*   - uint32_t epilogue: code offset of the exit shared by all stubs
+*/
+typedef struct {
+    Chunk* chunk; // compiled bytecode
+    uint8_t* code; // emitted machine code
+    size_t count; // of bytes in code
+    size_t capacity; // of code
+    Fixup* fixups; // branches to patch once code is emitted
+    int fixupCount; // number of fixups
+    int fixupCapacity; // capacity of fixups
+    uint32_t* labels; // code offset of every instruction, by its bytecode offset
+    uint32_t* exits; // code offset of exit stub of every instruction, by its bytecode offset
+    uint32_t* entries; // code offset of every instruction the interpreter can enter, becomes JitCode's entries
+    uint32_t epilogue; // code offset of the exit shared by all stubs
+} Assembler;
+
+// Temporaries templates compute in. Guards and comparisons with constants clobber R2, so templates keep values in R0 and R1
+typedef enum {
+    R0,
+    R1,
+    R2
+} Register;
+
+// Comparison of two numbers
+typedef enum {
+    COND_LESS,
+    COND_GREATER,
+    COND_EQUAL
+} Condition;
+
+// Arithmetic operation on two numbers
+typedef enum {
+    ARITH_ADD,
+    ARITH_SUBTRACT,
+    ARITH_MULTIPLY,
+    ARITH_DIVIDE
+} Arithmetic;
+
+/* Append bytes to machine code
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - const uint8_t* bytes: to append
+*   - size_t length: of bytes
+*/
+static void emitBytes(Assembler* a, const uint8_t* bytes, size_t length) {
+    if (a->count + length > a->capacity) {
+        a->capacity = a->capacity < 1024 ? 1024 : a->capacity * 2;
+        a->code = (uint8_t*)realloc(a->code, a->capacity);
+        if (a->code == NULL) exit(1);
+    }
+    memcpy(a->code + a->count, bytes, length);
+    a->count += length;
+}
+
+// Append listed bytes to machine code of assembler a
+#define EMIT(...) emitBytes(a, (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+/* Append little-endian 32 bit word, AArch64 instruction or x86-64 immediate
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - uint32_t word: to append
+*/
+static void emit32(Assembler* a, uint32_t word) {
+    EMIT(word & 0xff, (word >> 8) & 0xff, (word >> 16) & 0xff, word >> 24);
+}
+
+/* Record branch to patch once its target is emitted
+*   Arguments:
+*   - Assembler* a: branch belongs to
+*   - uint32_t position: of the branch, as Fixup expects it
+*   - int target: bytecode offset of the instruction branch goes to
+*   - bool toExit: whether branch goes to exit stub of the target
+*   - bool conditional: whether branch is conditional
+*/
+static void addFixup(Assembler* a, uint32_t position, int target, bool toExit, bool conditional) {
+    if (a->fixupCount == a->fixupCapacity) {
+        a->fixupCapacity = a->fixupCapacity < 64 ? 64 : a->fixupCapacity * 2;
+        a->fixups = (Fixup*)realloc(a->fixups, sizeof(Fixup) * a->fixupCapacity);
+        if (a->fixups == NULL) exit(1);
+    }
+    a->fixups[a->fixupCount++] = (Fixup){position, target, toExit, conditional};
+}
+
+#if defined(__x86_64__)
+
+/* System V x86-64 backend. Callee-saved registers hold the state across the code: rbx frame slots, r12 stack top,
+r13 globals, r14 context and r15 QNAN mask. Registers are R0 = rax, R1 = rcx, R2 = rdx, doubles go through xmm0 and xmm1
+*/
+
+/* Emit branch with 32 bit displacement
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - uint8_t condition: x86 condition code of the jcc, or 0xff for unconditional jmp
+*   - int target: bytecode offset of the instruction branch goes to
+*   - bool toExit: whether branch goes to exit stub of the target
+*/
+static void emitBranch(Assembler* a, uint8_t condition, int target, bool toExit) {
+    if (condition == 0xff) EMIT(0xE9); // jmp rel32
+    else EMIT(0x0F, 0x80 | condition); // jcc rel32
+    addFixup(a, (uint32_t)a->count, target, toExit, condition != 0xff);
+    emit32(a, 0);
+}
+
+/* Point branch at its target
+*   Arguments:
+*   - Assembler* a: branch belongs to
+*   - Fixup* fixup: of the branch
+*   - uint32_t target: code offset of its target
+*/
+static void patchBranch(Assembler* a, Fixup* fixup, uint32_t target) {
+    uint32_t displacement = target - (fixup->position + 4); // Relative to the end of the jump
+    memcpy(a->code + fixup->position, &displacement, sizeof(displacement));
+}
+
+#define X86_E 0x4 // Condition equal
+#define X86_BE 0x6 // Condition below or equal, also taken when comparison is unordered
+#define X86_JMP 0xff // Unconditional jump passed as condition to emitBranch()
+
+/* Emit entry of the code, which loads the context and jumps to the target given by caller
+*   Arguments:
+*   - Assembler* a: to emit into
+*/
+static void emitPrologue(Assembler* a) {
+    EMIT(0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push rbx, r12, r13, r14, r15
+    EMIT(0x49, 0x89, 0xFE); // mov r14, rdi
+    EMIT(0x49, 0x8B, 0x5E, offsetof(JitContext, slots)); // mov rbx, [r14 + slots]
+    EMIT(0x4D, 0x8B, 0x66, offsetof(JitContext, sp)); // mov r12, [r14 + sp]
+    EMIT(0x4D, 0x8B, 0x6E, offsetof(JitContext, globals)); // mov r13, [r14 + globals]
+    EMIT(0x49, 0xBF); // mov r15, QNAN
+    emit32(a, (uint32_t)QNAN);
+    emit32(a, (uint32_t)(QNAN >> 32));
+    EMIT(0xFF, 0xE6); // jmp rsi
+}
+
+/* Emit exit of the code, which writes back stack top and ip held in R0, and returns
+*   Arguments:
+*   - Assembler* a: to emit into
+*/
+static void emitEpilogue(Assembler* a) {
+    EMIT(0x49, 0x89, 0x46, offsetof(JitContext, ip)); // mov [r14 + ip], rax
+    EMIT(0x4D, 0x89, 0x66, offsetof(JitContext, sp)); // mov [r14 + sp], r12
+    EMIT(0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B); // pop r15, r14, r13, r12, rbx
+    EMIT(0xC3); // ret
+}
+
+/* Load 64 bit constant into register
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Register reg: to load
+*   - uint64_t value: to load
+*/
+static void emitLoadImmediate(Assembler* a, Register reg, uint64_t value) {
+    if (value <= UINT32_MAX) { // mov r32, imm32 zero-extends
+        EMIT(0xB8 + reg);
+        emit32(a, (uint32_t)value);
+        return;
+    }
+    EMIT(0x48, 0xB8 + reg); // mov r64, imm64
+    emit32(a, (uint32_t)value);
+    emit32(a, (uint32_t)(value >> 32));
+}
+
+/* Load or store frame slot
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Register reg: to load or store
+*   - int slot: index of the frame slot
+*/
+static void emitLoadSlot(Assembler* a, Register reg, int slot) {
+    EMIT(0x48, 0x8B, 0x83 | reg << 3); // mov reg, [rbx + disp32]
+    emit32(a, (uint32_t)(slot * sizeof(Value)));
+}
+
+static void emitStoreSlot(Assembler* a, Register reg, int slot) {
+    EMIT(0x48, 0x89, 0x83 | reg << 3); // mov [rbx + disp32], reg
+    emit32(a, (uint32_t)(slot * sizeof(Value)));
+}
+
+/* Load or store global variable
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Register reg: to load or store
+*   - int slot: of the global
+*/
+static void emitLoadGlobal(Assembler* a, Register reg, int slot) {
+    EMIT(0x49, 0x8B, 0x85 | reg << 3); // mov reg, [r13 + disp32]
+    emit32(a, (uint32_t)(slot * sizeof(Value)));
+}
+
+static void emitStoreGlobal(Assembler* a, Register reg, int slot) {
+    EMIT(0x49, 0x89, 0x85 | reg << 3); // mov [r13 + disp32], reg
+    emit32(a, (uint32_t)(slot * sizeof(Value)));
+}
+
+/* Load or store stack value
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Register reg: to load or store
+*   - int distance: from the top like PEEK(), -1 is the free slot above it
+*/
+static void emitLoadStack(Assembler* a, Register reg, int distance) {
+    EMIT(0x49, 0x8B, 0x44 | reg << 3, 0x24, (uint8_t)(-8 * (distance + 1))); // mov reg, [r12 + disp8]
+}
+
+static void emitStoreStack(Assembler* a, Register reg, int distance) {
+    EMIT(0x49, 0x89, 0x44 | reg << 3, 0x24, (uint8_t)(-8 * (distance + 1))); // mov [r12 + disp8], reg
+}
+
+/* Move stack top
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - int count: of values pushed, negative for popped ones
+*/
+static void emitAdjustStack(Assembler* a, int count) {
+    EMIT(0x49, 0x83, 0xC4, (uint8_t)(count * 8)); // add r12, imm8
+}
+
+/* Branch when register holds given value
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Register reg: to compare, R0 or R1
+*   - uint64_t value: to compare with, loaded into R2
+*   - int target: bytecode offset of the instruction to branch to
+*   - bool toExit: whether branch goes to exit stub of the target
+*/
+static void emitBranchIfValue(Assembler* a, Register reg, uint64_t value, int target, bool toExit) {
+    emitLoadImmediate(a, R2, value);
+    EMIT(0x48, 0x39, 0xD0 | reg); // cmp reg, rdx
+    emitBranch(a, X86_E, target, toExit);
+}
+
+/* Exit unless register holds number, one with all quiet NaN bits set is something else
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Register reg: to check, R0 or R1
+*   - int offset: of the instruction to exit to
+*/
+static void emitGuardNumber(Assembler* a, Register reg, int offset) {
+    EMIT(0x48, 0x89, 0xC2 | reg << 3); // mov rdx, reg
+    EMIT(0x4C, 0x21, 0xFA); // and rdx, r15
+    EMIT(0x4C, 0x39, 0xFA); // cmp rdx, r15
+    emitBranch(a, X86_E, offset, true);
+}
+
+// Move numbers in R0 and R1 into xmm0 and xmm1
+static void emitMoveToFloat(Assembler* a) {
+    EMIT(0x66, 0x48, 0x0F, 0x6E, 0xC0); // movq xmm0, rax
+    EMIT(0x66, 0x48, 0x0F, 0x6E, 0xC9); // movq xmm1, rcx
+}
+
+/* Compute R0 = R0 operation R1 on numbers
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Arithmetic operation: to compute
+*/
+static void emitArithmetic(Assembler* a, Arithmetic operation) {
+    static const uint8_t opcodes[] = {0x58, 0x5C, 0x59, 0x5E}; // addsd, subsd, mulsd, divsd
+    emitMoveToFloat(a);
+    EMIT(0xF2, 0x0F, opcodes[operation], 0xC1); // op xmm0, xmm1
+    EMIT(0x66, 0x48, 0x0F, 0x7E, 0xC0); // movq rax, xmm0
+}
+
+/* Set flags from comparison of numbers in R0 and R1, so that "above" holds when it's true
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Condition condition: to compare, COND_LESS or COND_GREATER
+*/
+static void emitCompareFlags(Assembler* a, Condition condition) {
+    emitMoveToFloat(a);
+    if (condition == COND_LESS) EMIT(0x66, 0x0F, 0x2E, 0xC8); // ucomisd xmm1, xmm0
+    else EMIT(0x66, 0x0F, 0x2E, 0xC1); // ucomisd xmm0, xmm1
+}
+
+// Turn 0 or 1 in al into boolean value in R0
+static void emitBoolean(Assembler* a) {
+    EMIT(0x0F, 0xB6, 0xC0); // movzx eax, al
+    emitLoadImmediate(a, R1, FALSE_VAL);
+    EMIT(0x48, 0x09, 0xC8); // or rax, rcx
+}
+
+/* Compute R0 = boolean value of comparison of numbers R0 and R1
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Condition condition: to compute
+*/
+static void emitCompare(Assembler* a, Condition condition) {
+    if (condition == COND_EQUAL) {
+        emitMoveToFloat(a);
+        EMIT(0x66, 0x0F, 0x2E, 0xC1); // ucomisd xmm0, xmm1
+        EMIT(0x0F, 0x94, 0xC0); // sete al
+        EMIT(0x0F, 0x9B, 0xC1); // setnp cl, NaN isn't equal to itself
+        EMIT(0x20, 0xC8); // and al, cl
+    } else {
+        emitCompareFlags(a, condition);
+        EMIT(0x0F, 0x97, 0xC0); // seta al
+    }
+    emitBoolean(a);
+}
+
+/* Branch unless comparison of numbers R0 and R1 holds
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Condition condition: to compare, COND_LESS or COND_GREATER
+*   - int target: bytecode offset of the instruction to branch to
+*/
+static void emitBranchUnless(Assembler* a, Condition condition, int target) {
+    emitCompareFlags(a, condition);
+    emitBranch(a, X86_BE, target, false);
+}
+
+// Negate number in R0
+static void emitNegate(Assembler* a) {
+    EMIT(0x48, 0x0F, 0xBA, 0xF8, 0x3F); // btc rax, 63
+}
+
+// Replace R0 with boolean value of whether it's falsey
+static void emitNot(Assembler* a) {
+    emitLoadImmediate(a, R2, NIL_VAL);
+    EMIT(0x48, 0x39, 0xD0); // cmp rax, rdx
+    EMIT(0x0F, 0x94, 0xC1); // sete cl
+    EMIT(0x48, 0xFF, 0xC2); // inc rdx, FALSE_VAL follows NIL_VAL
+    EMIT(0x48, 0x39, 0xD0); // cmp rax, rdx
+    EMIT(0x0F, 0x94, 0xC0); // sete al
+    EMIT(0x08, 0xC8); // or al, cl
+    emitBoolean(a);
+}
+
+/* Jump to instruction
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - int target: bytecode offset of the instruction
+*/
+static void emitJump(Assembler* a, int target) {
+    emitBranch(a, X86_JMP, target, false);
+}
+
+/* Emit exit stub, which leaves the code to the interpreter
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - uint8_t* ip: instruction the interpreter continues with
+*/
+static void emitExit(Assembler* a, uint8_t* ip) {
+    emitLoadImmediate(a, R0, (uint64_t)(uintptr_t)ip);
+    EMIT(0xE9); // jmp epilogue
+    emit32(a, a->epilogue - (uint32_t)(a->count + 4));
+}
+
+#elif defined(__aarch64__)
+
+/* AArch64 backend. Callee-saved registers hold the state across the code: x19 frame slots, x20 stack top, x21 globals,
+x22 QNAN mask and x23 context. Registers are R0 = x0, R1 = x1, R2 = x2, x9 is scratch, doubles go through d0 and d1
+*/
+
+#define A64_EQ 0x0 // Condition equal
+#define A64_NE 0x1 // Condition not equal
+#define A64_MI 0x4 // Condition negative, less than for floating point, false when unordered
+#define A64_PL 0x5 // Condition positive or zero, not less than for floating point
+#define A64_GT 0xC // Condition greater than, false when unordered
+#define A64_LE 0xD // Condition less than or equal, not greater than for floating point
+#define A64_ALWAYS 0xff // Unconditional branch passed as condition to emitBranch()
+#define A64_SCRATCH 9 // x9
+#define A64_XZR 31 // Zero register, or sp as base of loads and stores
+
+/* Emit branch with 26 bit displacement, or 19 bit one when conditional
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - uint8_t condition: AArch64 condition code of the b.cond, or A64_ALWAYS for b
+*   - int target: bytecode offset of the instruction branch goes to
+*   - bool toExit: whether branch goes to exit stub of the target
+*/
+static void emitBranch(Assembler* a, uint8_t condition, int target, bool toExit) {
+    addFixup(a, (uint32_t)a->count, target, toExit, condition != A64_ALWAYS);
+    emit32(a, condition == A64_ALWAYS ? 0x14000000 : 0x54000000 | condition); // b or b.cond
+}
+
+/* Point branch at its target
+*   Arguments:
+*   - Assembler* a: branch belongs to
+*   - Fixup* fixup: of the branch
+*   - uint32_t target: code offset of its target
+*/
+static void patchBranch(Assembler* a, Fixup* fixup, uint32_t target) {
+    uint32_t instruction;
+    memcpy(&instruction, a->code + fixup->position, sizeof(instruction));
+    uint32_t displacement = (target - fixup->position) / 4; // In instructions, relative to the branch
+    if (fixup->conditional) instruction |= (displacement & 0x7FFFF) << 5;
+    else instruction |= displacement & 0x3FFFFFF;
+    memcpy(a->code + fixup->position, &instruction, sizeof(instruction));
+}
+
+/* Load 64 bit constant into register, with movz and movk of every non-zero half-word
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - int reg: number of the register
+*   - uint64_t value: to load
+*/
+static void emitLoadImmediateTo(Assembler* a, int reg, uint64_t value) {
+    emit32(a, 0xD2800000 | (uint32_t)(value & 0xFFFF) << 5 | reg); // movz reg, #imm16
+    for (int shift = 1; shift < 4; shift++) {
+        uint32_t part = (value >> (16 * shift)) & 0xFFFF;
+        if (part != 0) emit32(a, 0xF2800000 | shift << 21 | part << 5 | reg); // movk reg, #imm16, lsl #(16 * shift)
+    }
+}
+
+// Load 64 bit constant into temporary register
+static void emitLoadImmediate(Assembler* a, Register reg, uint64_t value) {
+    emitLoadImmediateTo(a, reg, value);
+}
+
+/* Load or store 64 bit register at scaled unsigned offset from base
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - bool load: whether it's ldr rather than str
+*   - int reg: number of the register
+*   - int base: number of base register
+*   - size_t offset: in bytes, multiple of 8
+*/
+static void emitMemory(Assembler* a, bool load, int reg, int base, size_t offset) {
+    emit32(a, (load ? 0xF9400000 : 0xF9000000) | (uint32_t)(offset / 8) << 10 | base << 5 | reg); // ldr/str reg, [base, #offset]
+}
+
+/* Emit entry of the code, which loads the context and jumps to the target given by caller
+*   Arguments:
+*   - Assembler* a: to emit into
+*/
+static void emitPrologue(Assembler* a) {
+    emit32(a, 0xA9BC7BFD); // stp x29, x30, [sp, #-64]!
+    emit32(a, 0x910003FD); // mov x29, sp
+    emit32(a, 0xA90153F3); // stp x19, x20, [sp, #16]
+    emit32(a, 0xA9025BF5); // stp x21, x22, [sp, #32]
+    emitMemory(a, false, 23, A64_XZR, 48); // str x23, [sp, #48]
+    emit32(a, 0xAA0003F7); // mov x23, x0
+    emitMemory(a, true, 19, 23, offsetof(JitContext, slots)); // ldr x19, [x23, #slots]
+    emitMemory(a, true, 20, 23, offsetof(JitContext, sp)); // ldr x20, [x23, #sp]
+    emitMemory(a, true, 21, 23, offsetof(JitContext, globals)); // ldr x21, [x23, #globals]
+    emitLoadImmediateTo(a, 22, QNAN); // mov x22, QNAN
+    emit32(a, 0xD61F0020); // br x1
+}
+
+/* Emit exit of the code, which writes back stack top and ip held in R0, and returns
+*   Arguments:
+*   - Assembler* a: to emit into
+*/
+static void emitEpilogue(Assembler* a) {
+    emitMemory(a, false, 0, 23, offsetof(JitContext, ip)); // str x0, [x23, #ip]
+    emitMemory(a, false, 20, 23, offsetof(JitContext, sp)); // str x20, [x23, #sp]
+    emitMemory(a, true, 23, A64_XZR, 48); // ldr x23, [sp, #48]
+    emit32(a, 0xA9425BF5); // ldp x21, x22, [sp, #32]
+    emit32(a, 0xA94153F3); // ldp x19, x20, [sp, #16]
+    emit32(a, 0xA8C47BFD); // ldp x29, x30, [sp], #64
+    emit32(a, 0xD65F03C0); // ret
+}
+
+/* Load or store frame slot
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Register reg: to load or store
+*   - int slot: index of the frame slot, below 4096
+*/
+static void emitLoadSlot(Assembler* a, Register reg, int slot) {
+    emitMemory(a, true, reg, 19, slot * sizeof(Value)); // ldr reg, [x19, #slot * 8]
+}
+
+static void emitStoreSlot(Assembler* a, Register reg, int slot) {
+    emitMemory(a, false, reg, 19, slot * sizeof(Value)); // str reg, [x19, #slot * 8]
+}
+
+/* Load or store global variable
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Register reg: to load or store
+*   - int slot: of the global
+*/
+static void emitLoadGlobal(Assembler* a, Register reg, int slot) {
+    emitLoadImmediateTo(a, A64_SCRATCH, slot);
+    emit32(a, 0xF8607800 | A64_SCRATCH << 16 | 21 << 5 | reg); // ldr reg, [x21, x9, lsl #3]
+}
+
+static void emitStoreGlobal(Assembler* a, Register reg, int slot) {
+    emitLoadImmediateTo(a, A64_SCRATCH, slot);
+    emit32(a, 0xF8207800 | A64_SCRATCH << 16 | 21 << 5 | reg); // str reg, [x21, x9, lsl #3]
+}
+
+/* Load or store stack value
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Register reg: to load or store
+*   - int distance: from the top like PEEK(), -1 is the free slot above it
+*/
+static void emitLoadStack(Assembler* a, Register reg, int distance) {
+    uint32_t offset = (uint32_t)(-8 * (distance + 1)) & 0x1FF;
+    emit32(a, 0xF8400000 | offset << 12 | 20 << 5 | reg); // ldur reg, [x20, #offset]
+}
+
+static void emitStoreStack(Assembler* a, Register reg, int distance) {
+    uint32_t offset = (uint32_t)(-8 * (distance + 1)) & 0x1FF;
+    emit32(a, 0xF8000000 | offset << 12 | 20 << 5 | reg); // stur reg, [x20, #offset]
+}
+
+/* Move stack top
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - int count: of values pushed, negative for popped ones
+*/
+static void emitAdjustStack(Assembler* a, int count) {
+    uint32_t bytes = (uint32_t)(count < 0 ? -count : count) * 8;
+    emit32(a, (count < 0 ? 0xD1000000 : 0x91000000) | bytes << 10 | 20 << 5 | 20); // sub/add x20, x20, #bytes
+}
+
+/* Compare register with another register
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - int reg: number of the first register
+*   - int other: number of the other register
+*/
+static void emitCompareRegisters(Assembler* a, int reg, int other) {
+    emit32(a, 0xEB00001F | other << 16 | reg << 5); // cmp reg, other
+}
+
+/* Branch when register holds given value
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Register reg: to compare
+*   - uint64_t value: to compare with, loaded into scratch register
+*   - int target: bytecode offset of the instruction to branch to
+*   - bool toExit: whether branch goes to exit stub of the target
+*/
+static void emitBranchIfValue(Assembler* a, Register reg, uint64_t value, int target, bool toExit) {
+    emitLoadImmediateTo(a, A64_SCRATCH, value);
+    emitCompareRegisters(a, reg, A64_SCRATCH);
+    emitBranch(a, A64_EQ, target, toExit);
+}
+
+/* Exit unless register holds number, one with all quiet NaN bits set is something else
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Register reg: to check
+*   - int offset: of the instruction to exit to
+*/
+static void emitGuardNumber(Assembler* a, Register reg, int offset) {
+    emit32(a, 0x8A000000 | 22 << 16 | reg << 5 | A64_SCRATCH); // and x9, reg, x22
+    emitCompareRegisters(a, A64_SCRATCH, 22);
+    emitBranch(a, A64_EQ, offset, true);
+}
+
+// Move numbers in R0 and R1 into d0 and d1
+static void emitMoveToFloat(Assembler* a) {
+    emit32(a, 0x9E670000); // fmov d0, x0
+    emit32(a, 0x9E670021); // fmov d1, x1
+}
+
+/* Compute R0 = R0 operation R1 on numbers
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Arithmetic operation: to compute
+*/
+static void emitArithmetic(Assembler* a, Arithmetic operation) {
+    static const uint32_t instructions[] = {0x1E612800, 0x1E613800, 0x1E610800, 0x1E611800}; // fadd, fsub, fmul, fdiv
+    emitMoveToFloat(a);
+    emit32(a, instructions[operation]); // op d0, d0, d1
+    emit32(a, 0x9E660000); // fmov x0, d0
+}
+
+// AArch64 condition of comparison on floating point flags, false when comparison is unordered
+static uint32_t conditionCode(Condition condition) {
+    switch (condition) {
+        case COND_LESS: return A64_MI;
+        case COND_GREATER: return A64_GT;
+        default: return A64_EQ;
+    }
+}
+
+/* Compute R0 = boolean value of comparison of numbers R0 and R1
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Condition condition: to compute
+*/
+static void emitCompare(Assembler* a, Condition condition) {
+    emitMoveToFloat(a);
+    emit32(a, 0x1E612000); // fcmp d0, d1
+    emit32(a, 0x9A9F07E0 | (conditionCode(condition) ^ 1) << 12); // cset x0, condition
+    emitLoadImmediateTo(a, A64_SCRATCH, FALSE_VAL);
+    emit32(a, 0xAA090000); // orr x0, x0, x9
+}
+
+/* Branch unless comparison of numbers R0 and R1 holds
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - Condition condition: to compare, COND_LESS or COND_GREATER
+*   - int target: bytecode offset of the instruction to branch to
+*/
+static void emitBranchUnless(Assembler* a, Condition condition, int target) {
+    emitMoveToFloat(a);
+    emit32(a, 0x1E612000); // fcmp d0, d1
+    emitBranch(a, conditionCode(condition) ^ 1, target, false); // Inverted conditions hold when unordered too
+}
+
+// Negate number in R0
+static void emitNegate(Assembler* a) {
+    emit32(a, 0xD2410000); // eor x0, x0, #0x8000000000000000
+}
+
+// Replace R0 with boolean value of whether it's falsey
+static void emitNot(Assembler* a) {
+    emitLoadImmediateTo(a, A64_SCRATCH, NIL_VAL);
+    emitCompareRegisters(a, R0, A64_SCRATCH);
+    emit32(a, 0x9A9F07E0 | A64_NE << 12 | R1); // cset x1, eq
+    emit32(a, 0x91000529); // add x9, x9, #1, FALSE_VAL follows NIL_VAL
+    emitCompareRegisters(a, R0, A64_SCRATCH);
+    emit32(a, 0x9A9F07E0 | A64_NE << 12 | R2); // cset x2, eq
+    emit32(a, 0xAA020021); // orr x1, x1, x2
+    emitLoadImmediateTo(a, A64_SCRATCH, FALSE_VAL);
+    emit32(a, 0xAA090020); // orr x0, x1, x9
+}
+
+/* Jump to instruction
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - int target: bytecode offset of the instruction
+*/
+static void emitJump(Assembler* a, int target) {
+    emitBranch(a, A64_ALWAYS, target, false);
+}
+
+/* Emit exit stub, which leaves the code to the interpreter
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - uint8_t* ip: instruction the interpreter continues with
+*/
+static void emitExit(Assembler* a, uint8_t* ip) {
+    emitLoadImmediateTo(a, R0, (uint64_t)(uintptr_t)ip);
+    emit32(a, 0x14000000 | ((a->epilogue - (uint32_t)a->count) / 4 & 0x3FFFFFF)); // b epilogue
+}
+
+#endif
+
+/* Length of instruction including its operands, OP_WIDE prefix included
+*   Arguments:
+*   - Chunk* chunk: holding the instruction
+*   - int offset: of the instruction
+*
+*   Return number of bytes
+*/
+static int instructionLength(Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code + offset;
+    bool wide = code[0] == OP_WIDE;
+    uint8_t op = wide ? code[1] : code[0];
+    int prefix = wide ? 2 : 1; // Opcode, with OP_WIDE before it
+    int index = wide ? 2 : 1; // Widened index takes one more byte
+
+    switch (op) {
+        case OP_CLOSURE: { // Function constant followed by isLocal/index pair for every upvalue
+            int constant = wide ? (code[2] << 8) | code[3] : code[1];
+            int upvalueCount = AS_FUNCTION(chunk->constants.values[constant])->upvalueCount;
+            return prefix + index + upvalueCount * (index + 1);
+        }
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_BUILD_LIST:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            return prefix + index;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_LOOP:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SUPER_INVOKE:
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_INCREMENT_LOCAL:
+        case OP_CALL_LOCAL:
+            return prefix + index + 1;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_METHOD:
+        case OP_GET_BOUND_METHOD:
+        case OP_GET_FIELD:
+            return prefix + index + 2;
+        case OP_INVOKE:
+        case OP_INVOKE_METHOD:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+        case OP_GREATER_LOCAL_CONSTANT_JUMP:
+            return prefix + index + 3;
+        default:
+            return prefix;
+    }
+}
+
+/* Load two topmost stack values into R0 (the lower one) and R1, exiting unless both are numbers
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - int offset: of the instruction to exit to
+*/
+static void emitNumberOperands(Assembler* a, int offset) {
+    emitLoadStack(a, R0, 1);
+    emitLoadStack(a, R1, 0);
+    emitGuardNumber(a, R0, offset);
+    emitGuardNumber(a, R1, offset);
+}
+
+/* Replace two topmost stack values with R0
+*   Arguments:
+*   - Assembler* a: to emit into
+*/
+static void emitReplaceOperands(Assembler* a) {
+    emitAdjustStack(a, -1);
+    emitStoreStack(a, R0, 0);
+}
+
+// Push R0 onto the stack
+static void emitPush(Assembler* a) {
+    emitStoreStack(a, R0, -1);
+    emitAdjustStack(a, 1);
+}
+
+/* Emit machine code of instruction
+*   Arguments:
+*   - Assembler* a: to emit into
+*   - int offset: of the instruction
+*   - int length: of the instruction
+*
+*   Return whether instruction was emitted, false when only the interpreter runs it
+*/
+static bool emitInstruction(Assembler* a, int offset, int length) {
+    uint8_t* code = a->chunk->code + offset;
+    Value* constants = a->chunk->constants.values;
+    int operand = length >= 3 ? (code[1] << 8) | code[2] : 0; // Two bytes operand following opcode, for instructions that have it
+
+    switch (code[0]) {
+        case OP_CONSTANT: emitLoadImmediate(a, R0, constants[code[1]]); emitPush(a); return true;
+        case OP_NIL: emitLoadImmediate(a, R0, NIL_VAL); emitPush(a); return true;
+        case OP_TRUE: emitLoadImmediate(a, R0, TRUE_VAL); emitPush(a); return true;
+        case OP_FALSE: emitLoadImmediate(a, R0, FALSE_VAL); emitPush(a); return true;
+        case OP_POP: emitAdjustStack(a, -1); return true;
+        case OP_GET_LOCAL: emitLoadSlot(a, R0, code[1]); emitPush(a); return true;
+        case OP_GET_LOCAL_0:
+        case OP_GET_LOCAL_1:
+        case OP_GET_LOCAL_2:
+        case OP_GET_LOCAL_3:
+            emitLoadSlot(a, R0, code[0] - OP_GET_LOCAL_0);
+            emitPush(a);
+            return true;
+        case OP_SET_LOCAL: emitLoadStack(a, R0, 0); emitStoreSlot(a, R0, code[1]); return true;
+        case OP_GET_GLOBAL: // Undefined global is reported by the interpreter
+            emitLoadGlobal(a, R0, operand);
+            emitBranchIfValue(a, R0, UNDEFINED_VAL, offset, true);
+            emitPush(a);
+            return true;
+        case OP_DEFINE_GLOBAL:
+            emitLoadStack(a, R0, 0);
+            emitStoreGlobal(a, R0, operand);
+            emitAdjustStack(a, -1);
+            return true;
+        case OP_SET_GLOBAL:
+            emitLoadGlobal(a, R0, operand);
+            emitBranchIfValue(a, R0, UNDEFINED_VAL, offset, true);
+            emitLoadStack(a, R0, 0);
+            emitStoreGlobal(a, R0, operand);
+            return true;
+        case OP_EQUAL: // Only numbers are compared here, other values need valuesEqual()
+        case OP_EQUAL_NUMBER:
+            emitNumberOperands(a, offset);
+            emitCompare(a, COND_EQUAL);
+            emitReplaceOperands(a);
+            return true;
+        case OP_GREATER:
+        case OP_LESS:
+            emitNumberOperands(a, offset);
+            emitCompare(a, code[0] == OP_LESS ? COND_LESS : COND_GREATER);
+            emitReplaceOperands(a);
+            return true;
+        case OP_ADD: // Strings are concatenated by the interpreter
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            Arithmetic operation = code[0] == OP_SUBTRACT ? ARITH_SUBTRACT : code[0] == OP_MULTIPLY ? ARITH_MULTIPLY :
+                code[0] == OP_DIVIDE ? ARITH_DIVIDE : ARITH_ADD;
+            emitNumberOperands(a, offset);
+            emitArithmetic(a, operation);
+            emitReplaceOperands(a);
+            return true;
+        }
+        case OP_NOT: emitLoadStack(a, R0, 0); emitNot(a); emitStoreStack(a, R0, 0); return true;
+        case OP_NEGATE:
+            emitLoadStack(a, R0, 0);
+            emitGuardNumber(a, R0, offset);
+            emitNegate(a);
+            emitStoreStack(a, R0, 0);
+            return true;
+        case OP_JUMP: emitJump(a, offset + 3 + operand); return true;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_POP:
+            emitLoadStack(a, R0, 0);
+            if (code[0] == OP_JUMP_IF_FALSE_POP) emitAdjustStack(a, -1);
+            emitBranchIfValue(a, R0, NIL_VAL, offset + 3 + operand, false);
+            emitBranchIfValue(a, R0, FALSE_VAL, offset + 3 + operand, false);
+            return true;
+        case OP_LOOP: emitJump(a, offset + 3 - operand); return true;
+        case OP_ADD_LOCAL_LOCAL:
+            emitLoadSlot(a, R0, code[1]);
+            emitLoadSlot(a, R1, code[2]);
+            emitGuardNumber(a, R0, offset);
+            emitGuardNumber(a, R1, offset);
+            emitArithmetic(a, ARITH_ADD);
+            emitPush(a);
+            return true;
+        case OP_INCREMENT_LOCAL: // Compiler fuses only number constants
+            emitLoadSlot(a, R0, code[1]);
+            emitGuardNumber(a, R0, offset);
+            emitLoadImmediate(a, R1, constants[code[2]]);
+            emitArithmetic(a, ARITH_ADD);
+            emitStoreSlot(a, R0, code[1]);
+            return true;
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+        case OP_GREATER_LOCAL_CONSTANT_JUMP:
+            emitLoadSlot(a, R0, code[1]);
+            emitGuardNumber(a, R0, offset);
+            emitLoadImmediate(a, R1, constants[code[2]]);
+            emitBranchUnless(a, code[0] == OP_LESS_LOCAL_CONSTANT_JUMP ? COND_LESS : COND_GREATER,
+                offset + 5 + ((code[3] << 8) | code[4]));
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Copy finished code into executable memory
+*   Arguments:
+*   - Assembler* a: holding the code
+*
+*   Return machine code of the function, NULL when memory can't be mapped or made executable
+*/
+static JitCode* installCode(Assembler* a) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (a->count + page - 1) / page * page;
+    // Mapping is never writable and executable at once, systems enforcing W^X allow that
+    uint8_t* memory = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+    memcpy(memory, a->code, a->count);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return NULL;
+    }
+    __builtin___clear_cache((char*)memory, (char*)memory + a->count); // AArch64 doesn't keep instruction cache coherent
+
+    JitCode* code = (JitCode*)malloc(sizeof(JitCode));
+    if (code == NULL) exit(1);
+    code->memory = memory;
+    code->size = size;
+    code->bytecode = a->chunk->code;
+    code->entries = a->entries;
+    a->entries = NULL; // Owned by the code now
+    return code;
+}
+
+/* Compile function to machine code, leaving it interpreted when it has nothing to compile or memory can't be made executable.
+*   Function is compiled once, its hotness stops being counted whatever the result was
+*   Arguments:
+*   - ObjFunction* function: to compile
+*/
+void compileJit(ObjFunction* function) {
+    function->hotness = -1;
+    Chunk* chunk = &function->chunk;
+    // Memory is malloc'd rather than taken from the GC heap, so compiling in the middle of run() can't start a collection
+    Assembler a = {chunk, NULL, 0, 0, NULL, 0, 0, NULL, NULL, NULL, 0};
+    a.labels = (uint32_t*)malloc(sizeof(uint32_t) * chunk->count * 2);
+    a.entries = (uint32_t*)malloc(sizeof(uint32_t) * chunk->count);
+    if (a.labels == NULL || a.entries == NULL) exit(1);
+    a.exits = a.labels + chunk->count;
+    memset(a.labels, 0xff, sizeof(uint32_t) * chunk->count * 2); // Every byte is JIT_NO_ENTRY until it's emitted
+    memset(a.entries, 0xff, sizeof(uint32_t) * chunk->count);
+
+    emitPrologue(&a);
+    a.epilogue = (uint32_t)a.count;
+    emitEpilogue(&a);
+    int recent[JIT_MIN_RUN]; // Entries of the last instructions that run as machine code, which could exit too soon
+    int recentCount = 0;
+    for (int offset = 0, length; offset < chunk->count; offset += length) {
+        length = instructionLength(chunk, offset);
+        a.labels[offset] = (uint32_t)a.count;
+        if (emitInstruction(&a, offset, length)) {
+            a.entries[offset] = a.labels[offset];
+            if (chunk->code[offset] == OP_LOOP) { // Loop runs its body again, that's long enough from anywhere before
+                recentCount = 0;
+            } else {
+                if (recentCount == JIT_MIN_RUN - 1) memmove(recent, recent + 1, sizeof(int) * --recentCount);
+                recent[recentCount++] = offset;
+            }
+        } else { // Code reaching the instruction, by falling through or jumping, leaves it to the interpreter
+            while (recentCount > 0) a.entries[recent[--recentCount]] = JIT_NO_ENTRY;
+            a.exits[offset] = a.labels[offset];
+            emitExit(&a, chunk->code + offset);
+        }
+    }
+    bool compiled = false; // Whether interpreter can enter the code anywhere
+    for (int offset = 0; offset < chunk->count && !compiled; offset++) compiled = a.entries[offset] != JIT_NO_ENTRY;
+
+    // Exit stubs of guards go after all instructions, off the path that runs when guards hold
+    bool valid = true;
+    for (int i = 0; i < a.fixupCount && valid; i++) {
+        Fixup* fixup = &a.fixups[i];
+        if (fixup->target < 0 || fixup->target >= chunk->count) {
+            valid = false;
+            break;
+        }
+        if (fixup->exit && a.exits[fixup->target] == JIT_NO_ENTRY) {
+            a.exits[fixup->target] = (uint32_t)a.count;
+            emitExit(&a, chunk->code + fixup->target);
+        }
+        uint32_t target = fixup->exit ? a.exits[fixup->target] : a.labels[fixup->target];
+        valid = target != JIT_NO_ENTRY; // Jumps land on instruction starts, anything else is bytecode this can't follow
+        patchBranch(&a, fixup, target);
+    }
+
+    if (valid && compiled && a.count <= JIT_CODE_MAX) {
+        function->jit = installCode(&a);
+        if (function->jit == NULL) vm.jitEnabled = false; // Platform forbids executable memory, don't try again
+    }
+    free(a.code);
+    free(a.fixups);
+    free(a.labels);
+    free(a.entries);
+}
+
+/* Free machine code of function
+*   Arguments:
+*   - JitCode* code: to free, can be NULL
+*/
+void freeJit(JitCode* code) {
+    if (code == NULL) return;
+    munmap(code->memory, code->size);
+    free(code->entries);
+    free(code);
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000 // Calls and loop iterations after which function is compiled, build with -DJIT_THRESHOLD=N to change it
+#endif
+#define JIT_CODE_MAX (1024 * 1024) // Bytes of machine code function can compile to, AArch64 conditional branches reach this far
+#define JIT_MIN_RUN 8 // Instructions code has to run before it exits for the interpreter to enter it, shorter runs cost more than they save
+#define JIT_NO_ENTRY UINT32_MAX // Entry of bytecode offset machine code can't start at, inside instruction or at one it doesn't run
+
+/* State machine code runs with, passed by the interpreter and written back on exit
+*
+*   Fields:
+*   - Value* slots: frame slots of the executed function
+*   - Value* sp: stack top, updated on exit
+*   - Value* globals: values of global variables
+*   - uint8_t* ip: where machine code started, on exit instruction the interpreter continues with
+*/
+typedef struct {
+    Value* slots; // frame slots of the executed function
+    Value* sp; // stack top, updated on exit
+    Value* globals; // values of global variables
+    uint8_t* ip; // where machine code started, on exit instruction the interpreter continues with
+} JitContext;
+
+// Machine code entry, jumping to target after it loaded the context into registers
+typedef void (*JitEntry)(JitContext* context, const uint8_t* target);
+
+/* Function compiled to machine code
+*
+*   Fields:
+*   - uint8_t* memory: executable mapping holding the code, starting with its JitEntry
+*   - size_t size: of the mapping
+*   - uint8_t* bytecode: chunk code the function was compiled from
+*   - uint32_t* entries: offset into memory of every bytecode offset, JIT_NO_ENTRY where code can't start
+*/
+struct JitCode {
+    uint8_t* memory; // executable mapping holding the code, starting with its JitEntry
+    size_t size; // of the mapping
+    uint8_t* bytecode; // chunk code the function was compiled from
+    uint32_t* entries; // offset into memory of every bytecode offset, JIT_NO_ENTRY where code can't start
+};
+
+/* Compile function to machine code, leaving it interpreted when it has nothing to compile or memory can't be made executable.
+*   Function is compiled once, its hotness stops being counted whatever the result was
+*   Arguments:
+*   - ObjFunction* function: to compile
+*/
+void compileJit(ObjFunction* function);
+
+/* Free machine code of function
+*   Arguments:
+*   - JitCode* code: to free, can be NULL
+*/
+void freeJit(JitCode* code);
+
+/* Find where machine code of instruction starts
+*   Arguments:
+*   - JitCode* code: of the executed function
+*   - uint8_t* ip: instruction next to execute
+*
+*   Return offset of the instruction's code, JIT_NO_ENTRY when code can't start there
+*/
+static inline uint32_t jitEntry(JitCode* code, uint8_t* ip) {
+    return code->entries[ip - code->bytecode];
+}
+
+/* Run machine code from entry, until it reaches instruction it doesn't run
+*   Arguments:
+*   - JitCode* code: of the executed function
+*   - JitContext* context: to run with, its ip is the instruction of the entry
+*   - uint32_t entry: returned by jitEntry() for context's ip
+*/
+static inline void enterJit(JitCode* code, JitContext* context, uint32_t entry) {
+    ((JitEntry)(void*)code->memory)(context, code->memory + entry);
+}
+
+#endif
@@ -0,0 +1,206 @@
+#include <stdlib.h>
+
+#include "list.h"
+#include "memory.h"
+#include "native.h"
+#include "object.h"
+#include "vm.h"
+
+/* NaN boxing stores numbers as their own bits, so elements of list of numbers form an array of doubles
+that is loaded into vector registers as it is
+*/
+#if defined(NAN_BOXING) && defined(__SSE2__) && !defined(NO_SIMD)
+    #include <emmintrin.h>
+    #define LIST_SSE2
+#elif defined(NAN_BOXING) && defined(__ARM_NEON) && defined(__aarch64__) && !defined(NO_SIMD)
+    #include <arm_neon.h>
+    #define LIST_NEON
+#endif
+
+/* Check if every element of list is a number
+*   Arguments:
+*   - ObjList* list: to check
+*
+*   Return whether elements can be treated as doubles
+*/
+static bool allNumbers(ObjList* list) {
+    for (int i = 0; i < list->items.count; i++) {
+        if (!IS_NUMBER(list->items.values[i])) return false;
+    }
+    return true;
+}
+
+/* Add up numbers in four interleaved lanes, so vector and scalar builds round the same way
+*   Arguments:
+*   - const Value* values: numbers to add
+*   - int count: of values
+*
+*   Return sum of values
+*/
+static double sumNumbers(const Value* values, int count) {
+    int i = 0;
+    double total;
+#if defined(LIST_SSE2)
+    __m128d low = _mm_setzero_pd(); // Lanes 0 and 1
+    __m128d high = _mm_setzero_pd(); // Lanes 2 and 3
+    for (; i + 4 <= count; i += 4) {
+        low = _mm_add_pd(low, _mm_loadu_pd((const double*)&values[i]));
+        high = _mm_add_pd(high, _mm_loadu_pd((const double*)&values[i + 2]));
+    }
+    __m128d lanes = _mm_add_pd(low, high);
+    total = _mm_cvtsd_f64(_mm_add_sd(lanes, _mm_unpackhi_pd(lanes, lanes)));
+#elif defined(LIST_NEON)
+    float64x2_t low = vdupq_n_f64(0); // Lanes 0 and 1
+    float64x2_t high = vdupq_n_f64(0); // Lanes 2 and 3
+    for (; i + 4 <= count; i += 4) {
+        low = vaddq_f64(low, vld1q_f64((const double*)&values[i]));
+        high = vaddq_f64(high, vld1q_f64((const double*)&values[i + 2]));
+    }
+    float64x2_t lanes = vaddq_f64(low, high);
+    total = vgetq_lane_f64(lanes, 0) + vgetq_lane_f64(lanes, 1);
+#else
+    double lanes[4] = {0, 0, 0, 0};
+    for (; i + 4 <= count; i += 4) {
+        for (int lane = 0; lane < 4; lane++) {
+            lanes[lane] += AS_NUMBER(values[i + lane]);
+        }
+    }
+    total = (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+#endif
+    for (; i < count; i++) { // Elements past the last full group of four
+        total += AS_NUMBER(values[i]);
+    }
+    return total;
+}
+
+/* Multiply numbers in place
+*   Arguments:
+*   - Value* values: numbers to multiply
+*   - int count: of values
+*   - double factor: to multiply by
+*/
+static void scaleNumbers(Value* values, int count, double factor) {
+    int i = 0;
+#if defined(LIST_SSE2)
+    __m128d factors = _mm_set1_pd(factor);
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd((double*)&values[i], _mm_mul_pd(_mm_loadu_pd((const double*)&values[i]), factors));
+    }
+#elif defined(LIST_NEON)
+    float64x2_t factors = vdupq_n_f64(factor);
+    for (; i + 2 <= count; i += 2) {
+        vst1q_f64((double*)&values[i], vmulq_f64(vld1q_f64((const double*)&values[i]), factors));
+    }
+#endif
+    for (; i < count; i++) {
+        values[i] = NUMBER_VAL(AS_NUMBER(values[i]) * factor);
+    }
+}
+
+/* Compare two number values for qsort
+*   Arguments:
+*   - const void* a: pointer to the first value
+*   - const void* b: pointer to the second value
+*
+*   Return negative, zero or positive number as a is less than, equal to or greater than b
+*/
+static int compareNumbers(const void* a, const void* b) {
+    double x = AS_NUMBER(*(const Value*)a);
+    double y = AS_NUMBER(*(const Value*)b);
+    return (x > y) - (x < y);
+}
+
+/* Native function - Get number of elements of list or characters of string
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: list or string
+*
+*   Return length as number
+*/
+Value lenNative(int argCount, Value* args) {
+    if (IS_LIST(args[0])) return NUMBER_VAL(AS_LIST(args[0])->items.count);
+    if (isString(args[0])) return NUMBER_VAL(stringLength(AS_OBJ(args[0])));
+    return nativeError("len() expects a list or a string.");
+}
+
+/* Native function - Add element at the end of list
+*   Arguments:
+*   - int argCount: 2
+*   - Value* args: list, value to add
+*
+*   Return nil
+*/
+Value appendNative(int argCount, Value* args) {
+    if (!IS_LIST(args[0])) {
+        return nativeError("append() expects a list.");
+    }
+    writeValueArray(&AS_LIST(args[0])->items, args[1]); // Can grow and trigger GC, list and value are on the stack
+    writeBarrier(args[1]); // List can be already blackened
+    return NIL_VAL;
+}
+
+/* Native function - Set every element of list to the same value
+*   Arguments:
+*   - int argCount: 2
+*   - Value* args: list, value to set
+*
+*   Return nil
+*/
+Value fillNative(int argCount, Value* args) {
+    if (!IS_LIST(args[0])) {
+        return nativeError("fill() expects a list.");
+    }
+    ObjList* list = AS_LIST(args[0]);
+    writeBarrier(args[1]); // List can be already blackened
+    for (int i = 0; i < list->items.count; i++) {
+        list->items.values[i] = args[1];
+    }
+    return NIL_VAL;
+}
+
+/* Native function - Add up all elements of list of numbers
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: list of numbers
+*
+*   Return sum as number, the same in builds with and without SIMD
+*/
+Value sumNative(int argCount, Value* args) {
+    if (!IS_LIST(args[0]) || !allNumbers(AS_LIST(args[0]))) {
+        return nativeError("sum() expects a list of numbers.");
+    }
+    ObjList* list = AS_LIST(args[0]);
+    return NUMBER_VAL(sumNumbers(list->items.values, list->items.count));
+}
+
+/* Native function - Multiply every element of list of numbers in place
+*   Arguments:
+*   - int argCount: 2
+*   - Value* args: list of numbers, number factor
+*
+*   Return nil
+*/
+Value scaleNative(int argCount, Value* args) {
+    if (!IS_LIST(args[0]) || !allNumbers(AS_LIST(args[0])) || !IS_NUMBER(args[1])) {
+        return nativeError("scale() expects a list of numbers and a number.");
+    }
+    ObjList* list = AS_LIST(args[0]);
+    scaleNumbers(list->items.values, list->items.count, AS_NUMBER(args[1]));
+    return NIL_VAL;
+}
+
+/* Native function - Sort list of numbers in ascending order in place
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: list of numbers
+*
+*   Return nil
+*/
+Value sortNative(int argCount, Value* args) {
+    if (!IS_LIST(args[0]) || !allNumbers(AS_LIST(args[0]))) {
+        return nativeError("sort() expects a list of numbers.");
+    }
+    ObjList* list = AS_LIST(args[0]);
+    qsort(list->items.values, list->items.count, sizeof(Value), compareNumbers);
+    return NIL_VAL;
+}
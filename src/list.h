@@ -0,0 +1,60 @@
+#ifndef clox_list_h
+#define clox_list_h
+
+#include "value.h"
+
+/* Native function - Get number of elements of list or characters of string
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: list or string
+*
+*   Return length as number
+*/
+Value lenNative(int argCount, Value* args);
+
+/* Native function - Add element at the end of list
+*   Arguments:
+*   - int argCount: 2
+*   - Value* args: list, value to add
+*
+*   Return nil
+*/
+Value appendNative(int argCount, Value* args);
+
+/* Native function - Set every element of list to the same value
+*   Arguments:
+*   - int argCount: 2
+*   - Value* args: list, value to set
+*
+*   Return nil
+*/
+Value fillNative(int argCount, Value* args);
+
+/* Native function - Add up all elements of list of numbers
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: list of numbers
+*
+*   Return sum as number, the same in builds with and without SIMD
+*/
+Value sumNative(int argCount, Value* args);
+
+/* Native function - Multiply every element of list of numbers in place
+*   Arguments:
+*   - int argCount: 2
+*   - Value* args: list of numbers, number factor
+*
+*   Return nil
+*/
+Value scaleNative(int argCount, Value* args);
+
+/* Native function - Sort list of numbers in ascending order in place
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: list of numbers
+*
+*   Return nil
+*/
+Value sortNative(int argCount, Value* args);
+
+#endif
@@ -2,9 +2,22 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SOURCE_MMAP // Map script files instead of reading them into a buffer
+#define STDOUT_ISATTY // Tell whether stdout is a terminal, which gets its output flushed after every print
+#endif
+
 #include "common.h"
+#include "bytecode.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "profiler.h"
 #include "vm.h"
 
 // Handles REPL session by reading and interpreting code line by line
@@ -18,73 +31,293 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        interpret(line, strlen(line));
+        flushOutput(&vm.output); // Before the next prompt
+    }
+}
+
+/* Source code of the script
+*
+*   Fields:
+*   - char* chars: characters of the source, not null-terminated when mapped
+*   - size_t length: number of characters
+*   - bool mapped: whether chars are mapped file rather than allocated buffer
+*/
+typedef struct {
+    char* chars; // characters of the source, not null-terminated when mapped
+    size_t length; // number of characters
+    bool mapped; // whether chars are mapped file rather than allocated buffer
+} Source;
+
+#define READ_CHUNK 65536 // Bytes read at a time from streams whose size isn't known upfront
+
+/* Read whole stream such as stdin or pipe, whose size can't be checked upfront
+*   Arguments:
+*   - FILE* file: to read from
+*   - const char* path: of file for error messages
+*
+*   Return source in allocated buffer
+*/
+static Source readStream(FILE* file, const char* path) {
+    Source source = {NULL, 0, false};
+    size_t capacity = 0;
+    for (;;) {
+        if (capacity - source.length < READ_CHUNK) { // Buffer grows geometrically, so copying stays linear
+            capacity = capacity < READ_CHUNK ? READ_CHUNK : capacity * 2;
+            source.chars = (char*)realloc(source.chars, capacity);
+            if (source.chars == NULL) {
+                fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+                exit(74);
+            }
+        }
+
+        size_t bytesRead = fread(source.chars + source.length, sizeof(char), capacity - source.length, file);
+        source.length += bytesRead;
+        if (bytesRead == 0) break;
     }
+    if (ferror(file)) { // Could not read whole stream
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+    return source;
 }
 
-/* Read file from given path
+/* Read file from given path, "-" for stdin. Regular files are mapped instead of copied to memory
 *   Arguments:
 *   - const char* path: to file
 *
-*   Return pointer to allocated string with source code
+*   Return source of the script, released with freeSource()
 */
-static char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
+static Source readFile(const char* path) {
+    if (strcmp(path, "-") == 0) return readStream(stdin, path);
 
-    if (file == NULL) { // Could not open file on a given path
+#ifdef SOURCE_MMAP
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) { // Could not open file on a given path
         fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
-    
-    // Seek to the end of the file to check how big the file is for the allocation
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
 
-    char* buffer = (char*)malloc(fileSize + 1); // Allocate required memory
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+    struct stat fileStat;
+    if (fstat(descriptor, &fileStat) == 0 && S_ISREG(fileStat.st_mode) && fileStat.st_size > 0) {
+        // Pages are read in only as scanner reaches them, and dropped by the kernel instead of being swapped
+        void* chars = mmap(NULL, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (chars != MAP_FAILED) {
+            madvise(chars, (size_t)fileStat.st_size, MADV_SEQUENTIAL);
+            close(descriptor); // Mapping stays valid after file is closed
+            Source source = {(char*)chars, (size_t)fileStat.st_size, true};
+            return source;
+        }
     }
+    close(descriptor); // Empty file, pipe or device, which can't be mapped and is read as stream
+#endif
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file); // Read file content to the buffer
-    if(bytesRead < fileSize) { // Could not read whole file
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) { // Could not open file on a given path
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
+    Source source = readStream(file, path);
+    fclose(file);
+    return source;
+}
 
-    buffer[bytesRead] = '\0'; // Terminate string
+/* Release source of the script
+*   Arguments:
+*   - Source* source: returned by readFile()
+*/
+static void freeSource(Source* source) {
+#ifdef SOURCE_MMAP
+    if (source->mapped) {
+        munmap(source->chars, source->length);
+        return;
+    }
+#endif
+    free(source->chars);
+}
 
-    fclose(file);
-    return buffer;
+/* Report profile collected while running: opcodes to stderr, callstacks to folded stacks file
+*   Arguments:
+*   - const char* path: of folded stacks file
+*/
+static void reportProfile(const char* path) {
+    printProfile(vm.profile, stderr);
+    if (!writeFoldedStacks(vm.profile, path)) {
+        fprintf(stderr, "Could not write profile \"%s\".\n", path);
+        exit(74);
+    }
 }
 
 /* Interpret and run file from given path
 *   Arguments:
-*   - const char* path: to file
+*   - const char* path: to file, "-" for stdin
+*   - const char* profilePath: of folded stacks file, used when VM is profiled
 */
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+static void runFile(const char* path, const char* profilePath) {
+    Source source = readFile(path);
+    // Skip compiling if cache next to the file matches. Stdin has no cache, and dumping bytecode needs the compiler
+    bool cached = strcmp(path, "-") != 0 && !vm.dumpBytecode;
+    ObjFunction* function = cached ? readBytecode(path, source.chars, source.length) : NULL;
+    InterpretResult result = function != NULL ? interpretFunction(function) : interpret(source.chars, source.length);
+    freeSource(&source);
+    flushOutput(&vm.output); // Exit codes below skip freeing the VM
+    if (vm.gcStats) printGCStats();
+    if (vm.profile != NULL) reportProfile(profilePath); // Also after runtime error, which is often what's being profiled
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+/* Compile file from given path and write its bytecode cache next to it, without running it
+*   Arguments:
+*   - const char* path: to file
+*/
+static void compileFile(const char* path) {
+    Source source = readFile(path);
+    ObjFunction* function = compile(source.chars, source.length);
+    if (function == NULL) exit(65);
+
+    if (!writeBytecode(path, source.chars, source.length, function)) {
+        fprintf(stderr, "Could not write bytecode cache for \"%s\".\n", path);
+        exit(74);
+    }
+    freeSource(&source);
+}
+
+#define USAGE "Usage: clox [--gc-stats] [--gc-grow-factor=N] [--gc-min-heap=SIZE] [--gc-max-heap=SIZE] [--compile]\n" \
+    "            [--trace] [--dump-bytecode] [--profile[=file]] [--flush=line|size] [--no-jit] [path]\n"
+
+/* Parse heap size, number of bytes optionally followed by k, m or g for binary multiples
+*   Arguments:
+*   - const char* text: to parse
+*   - size_t* size: set to parsed size
+*
+*   Return whether text was valid size
+*/
+static bool parseSize(const char* text, size_t* size) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return false;
+    switch (*end) {
+        case 'k': case 'K': value *= 1024; end++; break;
+        case 'm': case 'M': value *= 1024 * 1024; end++; break;
+        case 'g': case 'G': value *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (*end != '\0' || value >= (double)SIZE_MAX) return false;
+    *size = (size_t)value;
+    return true;
+}
+
+/* Heap policy of the collector, read from environment and then command line
+*
+*   Fields:
+*   - double growFactor: next collection starts when heap grows to this multiple of bytes that survived the last one
+*   - size_t minHeap: heap size below which no collection starts
+*   - size_t maxHeap: heap size at which program fails, 0 for no limit
+*/
+typedef struct {
+    double growFactor; // next collection starts when heap grows to this multiple of bytes that survived the last one
+    size_t minHeap; // heap size below which no collection starts
+    size_t maxHeap; // heap size at which program fails, 0 for no limit
+} HeapPolicy;
+
+/* Set one setting of heap policy, exiting on invalid value
+*   Arguments:
+*   - HeapPolicy* policy: to change
+*   - const char* name: of the setting, "grow-factor", "min-heap" or "max-heap"
+*   - const char* value: of the setting
+*   - const char* source: option or environment variable the value came from, for error message
+*/
+static void setPolicy(HeapPolicy* policy, const char* name, const char* value, const char* source) {
+    bool valid;
+    if (strcmp(name, "grow-factor") == 0) {
+        char* end;
+        policy->growFactor = strtod(value, &end);
+        valid = end != value && *end == '\0' && policy->growFactor > 1; // Factor of 1 or less would collect on every allocation
+    } else if (strcmp(name, "min-heap") == 0) {
+        valid = parseSize(value, &policy->minHeap);
+    } else {
+        valid = parseSize(value, &policy->maxHeap);
+    }
+    if (!valid) {
+        fprintf(stderr, "Invalid value \"%s\" of %s.\n", value, source);
+        exit(64);
+    }
+}
+
 // Program entry
 int main(int argc, const char* argv[]) {
-    initVM();
+    VM* machine = newVM();
 
-    if (argc == 1) {  // Start repl session if no script path specified
+    bool compileOnly = false;
+    const char* profilePath = PROFILE_PATH; // Where folded stacks are written when profiling
+    HeapPolicy policy = {vm.gcGrowFactor, vm.gcMinHeap, vm.gcMaxHeap};
+#ifdef STDOUT_ISATTY
+    if (isatty(STDOUT_FILENO)) vm.output.policy = FLUSH_LINE; // Terminal shows prints as they happen, like stdio does
+#endif
+    // Environment sets policy for every run, command line options override it
+    const char* policyVariables[][2] = {
+        {"CLOX_GC_GROW_FACTOR", "grow-factor"}, {"CLOX_GC_MIN_HEAP", "min-heap"}, {"CLOX_GC_MAX_HEAP", "max-heap"}
+    };
+    for (int i = 0; i < 3; i++) {
+        const char* value = getenv(policyVariables[i][0]);
+        if (value != NULL) setPolicy(&policy, policyVariables[i][1], value, policyVariables[i][0]);
+    }
+
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) { // Options come before the path
+        if (strcmp(argv[1], "--gc-stats") == 0) { // Report GC pauses on exit
+            vm.gcStats = true;
+        } else if (strncmp(argv[1], "--gc-grow-factor=", 17) == 0 || strncmp(argv[1], "--gc-min-heap=", 14) == 0 ||
+                strncmp(argv[1], "--gc-max-heap=", 14) == 0) { // Heap policy of the collector
+            char option[24]; // Option without its value, like "--gc-min-heap"
+            const char* value = strchr(argv[1], '=') + 1;
+            snprintf(option, sizeof(option), "%.*s", (int)(value - argv[1] - 1), argv[1]);
+            setPolicy(&policy, option + 5, value, option);
+        } else if (strcmp(argv[1], "--compile") == 0) { // Write bytecode cache instead of running
+            compileOnly = true;
+        } else if (strcmp(argv[1], "--trace") == 0) { // Print stack and every instruction as it executes
+            vm.traceExecution = true;
+        } else if (strcmp(argv[1], "--dump-bytecode") == 0) { // Disassemble every compiled function
+            vm.dumpBytecode = true;
+        } else if (strncmp(argv[1], "--profile", 9) == 0 && (argv[1][9] == '\0' || argv[1][9] == '=')) {
+            // Count opcodes and sample callstacks, optionally naming the folded stacks file
+            if (vm.profile == NULL) vm.profile = newProfile();
+            if (argv[1][9] == '=') profilePath = argv[1] + 10;
+        } else if (strcmp(argv[1], "--flush=line") == 0) { // Flush output after every print
+            vm.output.policy = FLUSH_LINE;
+        } else if (strcmp(argv[1], "--flush=size") == 0) { // Flush output only when its buffer is full
+            vm.output.policy = FLUSH_SIZE;
+        } else if (strcmp(argv[1], "--no-jit") == 0) { // Only interpret, never compiling to machine code
+            vm.jitEnabled = false;
+        } else {
+            fprintf(stderr, USAGE);
+            exit(64);
+        }
+        argv++;
+        argc--;
+    }
+    if (policy.maxHeap > 0 && policy.maxHeap < policy.minHeap) {
+        fprintf(stderr, "Maximal heap can't be smaller than minimal heap.\n");
+        exit(64);
+    }
+    setHeapPolicy(policy.growFactor, policy.minHeap, policy.maxHeap);
+
+    if (compileOnly && argc == 2) {
+        compileFile(argv[1]);
+    } else if (compileOnly) {
+        fprintf(stderr, USAGE);
+        exit(64);
+    } else if (argc == 1) {  // Start repl session if no script path specified
         repl();
-    } else if (argc == 2) { // Compile and run specified script
-        runFile(argv[1]);
+        if (vm.gcStats) printGCStats();
+        if (vm.profile != NULL) reportProfile(profilePath);
+    } else if (argc == 2) { // Compile and run specified script, "-" reads it from stdin
+        runFile(argv[1], profilePath);
     } else { // Too much arguments passed
-        fprintf(stderr, "Usage: clox [path]\n"); 
+        fprintf(stderr, USAGE);
         exit(64);
     }
 
-    freeVM();
+    destroyVM(machine);
     return 0;
-}
\ No newline at end of file
+}
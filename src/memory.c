@@ -1,15 +1,75 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
+#include "native.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2 // After running GC set next run when memory allocation crosses N * memory after this run
+#ifdef DEBUG_STRESS_GC
+#define GC_STEP_WORK 1 // Interleave program with collector as much as possible
+#else
+#define GC_STEP_WORK 1024 // Objects blackened or swept by a single incremental step
+#endif
+
+#define SLAB_SIZE (16 * 1024) // Bytes of a single slab, slabs are aligned to their size
+
+/* Slab of equally sized object slots, followed in memory by the slots
+*
+*   Fields:
+*   - Slab* next: next slab of the same size class
+*   - Obj* freeSlots: linked list of unused slots
+*   - int slotSize: size of every slot
+*   - int slotCount: number of slots in the slab
+*   - int liveCount: number of used slots
+*   - bool swept: whether slab has no objects waiting for sweep in the current collection cycle
+*/
+struct Slab {
+    Slab* next; // next slab of the same size class
+    Obj* freeSlots; // linked list of unused slots
+    int slotSize; // size of every slot
+    int slotCount; // number of slots in the slab
+    int liveCount; // number of used slots
+    bool swept; // whether slab has no objects waiting for sweep in the current collection cycle
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(Slab) + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1)) // Slots start aligned to granule
+#define SLAB_OF(object) ((Slab*)((uintptr_t)(object) & ~(uintptr_t)(SLAB_SIZE - 1))) // Slab holding the object
+#define SLAB_SLOT(slab, index) ((Obj*)((char*)(slab) + SLAB_HEADER_SIZE + (size_t)(index) * (slab)->slotSize))
+#define SIZE_CLASS(size) ((int)(((size) - 1) / SLAB_GRANULE)) // Size class of object size
+
+// Free slot of object in slab
+#define FREE_OBJ(type, object) freeSlot(object, sizeof(type))
+
+static void runCollector();
+
+// Set threshold of the next collection from bytes that are allocated now, within heap limits
+static void scheduleCollection() {
+    double next = vm.bytesAllocated * vm.gcGrowFactor;
+    vm.nextGC = next < vm.gcMinHeap ? vm.gcMinHeap : next > (double)SIZE_MAX ? SIZE_MAX : (size_t)next;
+    // Crossing the limit has to reach runCollector(), which checks it outside the allocation fast path
+    if (vm.gcMaxHeap > 0 && vm.nextGC > vm.gcMaxHeap) vm.nextGC = vm.gcMaxHeap;
+}
+
+/* Set heap policy of current VM, taking effect from the next allocation
+*   Arguments:
+*   - double growFactor: next collection starts when heap grows to this multiple of bytes that survived the last one
+*   - size_t minHeap: heap size below which no collection starts
+*   - size_t maxHeap: heap size at which program fails when even full collection can't get under it, 0 for no limit
+*/
+void setHeapPolicy(double growFactor, size_t minHeap, size_t maxHeap) {
+    vm.gcGrowFactor = growFactor;
+    vm.gcMinHeap = minHeap;
+    vm.gcMaxHeap = maxHeap;
+    scheduleCollection();
+}
 
 /* Reallocates memory
 *   Arguments:
@@ -23,12 +83,12 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
         #ifdef DEBUG_STRESS_GC
-            collectGarbage();
+            runCollector();
+        #else
+            if (vm.gcPhase != GC_IDLE || vm.bytesAllocated > vm.nextGC) {
+                runCollector();
+            }
         #endif
-
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
-        }
     }
 
     if (newSize == 0) {
@@ -41,6 +101,85 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+/* Allocate new slab
+*   Arguments:
+*   - int sizeClass: of the slab
+*   - Slab** link: list link to put the slab in, the end of size class list
+*
+*   Return slab with all slots unused
+*/
+static Slab* newSlab(int sizeClass, Slab** link) {
+    Slab* slab = (Slab*)aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    if (slab == NULL) exit(1);
+    slab->freeSlots = NULL;
+    slab->slotSize = (sizeClass + 1) * SLAB_GRANULE;
+    slab->slotCount = (int)((SLAB_SIZE - SLAB_HEADER_SIZE) / slab->slotSize);
+    slab->liveCount = 0;
+    slab->swept = true; // Nothing in it to sweep
+    slab->next = NULL;
+    *link = slab;
+
+    // Going backwards, so slots are handed out in address order
+    for (int i = slab->slotCount - 1; i >= 0; i--) {
+        Obj* slot = SLAB_SLOT(slab, i);
+        slot->isFree = true;
+        slot->next = slab->freeSlots;
+        slab->freeSlots = slot;
+    }
+    return slab;
+}
+
+/* Allocate memory for object from a slab of its size class
+*   Arguments:
+*   - size_t size: of the object
+*
+*   Return pointer to object memory with GC flags set, rest is not initialized
+*/
+Obj* allocateSlot(size_t size) {
+    vm.bytesAllocated += size; // Objects count with their own size, so GC is scheduled the same as without slabs
+    #ifdef DEBUG_STRESS_GC
+        runCollector();
+    #else
+        if (vm.gcPhase != GC_IDLE || vm.bytesAllocated > vm.nextGC) {
+            runCollector();
+        }
+    #endif
+
+    // Slabs are filled in list order, only sweep can free slots in the slabs already filled
+    int sizeClass = SIZE_CLASS(size);
+    Slab* slab = vm.allocSlabs[sizeClass];
+    if (slab == NULL || slab->freeSlots == NULL) {
+        Slab** link = slab != NULL ? &slab->next : &vm.slabs[sizeClass];
+        while (*link != NULL && (*link)->freeSlots == NULL) link = &(*link)->next;
+        slab = *link != NULL ? *link : newSlab(sizeClass, link); // All slabs full
+        vm.allocSlabs[sizeClass] = slab;
+    }
+
+    Obj* object = slab->freeSlots;
+    slab->freeSlots = object->next;
+    slab->liveCount++;
+    object->isFree = false;
+    /* Object put into a slab still waiting for sweep would be freed as white,
+    so it starts black there. Sweep makes it white again
+    */
+    object->isMarked = vm.gcPhase == GC_SWEEP && !slab->swept;
+    return object;
+}
+
+/* Return slot of freed object to the free list of its slab
+*   Arguments:
+*   - Obj* object: to free
+*   - size_t size: of the object
+*/
+static void freeSlot(Obj* object, size_t size) {
+    vm.bytesAllocated -= size;
+    Slab* slab = SLAB_OF(object);
+    object->isFree = true;
+    object->next = slab->freeSlots;
+    slab->freeSlots = object;
+    slab->liveCount--;
+}
+
 /* Mark object to not be sweeped by garbage collector
 *   Arguments:
 *   - Obj* object: to mark
@@ -67,6 +206,7 @@ void markObject(Obj* object) {
 
     // Add object to gray objects array
     vm.grayStack[vm.grayCount++] = object;
+    if (vm.grayCount > vm.gcGrayMax) vm.gcGrayMax = vm.grayCount;
 }
 
 /* Mark value to not be sweeped by garbage collector
@@ -87,6 +227,29 @@ static void markArray(ValueArray* array) {
     }
 }
 
+/* Mark field names of shape and all shapes that transition from it
+*   Arguments:
+*   - Shape* shape: root of the (sub)tree to mark
+*/
+static void markShape(Shape* shape) {
+    markObject((Obj*)shape->name);
+    for (int i = 0; i < shape->transitionCount; i++) {
+        markShape(shape->transitions[i]);
+    }
+}
+
+/* Free shape and all shapes that transition from it
+*   Arguments:
+*   - Shape* shape: root of the (sub)tree to free
+*/
+static void freeShape(Shape* shape) {
+    for (int i = 0; i < shape->transitionCount; i++) {
+        freeShape(shape->transitions[i]);
+    }
+    FREE_ARRAY(Shape*, shape->transitions, shape->transitionCapacity);
+    FREE(Shape, shape);
+}
+
 /* Blacken object from gray by marking and graying objects that can be referenced
 *   Arguments:
 *   - Obj* object: to be blackened
@@ -110,6 +273,7 @@ static void blackenObject(Obj* object) {
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name); // Can reference its name
             markTable(&klass->methods); // Can reference all methods
+            markShape(klass->rootShape); // Can reference field names of its instances
             break;
         }
         case OBJ_CLOSURE:
@@ -127,8 +291,24 @@ static void blackenObject(Obj* object) {
         case OBJ_INSTANCE:
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass); // Can reference parent class
-            markTable(&instance->fields); // Can reference fields
+            if (instance->shape != NULL) { // Can reference fields
+                for (int i = 0; i < instance->shape->fieldCount; i++) {
+                    markValue(instance->fields[i]);
+                }
+            } else {
+                markTable(&instance->dictionary);
+            }
             break;
+        case OBJ_LIST:
+            markArray(&((ObjList*)object)->items); // Can reference all elements
+            break;
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(rope->left); // Can reference parts until flattened
+            markObject(rope->right);
+            markObject((Obj*)rope->flat); // Can reference flat string once flattened
+            break;
+        }
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue*)object)->closed); // Can reference closed values
             break;
@@ -149,50 +329,66 @@ static void freeObject(Obj* object) {
 
     switch (object->type) {
         case OBJ_BOUND_METHOD:
-            FREE(OBJ_BOUND_METHOD, object);
+            FREE_OBJ(ObjBoundMethod, object);
             break;
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
             freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeShape(klass->rootShape);
+            FREE_OBJ(ObjClass, object);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            FREE_OBJ(ObjClosure, object);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
+#ifdef BASELINE_JIT
+            freeJit(function->jit);
+#endif
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            FREE_OBJ(ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+            freeTable(&instance->dictionary);
+            FREE_OBJ(ObjInstance, object);
             break;
         }
+        case OBJ_LIST:
+            freeValueArray(&((ObjList*)object)->items);
+            FREE_OBJ(ObjList, object);
+            break;
         case OBJ_NATIVE: 
-            FREE(OBJ_NATIVE, object);
+            FREE_OBJ(ObjNative, object);
+            break;
+        case OBJ_ROPE:
+            FREE_OBJ(ObjRope, object);
             break;
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            if (string->chars == string->storage) { // Characters go away with the slot
+                freeSlot(object, sizeof(ObjString) + string->length + 1);
+            } else {
+                FREE_ARRAY(char, string->chars, string->length + 1);
+                FREE_OBJ(ObjString, object);
+            }
             break;
         }
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+            FREE_OBJ(ObjUpvalue, object);
             break;
     }
 }
 
 // Mark objects that can be directly referenced by program
 static void markRoots() {
-    // Mark all values on current VM's stack
+    // Mark all values on current VM's stack. run() keeps stack top in a local, so it spills it to vm.stackTop before anything that can allocate
     for (Value* slot = vm.stack; slot<vm.stackTop; slot++) {
         markValue(*slot);
     }
@@ -207,7 +403,10 @@ static void markRoots() {
         markObject((Obj*)upvalue);
     }
 
-    markTable(&vm.globals); // Mark globals
+    markTable(&vm.globalSlots); // Mark names of globals
+    for (int i = 0; i < vm.globalCount; i++) { // Mark values of globals
+        markValue(vm.globalValues[i]);
+    }
     markCompilerRoots(); // Mark objects owned by compiler
     markObject((Obj*)vm.initString); // Mark "init" string
 }
@@ -220,30 +419,217 @@ static void traceReferences() {
     }
 }
 
-// Free objects that were not marked during mark step
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    // Loop through whole linked list
-    while (object != NULL) {
+/* Calculate memory held by object, for live heap statistics
+*   Arguments:
+*   - Obj* object: to measure
+*   - int slotSize: of the slab holding the object
+*
+*   Return size of the slot and of arrays the object owns, tables aside
+*/
+static size_t objectSize(Obj* object, int slotSize) {
+    size_t size = slotSize;
+    switch (object->type) {
+        case OBJ_CLOSURE:
+            size += sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+            break;
+        case OBJ_FUNCTION: {
+            Chunk* chunk = &((ObjFunction*)object)->chunk;
+            size += chunk->capacity + sizeof(Value) * chunk->constants.capacity;
+            break;
+        }
+        case OBJ_INSTANCE:
+            size += sizeof(Value) * ((ObjInstance*)object)->fieldCapacity;
+            break;
+        case OBJ_LIST:
+            size += sizeof(Value) * ((ObjList*)object)->items.capacity;
+            break;
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            if (string->chars != string->storage) size += string->length + 1;
+            break;
+        }
+        default:
+            break;
+    }
+    return size;
+}
+
+/* Free objects of the slab that were not marked during mark step, walking slots in address order
+*   Arguments:
+*   - Slab* slab: to sweep
+*/
+static void sweepSlab(Slab* slab) {
+    slab->swept = true; // Slots freed here will be taken by white objects
+    size_t before = vm.bytesAllocated;
+    for (int i = 0; i < slab->slotCount && slab->liveCount > 0; i++) {
+        Obj* object = SLAB_SLOT(slab, i);
+        if (object->isFree) continue;
         if (object->isMarked) {
             object->isMarked = false; // Reset marking for the next GC run
-            previous = object;
-            object = object->next;
+            vm.gcSurvivors[object->type]++;
+            vm.gcSurvivorBytes[object->type] += objectSize(object, slab->slotSize);
         } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object; // Connect previous and next for linked list continuity
-            } else {
-                vm.objects = object; // If deleting first then set start of linked list as next object
-            }
+            freeObject(object);
+        }
+    }
+    vm.gcBytesFreed += before - vm.bytesAllocated;
+}
+
+// Publish statistics of the finished cycle and schedule the next one according to heap policy
+static void finishCycle() {
+    memcpy(vm.gcLiveObjects, vm.gcSurvivors, sizeof(vm.gcSurvivors));
+    memcpy(vm.gcLiveBytes, vm.gcSurvivorBytes, sizeof(vm.gcSurvivorBytes));
+    memset(vm.gcSurvivors, 0, sizeof(vm.gcSurvivors));
+    memset(vm.gcSurvivorBytes, 0, sizeof(vm.gcSurvivorBytes));
+    vm.gcCollections++;
+    scheduleCollection();
+}
+
+/* Sweep slab pointed to by the link, releasing the slab if nothing in it survived
+*   Arguments:
+*   - int sizeClass: of the slab
+*   - Slab** link: pointer to the list link holding the slab
+*
+*   Return link of the next slab
+*/
+static Slab** sweepLinkedSlab(int sizeClass, Slab** link) {
+    Slab* slab = *link;
+    sweepSlab(slab);
+    if (slab->liveCount > 0 || slab == vm.allocSlabs[sizeClass]) return &slab->next;
 
-            freeObject(unreached);
+    *link = slab->next; // Unlink empty slab, keeping the one allocation continues from
+    free(slab);
+    return link;
+}
+
+// Let allocation search for free slots from the start of every size class again
+static void rewindAllocation() {
+    for (int i = 0; i < SLAB_SIZE_CLASSES; i++) {
+        vm.allocSlabs[i] = vm.slabs[i];
+    }
+}
+
+#ifdef INCREMENTAL_GC
+
+// Start collection cycle by graying roots, objects allocated from now on stay white until they are reached
+static void beginMark() {
+    vm.gcPhase = GC_MARK;
+    markRoots();
+}
+
+// Finish marking atomically and queue all slabs for sweeping
+static void finishMark() {
+    markRoots(); // Roots change without write barriers, so find what was pushed to them since beginMark()
+    traceReferences();
+    tableRemoveWhite(&vm.strings);
+
+    // Slabs created from now on start as swept, so this cycle's sweep skips them
+    for (int i = 0; i < SLAB_SIZE_CLASSES; i++) {
+        for (Slab* slab = vm.slabs[i]; slab != NULL; slab = slab->next) {
+            slab->swept = false;
+        }
+    }
+    vm.sweepClass = 0;
+    vm.sweepLink = &vm.slabs[0];
+    vm.gcPhase = GC_SWEEP;
+}
+
+/* Blacken limited number of gray objects
+*   Arguments:
+*   - int work: maximal number of objects to blacken
+*
+*   Return whether gray objects ran out
+*/
+static bool traceSome(int work) {
+    while (vm.grayCount > 0 && work-- > 0) {
+        Obj* object = vm.grayStack[--vm.grayCount];
+        blackenObject(object);
+    }
+    return vm.grayCount == 0;
+}
+
+/* Sweep whole slabs until limited number of slots was looked at
+*   Arguments:
+*   - int work: number of slots to sweep, rounded up to whole slab
+*
+*   Return whether all slabs were swept
+*/
+static bool sweepSome(int work) {
+    for (;;) {
+        while (*vm.sweepLink == NULL) { // Go to the next size class
+            if (vm.sweepClass + 1 >= SLAB_SIZE_CLASSES) return true;
+            vm.sweepLink = &vm.slabs[++vm.sweepClass];
+        }
+        if (work <= 0) return false;
+
+        Slab* slab = *vm.sweepLink;
+        if (slab->swept) { // Created during this sweep
+            vm.sweepLink = &slab->next;
+            continue;
         }
+        work -= slab->slotCount;
+        // Whole slab at once, as nothing can be allocated in its slots meanwhile
+        vm.sweepLink = sweepLinkedSlab(vm.sweepClass, vm.sweepLink);
     }
 }
 
+// Finish collection cycle
+static void endCycle() {
+    vm.gcPhase = GC_IDLE;
+    rewindAllocation();
+    finishCycle();
+}
+
+// Advance collection cycle by a bounded amount of work
+static void collectStep() {
+    switch (vm.gcPhase) {
+        case GC_IDLE:
+            beginMark();
+            break;
+        case GC_MARK:
+            if (traceSome(GC_STEP_WORK)) finishMark();
+            break;
+        case GC_SWEEP:
+            if (sweepSome(GC_STEP_WORK)) endCycle();
+            break;
+    }
+}
+
+// Free objects that can't be rached by any part of the program, finishing the cycle in progress at once
+void collectGarbage() {
+    #ifdef DEBUG_LOG_GC
+        printf("-- gc begin\n");
+        size_t before = vm.bytesAllocated;
+    #endif
+
+    if (vm.gcPhase == GC_IDLE) beginMark();
+    if (vm.gcPhase == GC_MARK) {
+        traceReferences();
+        finishMark();
+    }
+    sweepSome(INT32_MAX);
+    endCycle();
+
+    #ifdef DEBUG_LOG_GC
+        printf("-- gc end\n");
+        printf(" collected %zu bytes (from %zu to %zu) next at %zu\n",
+            before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+    #endif
+}
+
+#else
+
+// Free objects that were not marked during mark step
+static void sweep() {
+    for (int i = 0; i < SLAB_SIZE_CLASSES; i++) {
+        Slab** link = &vm.slabs[i];
+        while (*link != NULL) {
+            link = sweepLinkedSlab(i, link);
+        }
+    }
+    rewindAllocation();
+}
+
 // Free objects that can't be rached by any part of the program
 void collectGarbage() {
     #ifdef DEBUG_LOG_GC
@@ -259,8 +645,7 @@ void collectGarbage() {
     */
     tableRemoveWhite(&vm.strings);
     sweep();
-
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    finishCycle();
 
     #ifdef DEBUG_LOG_GC
         printf("-- gc end\n");
@@ -269,13 +654,164 @@ void collectGarbage() {
     #endif
 }
 
-// Free whole VM's objects linked list and grayStack
+#endif
+
+// Read monotonic clock in nanoseconds
+static uint64_t nanoTime() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+/* Add GC pause to the histogram
+*   Arguments:
+*   - uint64_t pause: length in nanoseconds
+*/
+static void recordPause(uint64_t pause) {
+    int bucket = 0;
+    for (uint64_t micros = pause / 1000; micros > 0 && bucket < GC_PAUSE_BUCKETS - 1; micros >>= 1) {
+        bucket++;
+    }
+    vm.gcPauses[bucket]++;
+    vm.gcPauseCount++;
+    vm.gcPauseTotal += pause;
+    if (pause > vm.gcPauseMax) vm.gcPauseMax = pause;
+}
+
+/* Run garbage collector, incrementally when program is running. Compiler doesn't use write barriers, so it gets whole collections.
+*   Heap over its limit gets a whole collection too, and program fails if it's still over afterwards
+*/
+static void runCollector() {
+    uint64_t start = vm.gcStats ? nanoTime() : 0;
+    // Heap grows past the collection threshold only through here, so peak is sampled without touching allocation fast path
+    if (vm.bytesAllocated > vm.gcPeakHeap) vm.gcPeakHeap = vm.bytesAllocated;
+    bool overLimit = vm.gcMaxHeap > 0 && vm.bytesAllocated > vm.gcMaxHeap;
+
+    #ifdef INCREMENTAL_GC
+        if (vm.frameCount > 0 && !overLimit) {
+            collectStep();
+        } else {
+            bool inCycle = vm.gcPhase != GC_IDLE;
+            collectGarbage();
+            /* Cycle in progress kept everything reachable when its roots were taken, and what was allocated since.
+            One from the current roots tells if the limit is really exceeded
+            */
+            if (overLimit && inCycle && vm.bytesAllocated > vm.gcMaxHeap) collectGarbage();
+        }
+    #else
+        collectGarbage();
+    #endif
+
+    if (vm.gcStats) recordPause(nanoTime() - start);
+
+    if (overLimit && vm.bytesAllocated > vm.gcMaxHeap) {
+        runtimeError("Heap limit of %zu bytes exceeded, %zu bytes are live.", vm.gcMaxHeap, vm.bytesAllocated);
+        exit(70); // Allocation can't fail back into the program, so this one is fatal
+    }
+}
+
+// Name of every object type in statistics, indexed by ObjType
+static const char* objTypeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_BOUND_METHOD]  = "boundMethod",
+    [OBJ_CLASS]         = "class",
+    [OBJ_CLOSURE]       = "closure",
+    [OBJ_FUNCTION]      = "function",
+    [OBJ_INSTANCE]      = "instance",
+    [OBJ_LIST]          = "list",
+    [OBJ_NATIVE]        = "native",
+    [OBJ_ROPE]          = "rope",
+    [OBJ_STRING]        = "string",
+    [OBJ_UPVALUE]       = "upvalue",
+};
+
+// Get most bytes allocated at once so far
+static size_t peakHeap() {
+    return vm.bytesAllocated > vm.gcPeakHeap ? vm.bytesAllocated : vm.gcPeakHeap; // Heap may never have reached collector
+}
+
+// Print collector statistics, histogram of GC pauses and live objects after the last collection to stderr
+void printGCStats() {
+    fprintf(stderr, "gc collections: %llu, freed %.1f KB, gray stack max %d, intern table %d of %d entries used\n",
+        (unsigned long long)vm.gcCollections, vm.gcBytesFreed / 1024.0, vm.gcGrayMax, vm.strings.count, vm.strings.capacity);
+    fprintf(stderr, "gc heap: %.1f KB, peak %.1f KB, next collection at %.1f KB, grow factor %g, min %.1f KB",
+        vm.bytesAllocated / 1024.0, peakHeap() / 1024.0, vm.nextGC / 1024.0, vm.gcGrowFactor, vm.gcMinHeap / 1024.0);
+    if (vm.gcMaxHeap > 0) {
+        fprintf(stderr, ", max %.1f KB\n", vm.gcMaxHeap / 1024.0);
+    } else {
+        fprintf(stderr, ", no max\n");
+    }
+
+    fprintf(stderr, "gc pauses: %llu, total %.3f ms, max %.3f ms\n", (unsigned long long)vm.gcPauseCount,
+        vm.gcPauseTotal / 1e6, vm.gcPauseMax / 1e6);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (vm.gcPauses[i] == 0) continue;
+        if (i < GC_PAUSE_BUCKETS - 1) {
+            fprintf(stderr, "  < %8llu us: %llu\n", 1ull << i, (unsigned long long)vm.gcPauses[i]);
+        } else {
+            fprintf(stderr, "  >= %7llu us: %llu\n", 1ull << (i - 1), (unsigned long long)vm.gcPauses[i]);
+        }
+    }
+
+    if (vm.gcCollections == 0) return; // Nothing was found live yet
+    fprintf(stderr, "gc live after last collection:\n");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        if (vm.gcLiveObjects[i] == 0) continue;
+        fprintf(stderr, "  %-12s %10llu objects %12.1f KB\n", objTypeNames[i],
+            (unsigned long long)vm.gcLiveObjects[i], vm.gcLiveBytes[i] / 1024.0);
+    }
+}
+
+/* Native function - Read collector statistic by name
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: name, one of "collections", "bytesAllocated", "peakBytes", "bytesFreed", "nextGC", "grayMax", "strings"
+*     (used intern table entries), "pauses", "pauseTotal", "pauseMax" (seconds, measured only with --gc-stats), or type name followed
+*     by "Objects" or "Bytes" for what survived the last collection, like "stringObjects" or "listBytes"
+*
+*   Return value of the statistic as number
+*/
+Value gcStatNative(int argCount, Value* args) {
+    if (IS_ROPE(args[0])) args[0] = OBJ_VAL(flattenRope(AS_ROPE(args[0]))); // Name is on the stack while it's flattened
+    if (!IS_STRING(args[0])) {
+        return nativeError("gcStat() expects a string.");
+    }
+    const char* name = AS_CSTRING(args[0]);
+
+    if (strcmp(name, "collections") == 0) return NUMBER_VAL((double)vm.gcCollections);
+    if (strcmp(name, "bytesAllocated") == 0) return NUMBER_VAL((double)vm.bytesAllocated);
+    if (strcmp(name, "peakBytes") == 0) return NUMBER_VAL((double)peakHeap());
+    if (strcmp(name, "bytesFreed") == 0) return NUMBER_VAL((double)vm.gcBytesFreed);
+    if (strcmp(name, "nextGC") == 0) return NUMBER_VAL((double)vm.nextGC);
+    if (strcmp(name, "grayMax") == 0) return NUMBER_VAL(vm.gcGrayMax);
+    if (strcmp(name, "strings") == 0) return NUMBER_VAL(vm.strings.count);
+    if (strcmp(name, "pauses") == 0) return NUMBER_VAL((double)vm.gcPauseCount);
+    if (strcmp(name, "pauseTotal") == 0) return NUMBER_VAL(vm.gcPauseTotal / 1e9);
+    if (strcmp(name, "pauseMax") == 0) return NUMBER_VAL(vm.gcPauseMax / 1e9);
+
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        size_t length = strlen(objTypeNames[i]);
+        if (strncmp(name, objTypeNames[i], length) != 0) continue;
+        if (strcmp(name + length, "Objects") == 0) return NUMBER_VAL((double)vm.gcLiveObjects[i]);
+        if (strcmp(name + length, "Bytes") == 0) return NUMBER_VAL((double)vm.gcLiveBytes[i]);
+    }
+    return nativeError("Unknown GC statistic '%s'.", name);
+}
+
+// Free all VM's objects, slabs and grayStack
 void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    for (int i = 0; i < SLAB_SIZE_CLASSES; i++) {
+        Slab* slab = vm.slabs[i];
+        while (slab != NULL) {
+            for (int j = 0; j < slab->slotCount; j++) {
+                Obj* object = SLAB_SLOT(slab, j);
+                if (!object->isFree) freeObject(object); // Frees arrays and tables owned by object
+            }
+            Slab* next = slab->next;
+            free(slab);
+            slab = next;
+        }
+        vm.slabs[i] = NULL;
+        vm.allocSlabs[i] = NULL;
     }
     free(vm.grayStack);
-}
\ No newline at end of file
+}
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 /* Allocate memory for object
 *   Arguments:
@@ -66,6 +67,17 @@ reallocate(pointer, sizeof(type) * (oldCount), 0)
 */
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 
+#define SLAB_GRANULE 16 // Slot sizes are multiples of it
+#define SLOT_SIZE_MAX (SLAB_SIZE_CLASSES * SLAB_GRANULE) // Largest object that can be allocated from slabs
+
+/* Allocate memory for object from a slab of its size class
+*   Arguments:
+*   - size_t size: of the object, at most SLOT_SIZE_MAX
+*
+*   Return pointer to object memory with GC flags set, rest is not initialized
+*/
+Obj* allocateSlot(size_t size);
+
 /* Mark object to not be sweeped by garbage collector
 *   Arguments:
 *   - Obj* object: to mark
@@ -78,10 +90,46 @@ void markObject(Obj* object);
 */
 void markValue(Value value);
 
+/* Keep value written into heap object alive while incremental marking is in progress.
+*   Object written to may be already blackened, and marking would never look at it again.
+*   Stack, globals and other roots don't need it, as they are marked again when marking finishes
+*   Arguments:
+*   - Value value: being written
+*/
+static inline void writeBarrier(Value value) {
+    #ifdef INCREMENTAL_GC
+        if (vm.gcPhase == GC_MARK) markValue(value);
+    #else
+        (void)value;
+    #endif
+}
+
 // Free objects that can't be rached by any part of the program
 void collectGarbage();
 
-// Free whole VM's objects linked list and grayStack
+/* Set heap policy of current VM, taking effect from the next allocation
+*   Arguments:
+*   - double growFactor: next collection starts when heap grows to this multiple of bytes that survived the last one
+*   - size_t minHeap: heap size below which no collection starts
+*   - size_t maxHeap: heap size at which program fails when even full collection can't get under it, 0 for no limit
+*/
+void setHeapPolicy(double growFactor, size_t minHeap, size_t maxHeap);
+
+// Print collector statistics, histogram of GC pauses and live objects after the last collection to stderr
+void printGCStats();
+
+/* Native function - Read collector statistic by name
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: name, one of "collections", "bytesAllocated", "peakBytes", "bytesFreed", "nextGC", "grayMax", "strings"
+*     (used intern table entries), "pauses", "pauseTotal", "pauseMax" (seconds, measured only with --gc-stats), or type name followed
+*     by "Objects" or "Bytes" for what survived the last collection, like "stringObjects" or "listBytes"
+*
+*   Return value of the statistic as number
+*/
+Value gcStatNative(int argCount, Value* args);
+
+// Free all VM's objects, slabs and grayStack
 void freeObjects();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,460 @@
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "list.h"
+#include "memory.h"
+#include "native.h"
+#include "vm.h"
+
+/* Native function - Calculate how long did it take since program start
+*   Arguments:
+*   - int argCount - arguments required by native wrapper, disregarded
+*   - Value* args - arguments required by native wrapper, disregarded
+*
+*   Return number of seconds since program start
+*/
+static Value clockNative(int argCount, Value* args) {
+    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+}
+
+/* Native function - Load registered module of natives into globals
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: name of the module
+*
+*   Return true
+*/
+static Value loadModuleNative(int argCount, Value* args) {
+    if (IS_ROPE(args[0])) args[0] = OBJ_VAL(flattenRope(AS_ROPE(args[0]))); // Name is on the stack while it's flattened
+    if (!IS_STRING(args[0])) return nativeError("loadModule() expects a string.");
+    if (!loadNativeModule(AS_CSTRING(args[0]))) return nativeError("Unknown module '%s'.", AS_CSTRING(args[0]));
+    return BOOL_VAL(true);
+}
+
+/* Check that every argument of math native is a number
+*   Arguments:
+*   - const char* name: of the native, for error message
+*   - int argCount: number of arguments
+*   - Value* args: arguments
+*
+*   Return whether all arguments are numbers, error is already reported when they aren't
+*/
+static bool numberArgs(const char* name, int argCount, Value* args) {
+    for (int i = 0; i < argCount; i++) {
+        if (!IS_NUMBER(args[i])) {
+            nativeError("%s() expects numbers.", name);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Native function - Square root
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: number
+*
+*   Return square root of the number
+*/
+static Value sqrtNative(int argCount, Value* args) {
+    if (!numberArgs("sqrt", argCount, args)) return UNDEFINED_VAL;
+    return NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+}
+
+/* Native function - Round down
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: number
+*
+*   Return largest integer not greater than the number
+*/
+static Value floorNative(int argCount, Value* args) {
+    if (!numberArgs("floor", argCount, args)) return UNDEFINED_VAL;
+    return NUMBER_VAL(floor(AS_NUMBER(args[0])));
+}
+
+/* Native function - Absolute value
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: number
+*
+*   Return number without its sign
+*/
+static Value absNative(int argCount, Value* args) {
+    if (!numberArgs("abs", argCount, args)) return UNDEFINED_VAL;
+    return NUMBER_VAL(fabs(AS_NUMBER(args[0])));
+}
+
+/* Native function - Power
+*   Arguments:
+*   - int argCount: 2
+*   - Value* args: base, exponent
+*
+*   Return base raised to exponent
+*/
+static Value powNative(int argCount, Value* args) {
+    if (!numberArgs("pow", argCount, args)) return UNDEFINED_VAL;
+    return NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+}
+
+/* Native function - Smallest of numbers
+*   Arguments:
+*   - int argCount: at least 1
+*   - Value* args: numbers
+*
+*   Return the smallest number
+*/
+static Value minNative(int argCount, Value* args) {
+    if (argCount == 0) return nativeError("min() expects at least 1 argument.");
+    if (!numberArgs("min", argCount, args)) return UNDEFINED_VAL;
+    double result = AS_NUMBER(args[0]);
+    for (int i = 1; i < argCount; i++) {
+        if (AS_NUMBER(args[i]) < result) result = AS_NUMBER(args[i]);
+    }
+    return NUMBER_VAL(result);
+}
+
+/* Native function - Largest of numbers
+*   Arguments:
+*   - int argCount: at least 1
+*   - Value* args: numbers
+*
+*   Return the largest number
+*/
+static Value maxNative(int argCount, Value* args) {
+    if (argCount == 0) return nativeError("max() expects at least 1 argument.");
+    if (!numberArgs("max", argCount, args)) return UNDEFINED_VAL;
+    double result = AS_NUMBER(args[0]);
+    for (int i = 1; i < argCount; i++) {
+        if (AS_NUMBER(args[i]) > result) result = AS_NUMBER(args[i]);
+    }
+    return NUMBER_VAL(result);
+}
+
+/* Flatten string argument of io native in place, the flat string stays reachable on the stack
+*   Arguments:
+*   - const char* name: of the native, for error message
+*   - Value* arg: argument to check
+*
+*   Return characters of the string, NULL when argument isn't string and error is already reported
+*/
+static const char* stringArg(const char* name, Value* arg) {
+    if (IS_ROPE(*arg)) *arg = OBJ_VAL(flattenRope(AS_ROPE(*arg)));
+    if (!IS_STRING(*arg)) {
+        nativeError("%s() expects a string.", name);
+        return NULL;
+    }
+    return AS_CSTRING(*arg);
+}
+
+/* Read whole stream into a string. Characters are read into the array the string then owns, so they're never copied
+*   Arguments:
+*   - FILE* file: to read until its end
+*
+*   Return read string, NULL when reading failed or content is too long for a string
+*/
+static ObjString* readStream(FILE* file) {
+    // Regular files are read in one call, streams that can't tell their size in doubling chunks
+    size_t capacity = IO_READ_CHUNK;
+    long start = ftell(file); // Stdin may be partly read already
+    if (start >= 0 && fseek(file, 0, SEEK_END) == 0) {
+        long end = ftell(file);
+        if (end >= start) capacity = (size_t)(end - start) + 1; // +1 lets the first read see the end
+        fseek(file, start, SEEK_SET);
+    }
+    if (capacity > INT_MAX) return NULL;
+
+    char* chars = ALLOCATE(char, capacity);
+    size_t length = 0;
+    for (;;) {
+        length += fread(chars + length, 1, capacity - length, file);
+        if (length < capacity) break;
+        if (capacity > INT_MAX / 2) {
+            FREE_ARRAY(char, chars, capacity);
+            return NULL;
+        }
+        chars = GROW_ARRAY(char, chars, capacity, capacity * 2);
+        capacity *= 2;
+    }
+    if (ferror(file)) {
+        FREE_ARRAY(char, chars, capacity);
+        return NULL;
+    }
+
+    if (capacity != length + 1) chars = GROW_ARRAY(char, chars, capacity, length + 1); // String owns exactly length + 1
+    chars[length] = '\0';
+    return takeString(chars, (int)length);
+}
+
+/* Native function - Read whole file
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: path of the file, "-" for stdin
+*
+*   Return content of the file as a string
+*/
+static Value readFileNative(int argCount, Value* args) {
+    const char* path = stringArg("readFile", &args[0]);
+    if (path == NULL) return UNDEFINED_VAL;
+
+    bool standardInput = strcmp(path, "-") == 0;
+    if (standardInput) flushOutput(&vm.output); // Whoever types input should see what program printed so far
+    FILE* file = standardInput ? stdin : fopen(path, "rb");
+    if (file == NULL) return nativeError("Could not open file '%s'.", path);
+    ObjString* content = readStream(file);
+    if (!standardInput) fclose(file);
+    if (content == NULL) return nativeError("Could not read file '%s'.", path);
+    return OBJ_VAL(content);
+}
+
+/* Write value to file the way print writes it, without newline
+*   Arguments:
+*   - const char* name: of the native, for error message
+*   - Value* args: path of the file and value to write
+*   - const char* mode: of fopen, "wb" to replace file or "ab" to append to it
+*
+*   Return true, UNDEFINED_VAL after error
+*/
+static Value writeFileWith(const char* name, Value* args, const char* mode) {
+    const char* path = stringArg(name, &args[0]);
+    if (path == NULL) return UNDEFINED_VAL;
+    FILE* file = fopen(path, mode);
+    if (file == NULL) return nativeError("Could not open file '%s'.", path);
+
+    // Short values are batched in the buffer, strings longer than it are written straight from the heap
+    char buffer[IO_WRITE_BUFFER];
+    Output output;
+    initOutput(&output, file, buffer, sizeof(buffer));
+    writeValue(&output, args[1]);
+    freeOutput(&output);
+    bool failed = ferror(file) != 0;
+    if (fclose(file) != 0 || failed) return nativeError("Could not write file '%s'.", path);
+    return BOOL_VAL(true);
+}
+
+/* Native function - Replace content of file
+*   Arguments:
+*   - int argCount: 2
+*   - Value* args: path of the file, value to write
+*
+*   Return true
+*/
+static Value writeFileNative(int argCount, Value* args) {
+    return writeFileWith("writeFile", args, "wb");
+}
+
+/* Native function - Append to file, creating it when it doesn't exist
+*   Arguments:
+*   - int argCount: 2
+*   - Value* args: path of the file, value to write
+*
+*   Return true
+*/
+static Value appendFileNative(int argCount, Value* args) {
+    return writeFileWith("appendFile", args, "ab");
+}
+
+/* Native function - Read line from stdin
+*   Arguments:
+*   - int argCount: 0
+*   - Value* args: disregarded
+*
+*   Return the line without its newline, nil at the end of input
+*/
+static Value readLineNative(int argCount, Value* args) {
+    flushOutput(&vm.output); // Prompt printed before has to be visible
+
+    size_t capacity = IO_LINE_INITIAL;
+    char* chars = ALLOCATE(char, capacity);
+    size_t length = 0;
+    for (;;) {
+        if (fgets(chars + length, (int)(capacity - length), stdin) == NULL) break;
+        length += strlen(chars + length);
+        if (length == 0 || chars[length - 1] == '\n') break;
+        if (capacity > INT_MAX / 2) break; // Longest string ends the line
+        chars = GROW_ARRAY(char, chars, capacity, capacity * 2);
+        capacity *= 2;
+    }
+    if (length == 0 && (feof(stdin) || ferror(stdin))) {
+        FREE_ARRAY(char, chars, capacity);
+        return NIL_VAL;
+    }
+
+    if (length > 0 && chars[length - 1] == '\n') length--;
+    chars = GROW_ARRAY(char, chars, capacity, length + 1); // String owns exactly length + 1
+    chars[length] = '\0';
+    return OBJ_VAL(takeString(chars, (int)length));
+}
+
+/* Native function - Print value without newline, buffered like print
+*   Arguments:
+*   - int argCount: 1
+*   - Value* args: value to print
+*
+*   Return nil
+*/
+static Value writeNative(int argCount, Value* args) {
+    writeValue(&vm.output, args[0]);
+    endPrint(&vm.output);
+    return NIL_VAL;
+}
+
+/* Native function - Write buffered output to stdout now
+*   Arguments:
+*   - int argCount: 0
+*   - Value* args: disregarded
+*
+*   Return nil
+*/
+static Value flushNative(int argCount, Value* args) {
+    flushOutput(&vm.output);
+    return NIL_VAL;
+}
+
+/* Natives every VM starts with. Their order decides global slots, which bytecode cache files depend on,
+so new ones go to the end
+*/
+static const NativeDef coreNatives[] = {
+    {"clock",       clockNative,        0},
+    {"len",         lenNative,          1},
+    {"append",      appendNative,       2},
+    {"fill",        fillNative,         2},
+    {"sum",         sumNative,          1},
+    {"scale",       scaleNative,        2},
+    {"sort",        sortNative,         1},
+    {"gcStat",      gcStatNative,       1},
+    {"loadModule",  loadModuleNative,   1},
+    {NULL,          NULL,               0},
+};
+
+// Math functions, loaded with loadModule("math")
+static const NativeDef mathNatives[] = {
+    {"sqrt",    sqrtNative,     1},
+    {"floor",   floorNative,    1},
+    {"abs",     absNative,      1},
+    {"pow",     powNative,      2},
+    {"min",     minNative,      NATIVE_VARIADIC},
+    {"max",     maxNative,      NATIVE_VARIADIC},
+    {NULL,      NULL,           0},
+};
+
+// File and stream functions, loaded with loadModule("io")
+static const NativeDef ioNatives[] = {
+    {"readFile",    readFileNative,     1},
+    {"writeFile",   writeFileNative,    2},
+    {"appendFile",  appendFileNative,   2},
+    {"readLine",    readLineNative,     0},
+    {"write",       writeNative,        1},
+    {"flush",       flushNative,        0},
+    {NULL,          NULL,               0},
+};
+
+/* Registered module of natives
+*
+*   Fields:
+*   - const char* name: of the module
+*   - const NativeDef* natives: functions of the module, ending with entry with NULL name
+*/
+typedef struct {
+    const char* name; // of the module
+    const NativeDef* natives; // functions of the module, ending with entry with NULL name
+} NativeModule;
+
+// Modules every VM can load, shared by the whole process
+static NativeModule modules[NATIVE_MODULES_MAX] = {
+    {"core", coreNatives},
+    {"math", mathNatives},
+    {"io", ioNatives},
+};
+static int moduleCount = 3; // Number of registered modules
+
+/* Register module of native functions for every VM, which loads it with loadModule(name) in Lox.
+*   Registry is shared by the process and isn't synchronized, so modules have to be registered before VMs start
+*   Arguments:
+*   - const char* name: of the module, module registered with the same name before is replaced
+*   - const NativeDef* natives: functions of the module, ending with entry with NULL name, has to outlive VMs
+*
+*   Return whether module was registered, false when registry is full
+*/
+bool registerNativeModule(const char* name, const NativeDef* natives) {
+    for (int i = 0; i < moduleCount; i++) {
+        if (strcmp(modules[i].name, name) == 0) {
+            modules[i].natives = natives;
+            return true;
+        }
+    }
+    if (moduleCount == NATIVE_MODULES_MAX) return false;
+    modules[moduleCount].name = name;
+    modules[moduleCount].natives = natives;
+    moduleCount++;
+    return true;
+}
+
+/* Define native function in globals
+*   Arguments:
+*   - const NativeDef* native: to define
+*/
+static void defineNative(const NativeDef* native) {
+    // Name and function stay on the stack while slot reservation can trigger GC. Loading can run inside a native call,
+    // so stack isn't empty
+    push(OBJ_VAL(internString(native->name, (int)strlen(native->name))));
+    push(OBJ_VAL(newNative(native->function, native->arity)));
+    int slot = globalSlot(AS_STRING(vm.stackTop[-2]));
+    vm.globalValues[slot] = vm.stackTop[-1];
+    pop();
+    pop();
+}
+
+/* Define functions of registered module as globals of current VM, replacing globals with the same names
+*   Arguments:
+*   - const char* name: of the module
+*
+*   Return whether module was found
+*/
+bool loadNativeModule(const char* name) {
+    for (int i = 0; i < moduleCount; i++) {
+        if (strcmp(modules[i].name, name) != 0) continue;
+        for (const NativeDef* native = modules[i].natives; native->name != NULL; native++) {
+            defineNative(native);
+        }
+        return true;
+    }
+    return false;
+}
+
+/* Report runtime error from native function, arguments behave like in printf
+*   Arguments:
+*   - const char* format: of the message
+*   - ... - arbitrary number of arguments passed to vsnprintf
+*
+*   Return UNDEFINED_VAL, for native to return it as its result
+*/
+Value nativeError(const char* format, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    runtimeError("%s", message);
+    return UNDEFINED_VAL;
+}
+
+/* Keep object created by native reachable while native allocates more, stack above arguments is free for it
+*   Arguments:
+*   - Value value: to keep, at most NATIVE_ROOTS_MAX at once
+*/
+void pushRoot(Value value) {
+    push(value); // Calls leave STACK_HEADROOM slots above arguments, which is more than NATIVE_ROOTS_MAX
+}
+
+/* Release values kept by pushRoot(), before native returns
+*   Arguments:
+*   - int count: of values to release
+*/
+void popRoots(int count) {
+    vm.stackTop -= count;
+}
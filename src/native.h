@@ -0,0 +1,65 @@
+#ifndef clox_native_h
+#define clox_native_h
+
+#include "object.h"
+
+#define NATIVE_VARIADIC -1 // Arity of native taking any number of arguments, it checks them itself
+#define NATIVE_ROOTS_MAX 4 // Values a native can keep on the stack with pushRoot() at once
+#define NATIVE_MODULES_MAX 32 // Modules that can be registered, built-in ones included
+#define IO_READ_CHUNK (64 * 1024) // First read of stream that can't tell its size, doubled until it's read whole
+#define IO_WRITE_BUFFER 4096 // Buffer of writeFile() and appendFile(), longer strings skip it
+#define IO_LINE_INITIAL 128 // Capacity readLine() starts with, doubled for longer lines
+
+/* Native function with its name in Lox, entry of module's array that ends with entry with NULL name
+*
+*   Fields:
+*   - const char* name: of the global the function is defined as
+*   - NativeFn function: implementation
+*   - int arity: number of arguments checked before the call, or NATIVE_VARIADIC
+*/
+typedef struct {
+    const char* name; // of the global the function is defined as
+    NativeFn function; // implementation
+    int arity; // number of arguments checked before the call, or NATIVE_VARIADIC
+} NativeDef;
+
+/* Register module of native functions for every VM, which loads it with loadModule(name) in Lox.
+*   Registry is shared by the process and isn't synchronized, so modules have to be registered before VMs start
+*   Arguments:
+*   - const char* name: of the module, module registered with the same name before is replaced
+*   - const NativeDef* natives: functions of the module, ending with entry with NULL name, has to outlive VMs
+*
+*   Return whether module was registered, false when registry is full
+*/
+bool registerNativeModule(const char* name, const NativeDef* natives);
+
+/* Define functions of registered module as globals of current VM, replacing globals with the same names
+*   Arguments:
+*   - const char* name: of the module
+*
+*   Return whether module was found
+*/
+bool loadNativeModule(const char* name);
+
+/* Report runtime error from native function, arguments behave like in printf
+*   Arguments:
+*   - const char* format: of the message
+*   - ... - arbitrary number of arguments passed to vsnprintf
+*
+*   Return UNDEFINED_VAL, for native to return it as its result
+*/
+Value nativeError(const char* format, ...);
+
+/* Keep object created by native reachable while native allocates more, stack above arguments is free for it
+*   Arguments:
+*   - Value value: to keep, at most NATIVE_ROOTS_MAX at once
+*/
+void pushRoot(Value value);
+
+/* Release values kept by pushRoot(), before native returns
+*   Arguments:
+*   - int count: of values to release
+*/
+void popRoots(int count);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -18,12 +19,8 @@
 *   Return generic Obj pointer of allocated object. Returned object should be casted to appropriate object type
 */
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = allocateSlot(size); // Comes with GC flags set
     object->type = type;
-    object->isMarked = false;
-
-    object->next = vm.objects;
-    vm.objects = object;
 
     #ifdef DEBUG_LOG_GC
         printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -46,6 +43,25 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     return bound;
 }
 
+/* Create shape
+*   Arguments:
+*   - Shape* parent: shape to extend, NULL for root shape
+*   - ObjString* name: of the added field, NULL for root shape
+*
+*   Return newly created shape, not linked to the parent yet
+*/
+static Shape* newShape(Shape* parent, ObjString* name) {
+    Shape* shape = ALLOCATE(Shape, 1);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    shape->id = vm.nextShapeId++;
+    shape->transitions = NULL;
+    shape->transitionCount = 0;
+    shape->transitionCapacity = 0;
+    return shape;
+}
+
 /* Create class object
 *   Arguments:
 *   - ObjString* name
@@ -53,9 +69,14 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
 *   Return newly created object
 */
 ObjClass* newClass(ObjString* name) {
+    Shape* root = newShape(NULL, NULL); // Allocated before the class, so GC can't find class without its root shape
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS); // Allocate memory for object
     klass->name = name;
     initTable(&klass->methods); // Initialize hash table for methods
+    klass->id = vm.nextClassId++;
+    klass->rootShape = root;
+    klass->shapeCount = 1;
+    klass->fieldsHint = 0;
     return klass;
 }
 
@@ -85,7 +106,10 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION); // Allocate memory for object
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxSlots = 0;
     function->name = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
     initChunk(&function->chunk); // Init chunk for the function opcodes that will be added later
     return function;
 }
@@ -97,37 +121,195 @@ ObjFunction* newFunction() {
 *   Return newly created object
 */
 ObjInstance* newInstance(ObjClass* klass) {
+    // Fields are allocated before the instance, so GC can't sweep the instance that is not on the stack yet
+    int capacity = klass->fieldsHint;
+    Value* fields = ALLOCATE(Value, capacity);
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE); // Allocate memory for object
     instance->klass = klass;
-    initTable(&instance->fields); // Init hash table for instance fields
+    instance->shape = klass->rootShape;
+    instance->fields = fields;
+    instance->fieldCapacity = capacity;
+    initTable(&instance->dictionary); // Init hash table used only in dictionary mode
     return instance;
 }
 
+/* Find slot of field in shape
+*   Arguments:
+*   - Shape* shape: to look in
+*   - ObjString* name: of the field
+*
+*   Return slot index, -1 if shape has no such field
+*/
+int shapeFindSlot(Shape* shape, ObjString* name) {
+    // Walk towards the root, every shape knows only its last field
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (shape->name == name) return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+/* Get shape with one more field, creating it if necessary
+*   Arguments:
+*   - ObjClass* klass: owning the transition tree
+*   - Shape* shape: to extend
+*   - ObjString* name: of the added field
+*
+*   Return shape after adding the field, NULL if instance should go into dictionary mode
+*/
+static Shape* shapeTransition(ObjClass* klass, Shape* shape, ObjString* name) {
+    for (int i = 0; i < shape->transitionCount; i++) {
+        if (shape->transitions[i]->name == name) return shape->transitions[i];
+    }
+    if (shape->fieldCount >= SHAPE_MAX_FIELDS || klass->shapeCount >= SHAPE_MAX_PER_CLASS) return NULL;
+
+    // Grow transitions array first, so GC running in between never sees half linked shape
+    if (shape->transitionCapacity < shape->transitionCount + 1) {
+        int oldCapacity = shape->transitionCapacity;
+        int capacity = oldCapacity < 2 ? 2 : oldCapacity * 2; // Most shapes have a single transition
+        shape->transitions = GROW_ARRAY(Shape*, shape->transitions, oldCapacity, capacity);
+        shape->transitionCapacity = capacity;
+    }
+    writeBarrier(OBJ_VAL(name)); // Class owning the tree can be already blackened
+    Shape* next = newShape(shape, name);
+    shape->transitions[shape->transitionCount++] = next;
+    klass->shapeCount++;
+    return next;
+}
+
+/* Move instance fields into hash table
+*   Arguments:
+*   - ObjInstance* instance: in shape mode
+*/
+static void toDictionary(ObjInstance* instance) {
+    // Instance keeps its shape until done, so GC triggered by table growth still marks all fields
+    for (Shape* shape = instance->shape; shape->parent != NULL; shape = shape->parent) {
+        tableSet(&instance->dictionary, shape->name, instance->fields[shape->fieldCount - 1]);
+    }
+    FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+    instance->fields = NULL;
+    instance->fieldCapacity = 0;
+    instance->shape = NULL;
+}
+
+/* Get instance field without the help of inline cache
+*   Arguments:
+*   - ObjInstance* instance: to get field from
+*   - ObjString* name: of the field
+*   - Value* value: pointer to the value that should be updated with the found field
+*
+*   Return whether field found
+*/
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value) {
+    if (instance->shape == NULL) return tableGet(&instance->dictionary, name, value);
+
+    int slot = shapeFindSlot(instance->shape, name);
+    if (slot == -1) return false;
+    *value = instance->fields[slot];
+    return true;
+}
+
+/* Set or add instance field, moving instance to the next shape or to dictionary mode
+*   Arguments:
+*   - ObjInstance* instance: to set field of. Has to be reachable by GC, as fields can be reallocated
+*   - ObjString* name: of the field
+*   - Value value: to set
+*/
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value) {
+    if (instance->shape != NULL) {
+        int slot = shapeFindSlot(instance->shape, name);
+        if (slot != -1) { // Existing field
+            instance->fields[slot] = value;
+            return;
+        }
+
+        Shape* next = shapeTransition(instance->klass, instance->shape, name);
+        if (next != NULL) {
+            slot = next->fieldCount - 1;
+            if (instance->fieldCapacity < next->fieldCount) {
+                int oldCapacity = instance->fieldCapacity;
+                int capacity = GROW_CAPACITY(oldCapacity);
+                instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, capacity);
+                instance->fieldCapacity = capacity;
+            }
+            instance->fields[slot] = value;
+            instance->shape = next; // Only now GC can see the new slot
+            if (instance->klass->fieldsHint < next->fieldCount) instance->klass->fieldsHint = next->fieldCount;
+            return;
+        }
+
+        toDictionary(instance); // Too many fields or shapes
+    }
+    tableSet(&instance->dictionary, name, value);
+}
+
 /* Create native function object
 *   Arguments:
 *   - NativeFn function: pointer to native function
+*   - int arity: number of arguments the function takes
 *
 *   Return newly created object
 */
-ObjNative* newNative(NativeFn function) {
+ObjNative* newNative(NativeFn function, int arity) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE); // Allocate memory for object
     native->function = function;
+    native->arity = arity;
     return native;
 }
 
-/* Allocate string on the heap
+/* Create list object
+*   Arguments:
+*   - int count: number of elements, set to nil
+*
+*   Return newly created object
+*/
+ObjList* newList(int count) {
+    // Elements are allocated before the list, so GC can't sweep the list that is not on the stack yet
+    Value* values = ALLOCATE(Value, count);
+    for (int i = 0; i < count; i++) {
+        values[i] = NIL_VAL;
+    }
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST); // Allocate memory for object
+    initValueArray(&list->items);
+    list->items.values = values;
+    list->items.count = count;
+    list->items.capacity = count;
+    return list;
+}
+
+/* Allocate string on the heap, with characters inline when the whole object fits into a slab slot
 *   Arguments:
 *   - char* chars: string itself
 *   - int length: of string
-*   - uint32_t hash
+*   - uint32_t hash: 0 if not computed yet
+*   - bool intern: whether to add string to VM's strings table
+*   - bool take: whether to claim ownership of chars, otherwise they are copied
 *
 *   Return allocated object
 */
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING); // Allocate memory for object
+static ObjString* allocateString(char* chars, int length, uint32_t hash, bool intern, bool take) {
+    size_t inlineSize = sizeof(ObjString) + length + 1;
+    bool inlined = inlineSize <= SLOT_SIZE_MAX;
+
+    char* heapChars = take ? chars : NULL;
+    if (!inlined && !take) { // Separate buffer allocated before the object, as allocation can trigger GC
+        heapChars = ALLOCATE(char, length + 1);
+        memcpy(heapChars, chars, length);
+        heapChars[length] = '\0'; // Terminate string
+    }
+
+    ObjString* string = (ObjString*)allocateObject(inlined ? inlineSize : sizeof(ObjString), OBJ_STRING);
     string->length = length;
-    string->chars = chars;
     string->hash = hash;
+    string->interned = intern;
+    if (inlined) {
+        string->chars = string->storage;
+        memcpy(string->storage, chars, length);
+        string->storage[length] = '\0'; // Terminate string
+        if (take) FREE_ARRAY(char, chars, length + 1); // Taken buffer is no longer needed
+    } else {
+        string->chars = heapChars;
+    }
+    if (!intern) return string;
 
     push(OBJ_VAL(string)); // Storing string on the stack so it won't be cleaned by GC if GC trigered during tableSet
     tableSet(&vm.strings, string, NIL_VAL); // Adding string to the VM's strings hash table
@@ -135,7 +317,9 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
     return string;
 }
 
-/* Calculate string's hash using FNV-1a algorithm
+#define HASH_WORDS_MIN_LENGTH 32 // Longer strings are hashed eight characters at a time
+
+/* Calculate string's hash using FNV-1a algorithm, over words instead of bytes for long strings
 *   Arguments:
 *   - char* key: string to hash
 *   - int length: of string to hash
@@ -143,6 +327,22 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
 *   Return calculated hash
 */
 static uint32_t hashString(const char* key, int length) {
+    if (length >= HASH_WORDS_MIN_LENGTH) {
+        uint64_t hash = 14695981039346656037u; // Initial constant (64-bit FNV offset basis)
+        int i = 0;
+        for (; i + 8 <= length; i += 8) { // For every eight characters
+            uint64_t word;
+            memcpy(&word, key + i, sizeof(word)); // Possibly unaligned read
+            hash ^= word;
+            hash *= 1099511628211u; // 64-bit FNV prime
+        }
+        for (; i < length; i++) { // Remaining characters
+            hash ^= (uint8_t)key[i];
+            hash *= 1099511628211u;
+        }
+        return (uint32_t)(hash ^ (hash >> 32)); // Fold high bits, which depend on all characters, into low ones
+    }
+
     uint32_t hash = 2166136261u; // Initial constant (FNV offset basis)
     for (int i = 0; i < length; i++) { // For every character
         hash ^= (uint8_t)key[i]; // XOR current hash value with character
@@ -151,14 +351,98 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
+/* Get hash of string, computing it on first use for strings that were not interned
+*   Arguments:
+*   - ObjString* string: to get hash of
+*
+*   Return hash of string
+*/
+uint32_t stringHash(ObjString* string) {
+    if (string->hash == 0) string->hash = hashString(string->chars, string->length); // Zero hash is just recomputed
+    return string->hash;
+}
+
+/* Create rope object concatenating two strings
+*   Arguments:
+*   - Obj* left: first part, ObjString or ObjRope. Has to be reachable by GC
+*   - Obj* right: second part, ObjString or ObjRope. Has to be reachable by GC
+*
+*   Return newly created object
+*/
+ObjRope* newRope(Obj* left, Obj* right) {
+    // Already flattened ropes are replaced by their strings, so their parts are not kept alive
+    if (left->type == OBJ_ROPE && ((ObjRope*)left)->flat != NULL) left = (Obj*)((ObjRope*)left)->flat;
+    if (right->type == OBJ_ROPE && ((ObjRope*)right)->flat != NULL) right = (Obj*)((ObjRope*)right)->flat;
+
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE); // Allocate memory for object
+    rope->length = stringLength(left) + stringLength(right);
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return rope;
+}
+
+/* Copy characters of string or rope into buffer
+*   Arguments:
+*   - Obj* object: ObjString or ObjRope to copy
+*   - char* chars: buffer with space for all characters of object
+*/
+static void writeChars(Obj* object, char* chars) {
+    while (object->type == OBJ_ROPE) {
+        ObjRope* rope = (ObjRope*)object;
+        if (rope->flat != NULL) { // Parts already released
+            object = (Obj*)rope->flat;
+            break;
+        }
+
+        // Recursing only into the shorter part and looping over the longer one keeps depth below log2 of length
+        int leftLength = stringLength(rope->left);
+        if (leftLength < rope->length - leftLength) {
+            writeChars(rope->left, chars);
+            chars += leftLength;
+            object = rope->right;
+        } else {
+            writeChars(rope->right, chars + leftLength);
+            object = rope->left;
+        }
+    }
+
+    ObjString* string = (ObjString*)object;
+    memcpy(chars, string->chars, string->length);
+}
+
+/* Copy characters of rope into flat interned string, released parts can be then collected
+*   Arguments:
+*   - ObjRope* rope: to flatten. Has to be reachable by GC
+*
+*   Return interned string with characters of the rope
+*/
+ObjString* flattenRope(ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    char* chars = ALLOCATE(char, rope->length + 1); // Parts are still referenced by the rope if GC triggered
+    writeChars((Obj*)rope, chars);
+    chars[rope->length] = '\0'; // Terminate string
+
+    ObjString* flat = takeString(chars, rope->length); // Hashed and interned only now, if short enough
+    writeBarrier(OBJ_VAL(flat)); // Rope can already be traced
+    rope->flat = flat;
+    rope->left = NULL;
+    rope->right = NULL;
+    return flat;
+}
+
 /* Claim ownership of the passed string
 *   Arguments:
 *   - char* chars: string to be taken
 *   - int length: of string
 *
-*   Return allocated object
+*   Return allocated object, interned unless longer than STRING_INTERN_MAX
 */
 ObjString* takeString(char* chars, int length) {
+    // Long strings are neither hashed nor interned, they are compared by characters instead
+    if (length > STRING_INTERN_MAX) return allocateString(chars, length, 0, false, true);
+
     uint32_t hash = hashString(chars, length); // Calculate hash
 
     // Try to find string in the vm's strings table. If found then free passed chars as string already interned
@@ -168,30 +452,57 @@ ObjString* takeString(char* chars, int length) {
         return interned;
     }
 
-    // Returning object without allocating new memory for <chars> effectively claiming ownership over them
-    return allocateString(chars, length, hash);
+    // Claiming ownership over <chars>, they are freed if copied inline
+    return allocateString(chars, length, hash, true, true);
 }
 
-/* Copy string to the heap without taking ownership
+/* Copy string to the heap, interning it regardless of length
 *   Arguments:
 *   - char* chars: string to be copied
 *   - int length: of string
 *
-*   Return allocated object
+*   Return interned object
 */
-ObjString* copyString(const char* chars, int length) {
+ObjString* internString(const char* chars, int length) {
     uint32_t hash = hashString(chars, length); // Calculate hash
 
     // Try to find string in the vm's strings table. If found then return interned string
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
     if (interned != NULL) return interned; 
 
-    // If string not interned allocate new memory and copy string
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0'; // Terminate string
+    return allocateString((char*)chars, length, hash, true, false); // Copied, so chars are not modified
+}
 
-    return allocateString(heapChars, length, hash);
+/* Copy string to the heap without taking ownership
+*   Arguments:
+*   - char* chars: string to be copied
+*   - int length: of string
+*
+*   Return allocated object, interned unless longer than STRING_INTERN_MAX
+*/
+ObjString* copyString(const char* chars, int length) {
+    if (length <= STRING_INTERN_MAX) return internString(chars, length);
+
+    // Long strings are neither hashed nor interned, they are compared by characters instead
+    return allocateString((char*)chars, length, 0, false, false);
+}
+
+/* Copy string with already known hash to the heap, used for strings loaded from bytecode cache
+*   Arguments:
+*   - char* chars: string to be copied
+*   - int length: of string
+*   - uint32_t hash: of string, 0 for long strings not hashed yet
+*   - bool intern: whether string goes to VM's strings table
+*
+*   Return interned or newly allocated object
+*/
+ObjString* copyHashedString(const char* chars, int length, uint32_t hash, bool intern) {
+    if (!intern) return allocateString((char*)chars, length, hash, false, false);
+
+    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    if (interned != NULL) return interned;
+
+    return allocateString((char*)chars, length, hash, true, false); // Copied, so chars are not modified
 }
 
 /* Create upvalue object
@@ -208,47 +519,101 @@ ObjUpvalue* newUpvalue(Value* slot) {
     return upvalue;
 }
 
-/* Print function name
+/* Write function name
 *   Arguments:
+*   - Output* output: to write to
 *   - ObjFunction* function
 */
-static void printFunction(ObjFunction* function) {
+static void writeFunction(Output* output, ObjFunction* function) {
     if (function->name == NULL) {
-        printf("<script>");
+        writeOutput(output, "<script>", 8);
+        return;
+    }
+    writeOutput(output, "<fn ", 4);
+    writeOutput(output, function->name->chars, function->name->length);
+    writeOutput(output, ">", 1);
+}
+
+#define LIST_PRINT_DEPTH 16 // Deeper nested lists are printed as [...], which also stops on lists containing themselves
+
+/* Write list elements
+*   Arguments:
+*   - Output* output: to write to
+*   - ObjList* list
+*/
+static void writeList(Output* output, ObjList* list) {
+    static THREAD_LOCAL int depth = 0; // Number of lists being printed that contain this one
+    if (depth == LIST_PRINT_DEPTH) {
+        writeOutput(output, "[...]", 5);
         return;
     }
-    printf("<fn %s>", function->name->chars);
+
+    depth++;
+    writeOutput(output, "[", 1);
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0) writeOutput(output, ", ", 2);
+        writeValue(output, list->items.values[i]);
+    }
+    writeOutput(output, "]", 1);
+    depth--;
 }
 
-/* Print object
+/* Write object
 *   Arguments:
-*   - Value value: to print, must be of VAL_OBJ type
+*   - Output* output: to write to
+*   - Value value: to write, must be of VAL_OBJ type
 */
-void printObject(Value value) {
+void writeObject(Output* output, Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
-            printFunction(AS_BOUND_METHOD(value)->method->function);
+            writeFunction(output, AS_BOUND_METHOD(value)->method->function);
             break;
         case OBJ_CLASS:
-            printf("%s", AS_CLASS(value)->name->chars);
+            writeOutput(output, AS_CLASS(value)->name->chars, AS_CLASS(value)->name->length);
             break;
         case OBJ_CLOSURE:
-            printFunction(AS_CLOSURE(value)->function);
+            writeFunction(output, AS_CLOSURE(value)->function);
             break;
         case OBJ_FUNCTION:
-            printFunction(AS_FUNCTION(value));
+            writeFunction(output, AS_FUNCTION(value));
+            break;
+        case OBJ_INSTANCE: {
+            ObjString* name = AS_INSTANCE(value)->klass->name;
+            writeOutput(output, name->chars, name->length);
+            writeOutput(output, " instance", 9);
             break;
-        case OBJ_INSTANCE:
-            printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+        }
+        case OBJ_LIST:
+            writeList(output, AS_LIST(value));
             break;
         case OBJ_NATIVE:
-            printf("<native fn>");
+            writeOutput(output, "<native fn>", 11);
+            break;
+        case OBJ_ROPE: {
+            ObjRope* rope = AS_ROPE(value);
+            if (rope->flat != NULL) {
+                writeOutput(output, rope->flat->chars, rope->flat->length);
+                break;
+            }
+            // Printing does not need the string to be flat. Parts are copied straight into the buffer when they fit,
+            // otherwise into temporary buffer outside of GC heap
+            char* chars = reserveOutput(output, rope->length);
+            if (chars != NULL) {
+                writeChars((Obj*)rope, chars);
+                break;
+            }
+            chars = (char*)malloc(rope->length);
+            if (chars == NULL) exit(1);
+            writeChars((Obj*)rope, chars);
+            writeOutput(output, chars, rope->length);
+            free(chars);
             break;
+        }
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            writeOutput(output, AS_CSTRING(value), AS_STRING(value)->length);
             break;
         case OBJ_UPVALUE:
-            printf("upvalue");
+            writeOutput(output, "upvalue", 7);
             break;
     }
 }
\ No newline at end of file
@@ -8,13 +8,17 @@
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type) // Get type of object
 
+typedef struct JitCode JitCode; // Function compiled to machine code, defined by jit.h
+
 // Checks if object is of any given type
 #define IS_BOUND_METHOD(value)  isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value)         isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)       isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value)      isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value)          isObjType(value, OBJ_LIST)
 #define IS_NATIVE(value)        isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value)          isObjType(value, OBJ_ROPE)
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
 
 // Casts of objects to given type
@@ -23,7 +27,9 @@
 #define AS_CLOSURE(value)       ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)      ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance*)AS_OBJ(value))
+#define AS_LIST(value)          ((ObjList*)AS_OBJ(value))
 #define AS_NATIVE(value)        (((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value)          ((ObjRope*)AS_OBJ(value))
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
 
@@ -33,21 +39,27 @@ typedef enum {
     OBJ_CLOSURE,        // Closure
     OBJ_FUNCTION,       // Function
     OBJ_INSTANCE,       // Instance
+    OBJ_LIST,           // List of values
     OBJ_NATIVE,         // Native function
+    OBJ_ROPE,           // Concatenation of strings not flattened yet
     OBJ_STRING,         // String
     OBJ_UPVALUE         // Upvalue
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1) // Number of object types, size of tables indexed by ObjType
+
 /* Objects header struct
 *
 *   Fields:
 *   - ObjType type
 *   - bool isMarked: as accessible to not be freed by GC
-*   - struct Obj* next: object in the linked list
+*   - bool isFree: whether slab slot holding the object is unused
+*   - struct Obj* next: next free slot of the same size class, only while slot is unused
 */
 struct Obj {
     ObjType type;
     bool isMarked;
+    bool isFree;
     struct Obj* next;
 };
 
@@ -57,18 +69,24 @@ struct Obj {
 *   - Obj obj: object header
 *   - int arity: of the function (number of arguments)
 *   - int upvalueCount: number of function upvalues
+*   - int maxSlots: deepest stack the function reaches, counted from its slot 0
 *   - Chunk chunk: of the function opcodes to execute
 *   - ObjString* name: of the function
+*   - int hotness: calls and loop iterations counted towards JIT_THRESHOLD, -1 once function was compiled
+*   - JitCode* jit: machine code of the function, NULL while it's only interpreted
 */
 typedef struct {
     Obj obj; // object header
     int arity; // of the function (number of arguments)
     int upvalueCount; // number of function upvalues
+    int maxSlots; // deepest stack the function reaches, counted from its slot 0
     Chunk chunk; // of the function opcodes to execute
     ObjString* name; // of the function
+    int hotness; // calls and loop iterations counted towards JIT_THRESHOLD, -1 once function was compiled
+    JitCode* jit; // machine code of the function, NULL while it's only interpreted
 } ObjFunction;
 
-// Pointer to native function
+// Pointer to native function, returning UNDEFINED_VAL from nativeError() when it fails
 typedef Value (*NativeFn)(int argCount, Value* args);
 
 /* Native function object struct
@@ -76,27 +94,66 @@ typedef Value (*NativeFn)(int argCount, Value* args);
 *   Fields:
 *   - Obj obj: object header
 *   - NativeFn function
+*   - int arity: number of arguments the function takes, NATIVE_VARIADIC for any
 */
 typedef struct {
     Obj obj; // object header
     NativeFn function;
+    int arity; // number of arguments the function takes, NATIVE_VARIADIC for any
 } ObjNative;
 
+/* List object struct, dense array of values indexed from 0
+*
+*   Fields:
+*   - Obj obj: object header
+*   - ValueArray items: elements of the list
+*/
+typedef struct {
+    Obj obj; // object header
+    ValueArray items; // elements of the list
+} ObjList;
+
+#define STRING_INTERN_MAX 256 // Longer strings are not interned unless they are names
+
 /* String object struct
 *
 *   Fields:
 *    Obj obj: object header
 *    int length: of the string
-*    char* chars: pointer to first character
-*    uint32_t hash
+*    uint32_t hash: 0 until needed for strings that are not interned
+*    bool interned: whether string is in VM's strings table, so equal to other strings only by identity
+*    char* chars: pointer to first character, into storage when string fits into a slab slot
+*    char storage[]: characters of short string, allocated together with the object
 */
 struct ObjString {
     Obj obj; // object header
     int length; // of the string
-    char* chars; // pointer to first character
-    uint32_t hash;
+    uint32_t hash; // 0 until needed for strings that are not interned
+    bool interned; // whether string is in VM's strings table, so equal to other strings only by identity
+    char* chars; // pointer to first character, into storage when string fits into a slab slot
+    char storage[]; // characters of short string, allocated together with the object
 };
 
+#define ROPE_MIN_LENGTH 64 // Shorter concatenations are copied into flat string right away
+
+/* Rope object struct, result of concatenation whose characters are not copied, hashed nor interned
+until they are needed. Behaves as a string in the language
+*
+*   Fields:
+*    Obj obj: object header
+*    int length: of the whole string
+*    Obj* left: first part, ObjString or ObjRope, NULL once flattened
+*    Obj* right: second part, ObjString or ObjRope, NULL once flattened
+*    ObjString* flat: string with the same characters, NULL until flattened
+*/
+typedef struct {
+    Obj obj; // object header
+    int length; // of the whole string
+    Obj* left; // first part, ObjString or ObjRope, NULL once flattened
+    Obj* right; // second part, ObjString or ObjRope, NULL once flattened
+    ObjString* flat; // string with the same characters, NULL until flattened
+} ObjRope;
+
 /* Upvalue object struct
 *
 *   Fields:
@@ -127,17 +184,51 @@ typedef struct {
     int upvalueCount; // number of upvalues in linked list captured by closure
 } ObjClosure;
 
+#define SHAPE_MAX_FIELDS 64 // Instance with more fields falls back to dictionary mode
+#define SHAPE_MAX_PER_CLASS 256 // Instances of class with more shapes fall back to dictionary mode
+
+/* Shape (hidden class) struct describing which field is in which slot of instance
+Shapes of one class form a transition tree, each child adds one field to its parent.
+Shapes are owned by the class and freed together with it, they are not objects on their own
+*
+*   Fields:
+*   - struct Shape* parent: shape without the last field, NULL for the root shape
+*   - ObjString* name: of the last field, NULL for the root shape
+*   - int fieldCount: number of fields, the last one is in slot fieldCount - 1
+*   - uint32_t id: unique id of the shape, inline caches are keyed on it
+*   - struct Shape** transitions: pointer to array of child shapes
+*   - int transitionCount: number of child shapes
+*   - int transitionCapacity
+*/
+typedef struct Shape {
+    struct Shape* parent; // shape without the last field, NULL for the root shape
+    ObjString* name; // of the last field, NULL for the root shape
+    int fieldCount; // number of fields, the last one is in slot fieldCount - 1
+    uint32_t id; // unique id of the shape, inline caches are keyed on it
+    struct Shape** transitions; // pointer to array of child shapes
+    int transitionCount; // number of child shapes
+    int transitionCapacity;
+} Shape;
+
 /* Class object struct
 *
 *   Fields:
 *   Obj obj: object header
 *   ObjString* name
 *   Table methods: hash table of class methods
+*   uint32_t id: unique id of class and its current methods, inline caches are keyed on it
+*   Shape* rootShape: shape of instance without fields, root of class's transition tree
+*   int shapeCount: number of shapes in transition tree
+*   int fieldsHint: most fields any instance had, used as initial capacity of new instances
 */
 typedef struct {
     Obj obj; // object header
     ObjString* name;
     Table methods; // hash table of class methods
+    uint32_t id; // unique id of class and its current methods, inline caches are keyed on it
+    Shape* rootShape; // shape of instance without fields, root of class's transition tree
+    int shapeCount; // number of shapes in transition tree
+    int fieldsHint; // most fields any instance had, used as initial capacity of new instances
 } ObjClass;
 
 /* Class object struct
@@ -145,12 +236,18 @@ typedef struct {
 *   Fields:
 *   Obj obj: object header
 *   ObjClass* klass: parent class
-*   Table fields: of the instance
+*   Shape* shape: layout of fields, NULL when instance is in dictionary mode
+*   Value* fields: pointer to array of field values, indexed by shape's slots
+*   int fieldCapacity: capacity of fields array
+*   Table dictionary: fields of instance in dictionary mode
 */
 typedef struct {
     Obj obj; // object header
     ObjClass* klass; // parent class
-    Table fields; // of the instance
+    Shape* shape; // layout of fields, NULL when instance is in dictionary mode
+    Value* fields; // pointer to array of field values, indexed by shape's slots
+    int fieldCapacity; // capacity of fields array
+    Table dictionary; // fields of instance in dictionary mode
 } ObjInstance;
 
 /* Class object struct
@@ -205,20 +302,73 @@ ObjFunction* newFunction();
 */
 ObjInstance* newInstance(ObjClass* klass);
 
+/* Find slot of field in shape
+*   Arguments:
+*   - Shape* shape: to look in
+*   - ObjString* name: of the field
+*
+*   Return slot index, -1 if shape has no such field
+*/
+int shapeFindSlot(Shape* shape, ObjString* name);
+
+/* Get instance field without the help of inline cache
+*   Arguments:
+*   - ObjInstance* instance: to get field from
+*   - ObjString* name: of the field
+*   - Value* value: pointer to the value that should be updated with the found field
+*
+*   Return whether field found
+*/
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+
+/* Set or add instance field, moving instance to the next shape or to dictionary mode
+*   Arguments:
+*   - ObjInstance* instance: to set field of. Has to be reachable by GC, as fields can be reallocated
+*   - ObjString* name: of the field
+*   - Value value: to set
+*/
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+
 /* Create native function object
 *   Arguments:
 *   - NativeFn function: pointer to native function
+*   - int arity: number of arguments the function takes
 *
 *   Return newly created object
 */
-ObjNative* newNative(NativeFn function);
+ObjNative* newNative(NativeFn function, int arity);
+
+/* Create list object
+*   Arguments:
+*   - int count: number of elements, set to nil
+*
+*   Return newly created object
+*/
+ObjList* newList(int count);
+
+/* Create rope object concatenating two strings
+*   Arguments:
+*   - Obj* left: first part, ObjString or ObjRope. Has to be reachable by GC
+*   - Obj* right: second part, ObjString or ObjRope. Has to be reachable by GC
+*
+*   Return newly created object
+*/
+ObjRope* newRope(Obj* left, Obj* right);
+
+/* Copy characters of rope into flat string, released parts can be then collected
+*   Arguments:
+*   - ObjRope* rope: to flatten. Has to be reachable by GC
+*
+*   Return flat string with characters of the rope
+*/
+ObjString* flattenRope(ObjRope* rope);
 
 /* Claim ownership of the passed string
 *   Arguments:
 *   - char* chars: string to be taken
 *   - int length: of string
 *
-*   Return allocated object
+*   Return allocated object, interned unless longer than STRING_INTERN_MAX
 */
 ObjString* takeString(char* chars, int length);
 
@@ -227,10 +377,38 @@ ObjString* takeString(char* chars, int length);
 *   - char* chars: string to be copied
 *   - int length: of string
 *
-*   Return allocated object
+*   Return allocated object, interned unless longer than STRING_INTERN_MAX
 */
 ObjString* copyString(const char* chars, int length);
 
+/* Copy string to the heap, interning it regardless of length. Names used as table keys have to be interned
+*   Arguments:
+*   - char* chars: string to be copied
+*   - int length: of string
+*
+*   Return interned object
+*/
+ObjString* internString(const char* chars, int length);
+
+/* Copy string with already known hash to the heap, used for strings loaded from bytecode cache
+*   Arguments:
+*   - char* chars: string to be copied
+*   - int length: of string
+*   - uint32_t hash: of string, 0 for long strings not hashed yet
+*   - bool intern: whether string goes to VM's strings table
+*
+*   Return interned or newly allocated object
+*/
+ObjString* copyHashedString(const char* chars, int length, uint32_t hash, bool intern);
+
+/* Get hash of string, computing it on first use for strings that were not interned
+*   Arguments:
+*   - ObjString* string: to get hash of
+*
+*   Return hash of string
+*/
+uint32_t stringHash(ObjString* string);
+
 /* Create upvalue object
 *   Arguments:
 *   - Value* slot: pointer to where the closed-over variable lives
@@ -239,11 +417,12 @@ ObjString* copyString(const char* chars, int length);
 */
 ObjUpvalue* newUpvalue(Value* slot);
 
-/* Print object
+/* Write object
 *   Arguments:
-*   - Value value: to print, must be of VAL_OBJ type
+*   - Output* output: to write to
+*   - Value value: to write, must be of VAL_OBJ type
 */
-void printObject(Value value);
+void writeObject(Output* output, Value value);
 
 /* Check if the object is of given type
 *   Arguments:
@@ -256,4 +435,24 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/* Check if the value is a string, either flat or rope
+*   Arguments:
+*   - Value value: to check
+*
+*   Return true if value behaves as a string
+*/
+static inline bool isString(Value value) {
+    return IS_OBJ(value) && (AS_OBJ(value)->type == OBJ_STRING || AS_OBJ(value)->type == OBJ_ROPE);
+}
+
+/* Get length of string or rope
+*   Arguments:
+*   - Obj* object: ObjString or ObjRope
+*
+*   Return number of characters
+*/
+static inline int stringLength(Obj* object) {
+    return object->type == OBJ_ROPE ? ((ObjRope*)object)->length : ((ObjString*)object)->length;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,780 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+#include "vm.h"
+
+/* Decoded instruction that optimizer works on
+*
+*   Fields:
+*   - uint8_t op: opcode. Backward jumps are also stored as OP_JUMP, direction is chosen again when encoding
+*   - bool wide: whether instruction is prefixed by OP_WIDE, so its first operand takes two bytes
+*   - uint8_t operands[5]: operand bytes of fixed size instructions, jump operand is replaced by target
+*   - const uint8_t* upvalues: pointer to closure's isLocal/index pairs in the original code
+*   - int target: index of instruction that jump lands on
+*   - int line: source code line from which instruction originates
+*   - int offset: of the instruction in the original code, used to keep threaded jumps in range
+*   - bool isTarget: whether any jump lands on the instruction
+*/
+typedef struct {
+    uint8_t op; // opcode. Backward jumps are also stored as OP_JUMP, direction is chosen again when encoding
+    bool wide; // whether instruction is prefixed by OP_WIDE, so its first operand takes two bytes
+    uint8_t operands[5]; // operand bytes of fixed size instructions, jump operand is replaced by target
+    const uint8_t* upvalues; // pointer to closure's isLocal/index pairs in the original code
+    int target; // index of instruction that jump lands on
+    int line; // source code line from which instruction originates
+    int offset; // of the instruction in the original code, used to keep threaded jumps in range
+    bool isTarget; // whether any jump lands on the instruction
+} Instruction;
+
+/* Get first operand of instruction, which is two bytes long when widened
+*   Arguments:
+*   - Instruction* instruction: to read
+*
+*   Return constant, frame slot or upvalue index
+*/
+static int indexOperand(Instruction* instruction) {
+    if (instruction->wide) return (instruction->operands[0] << 8) | instruction->operands[1];
+    return instruction->operands[0];
+}
+
+/* Get number of operand bytes following the opcode
+*   Arguments:
+*   - Chunk* chunk: containing constants table
+*   - Instruction* instruction: with opcode and operands, first operand is needed for OP_CLOSURE
+*
+*   Return number of bytes after the opcode, not counting OP_WIDE prefix
+*/
+static int operandLength(Chunk* chunk, Instruction* instruction) {
+    if (instruction->op == OP_CLOSURE) { // Function constant followed by isLocal/index pair for every upvalue
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[indexOperand(instruction)]);
+        return instruction->wide ? 2 + function->upvalueCount * 3 : 1 + function->upvalueCount * 2;
+    }
+
+    int wide = instruction->wide ? 1 : 0; // Widened index takes one more byte
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_BUILD_LIST:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 1 + wide;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_LOOP:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SUPER_INVOKE:
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_INCREMENT_LOCAL:
+        case OP_CALL_LOCAL:
+            return 2 + wide;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_METHOD:
+        case OP_GET_BOUND_METHOD:
+            return 3 + wide;
+        case OP_INVOKE:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+        case OP_GREATER_LOCAL_CONSTANT_JUMP:
+            return 4 + wide;
+        default:
+            return 0;
+    }
+}
+
+// Whether opcode ends with two bytes jump offset
+static bool isJumpOp(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_LOOP:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+        case OP_GREATER_LOCAL_CONSTANT_JUMP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether instruction is a jump stored with target index
+static bool isJump(Instruction* instruction) {
+    return isJumpOp(instruction->op);
+}
+
+/* Get frame slot read by local getter
+*   Arguments:
+*   - Instruction* instruction: to check
+*   - int* slot: output for the slot
+*
+*   Return whether instruction is any form of OP_GET_LOCAL
+*/
+static bool localSlot(Instruction* instruction, int* slot) {
+    switch (instruction->op) {
+        case OP_GET_LOCAL: *slot = indexOperand(instruction); return true;
+        case OP_GET_LOCAL_0: *slot = 0; return true;
+        case OP_GET_LOCAL_1: *slot = 1; return true;
+        case OP_GET_LOCAL_2: *slot = 2; return true;
+        case OP_GET_LOCAL_3: *slot = 3; return true;
+        default: return false;
+    }
+}
+
+/* Decode chunk's bytecode into instructions array
+*   Arguments:
+*   - Chunk* chunk: to decode
+*   - Instruction* code: array big enough to hold instruction per byte
+*
+*   Return number of decoded instructions
+*/
+static int decode(Chunk* chunk, Instruction* code) {
+    int* indexAt = ALLOCATE(int, chunk->count + 1); // Instruction index starting at the given offset
+    int count = 0;
+
+    for (int offset = 0; offset < chunk->count;) {
+        Instruction* instruction = &code[count];
+        instruction->wide = chunk->code[offset] == OP_WIDE;
+        int opOffset = instruction->wide ? offset + 1 : offset; // Offset of the opcode after the prefix
+        instruction->op = chunk->code[opOffset];
+        for (int i = 0; i < 5; i++) {
+            instruction->operands[i] = opOffset + 1 + i < chunk->count ? chunk->code[opOffset + 1 + i] : 0;
+        }
+        instruction->upvalues = instruction->op == OP_CLOSURE ? &chunk->code[opOffset + (instruction->wide ? 3 : 2)] : NULL;
+        instruction->target = -1;
+        instruction->line = getLine(chunk, offset);
+        instruction->offset = offset;
+        instruction->isTarget = false;
+        indexAt[offset] = count++;
+
+        int length = operandLength(chunk, instruction);
+        if (isJumpOp(instruction->op)) {
+            // Jump offset is in the last two operand bytes and counts from the end of the instruction
+            int jump = (chunk->code[opOffset + length - 1] << 8) | chunk->code[opOffset + length];
+            instruction->target = instruction->op == OP_LOOP ? -jump : jump; // Resolved to index below
+        }
+        offset = opOffset + 1 + length;
+    }
+    indexAt[chunk->count] = count;
+
+    // Translate jump offsets to instruction indexes
+    for (int i = 0; i < count; i++) {
+        Instruction* instruction = &code[i];
+        if (!isJumpOp(instruction->op)) continue;
+
+        int after = (i + 1 < count ? code[i + 1].offset : chunk->count);
+        instruction->target = indexAt[after + instruction->target];
+        if (instruction->op == OP_LOOP) instruction->op = OP_JUMP;
+        code[instruction->target].isTarget = true;
+    }
+
+    FREE_ARRAY(int, indexAt, chunk->count + 1);
+    return count;
+}
+
+/* Get number of values instruction leaves on the stack minus number of values it takes
+*   Arguments:
+*   - Instruction* instruction: to check
+*
+*   Return stack depth change after instruction, for jumps the same on both paths
+*/
+static int stackEffect(Instruction* instruction) {
+    int wide = instruction->wide ? 1 : 0; // Arguments count follows widened index
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_0:
+        case OP_GET_LOCAL_1:
+        case OP_GET_LOCAL_2:
+        case OP_GET_LOCAL_3:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_GET_METHOD:
+        case OP_GET_BOUND_METHOD:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_GET_INDEX:
+            return -1;
+        case OP_SET_INDEX: return -2;
+        case OP_BUILD_LIST: return 1 - indexOperand(instruction); // Elements are replaced by the list
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -instruction->operands[0]; // Arguments are replaced by result with callee
+        case OP_INVOKE:
+        case OP_CALL_LOCAL:
+            return -instruction->operands[1 + wide];
+        case OP_SUPER_INVOKE: return -instruction->operands[1 + wide] - 1; // Superclass is popped too
+        default:
+            return 0;
+    }
+}
+
+/* Get value pushed by literal instruction
+*   Arguments:
+*   - Chunk* chunk: containing constants table
+*   - Instruction* instruction: to check
+*   - Value* value: output for the pushed value
+*
+*   Return whether instruction pushes value known at compile time
+*/
+static bool literalValue(Chunk* chunk, Instruction* instruction, Value* value) {
+    switch (instruction->op) {
+        case OP_CONSTANT: *value = chunk->constants.values[indexOperand(instruction)]; return true;
+        case OP_NIL: *value = NIL_VAL; return true;
+        case OP_TRUE: *value = BOOL_VAL(true); return true;
+        case OP_FALSE: *value = BOOL_VAL(false); return true;
+        default: return false;
+    }
+}
+
+/* Check if constant can be reused for the value
+*   Arguments:
+*   - Value a: constant from the table
+*   - Value b: value to be pushed
+*
+*   Return whether values are identical. Unlike valuesEqual, 0 and -0 differ
+*/
+static bool sameConstant(Value a, Value b) {
+    if (IS_NUMBER(a) != IS_NUMBER(b)) return false;
+    if (!IS_NUMBER(a)) return valuesEqual(a, b);
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return x == y && signbit(x) == signbit(y);
+}
+
+/* Hash constant, so that constants that are the same for sameConstant() hash the same
+*   Arguments:
+*   - Value value: to hash
+*
+*   Return hash of number's bits, string's characters or object's address
+*/
+static uint32_t hashConstant(Value value) {
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return (uint32_t)(bits ^ (bits >> 32));
+    }
+    if (IS_STRING(value)) return stringHash(AS_STRING(value)); // Long strings are equal by content
+    if (IS_OBJ(value)) return (uint32_t)((uintptr_t)AS_OBJ(value) >> 4);
+    return IS_BOOL(value) && AS_BOOL(value) ? 1 : 0;
+}
+
+/* Open addressing map from chunk constant to its index in constants table, built by the first fold of a pass
+*
+*   Fields:
+*   - int* slots: constant index of every slot, -1 for empty slot
+*   - int capacity: number of slots, 0 until map is built, then power of two
+*   - int count: number of used slots
+*/
+typedef struct {
+    int* slots; // constant index of every slot, -1 for empty slot
+    int capacity; // number of slots, 0 until map is built, then power of two
+    int count; // number of used slots
+} ConstantMap;
+
+/* Find slot of constant in the map
+*   Arguments:
+*   - ConstantMap* map: to search in
+*   - Chunk* chunk: containing constants table
+*   - Value value: to find
+*
+*   Return slot holding index of the same constant, or empty slot it would be put in
+*/
+static int findConstant(ConstantMap* map, Chunk* chunk, Value value) {
+    uint32_t slot = hashConstant(value) & (map->capacity - 1);
+    while (map->slots[slot] != -1 && !sameConstant(chunk->constants.values[map->slots[slot]], value)) {
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    return slot;
+}
+
+/* Double capacity of the map, rehashing its slots
+*   Arguments:
+*   - ConstantMap* map: to grow
+*   - Chunk* chunk: containing constants table
+*/
+static void growConstantMap(ConstantMap* map, Chunk* chunk) {
+    int* old = map->slots;
+    int oldCapacity = map->capacity;
+    map->capacity = GROW_CAPACITY(oldCapacity);
+    map->slots = ALLOCATE(int, map->capacity);
+    for (int i = 0; i < map->capacity; i++) map->slots[i] = -1;
+    for (int i = 0; i < oldCapacity; i++) {
+        if (old[i] != -1) map->slots[findConstant(map, chunk, chunk->constants.values[old[i]])] = old[i];
+    }
+    FREE_ARRAY(int, old, oldCapacity);
+}
+
+/* Put constant index into the map, keeping index already there, so the first one of same constants is reused
+*   Arguments:
+*   - ConstantMap* map: to put into, already built
+*   - Chunk* chunk: containing constants table
+*   - int constant: index of the constant
+*/
+static void mapConstant(ConstantMap* map, Chunk* chunk, int constant) {
+    if ((map->count + 1) * 2 > map->capacity) growConstantMap(map, chunk); // Kept at most half full
+    int slot = findConstant(map, chunk, chunk->constants.values[constant]);
+    if (map->slots[slot] != -1) return;
+    map->slots[slot] = constant;
+    map->count++;
+}
+
+/* Turn instruction into one pushing given value
+*   Arguments:
+*   - Chunk* chunk: which constants table will hold the value
+*   - ConstantMap* constants: map of chunk's constants, built on first use
+*   - Instruction* instruction: to overwrite
+*   - Value value: to be pushed
+*   - bool canWiden: whether instruction can take OP_WIDE prefix for constant index above UINT8_MAX
+*
+*   Return false when value doesn't fit into constants table or would need prefix that isn't allowed
+*/
+static bool pushValue(Chunk* chunk, ConstantMap* constants, Instruction* instruction, Value value, bool canWiden) {
+    if (IS_NIL(value)) {
+        instruction->op = OP_NIL;
+        instruction->wide = false;
+        return true;
+    }
+    if (IS_BOOL(value)) {
+        instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+        instruction->wide = false;
+        return true;
+    }
+
+    // Reuse constant if chunk already has it, folded expressions often produce repeated values
+    if (constants->capacity == 0) { // First fold of the pass, chunks without folds never build the map
+        push(value); // Folded string is referenced only from here, and building the map can collect garbage
+        growConstantMap(constants, chunk);
+        for (int i = 0; i < chunk->constants.count && i <= UINT16_MAX; i++) mapConstant(constants, chunk, i);
+        pop();
+    }
+    int constant = constants->slots[findConstant(constants, chunk, value)];
+    if (constant == -1) {
+        int count = chunk->constants.count;
+        if (count > UINT16_MAX || (!canWiden && count > UINT8_MAX)) return false;
+        constant = addConstant(chunk, value);
+        mapConstant(constants, chunk, constant);
+    }
+    if (!canWiden && constant > UINT8_MAX) return false;
+
+    instruction->op = OP_CONSTANT;
+    instruction->wide = constant > UINT8_MAX;
+    if (instruction->wide) {
+        instruction->operands[0] = (constant >> 8) & 0xff;
+        instruction->operands[1] = constant & 0xff;
+    } else {
+        instruction->operands[0] = (uint8_t)constant;
+    }
+    return true;
+}
+
+/* Evaluate binary operator on values known at compile time
+*   Arguments:
+*   - uint8_t op: binary opcode
+*   - Value a: left operand
+*   - Value b: right operand
+*   - Value* result: output for the operator result
+*
+*   Return whether operator can be folded. Operands that would fail at runtime are left for VM to report
+*/
+static bool foldBinary(uint8_t op, Value a, Value b, Value* result) {
+    if (op == OP_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    }
+
+    if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        int length = left->length + right->length;
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(takeString(chars, length)); // Operands stay reachable through constants table
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case OP_ADD: *result = NUMBER_VAL(x + y); return true;
+        case OP_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+        case OP_MULTIPLY: *result = NUMBER_VAL(x * y); return true;
+        case OP_DIVIDE: *result = NUMBER_VAL(x / y); return true;
+        case OP_GREATER: *result = BOOL_VAL(x > y); return true;
+        case OP_LESS: *result = BOOL_VAL(x < y); return true;
+        default: return false;
+    }
+}
+
+/* Rewrite the tail of already optimized instructions once
+*   Arguments:
+*   - Chunk* chunk: containing constants table
+*   - ConstantMap* constants: map of chunk's constants for folded values
+*   - Instruction* out: optimized instructions so far
+*   - int* count: of optimized instructions, updated after rewrite
+*   - bool* pendingTarget: set when jump target was removed, so the next instruction becomes the target
+*
+*   Return whether anything was rewritten
+*/
+static bool peephole(Chunk* chunk, ConstantMap* constants, Instruction* out, int* count, bool* pendingTarget) {
+    int n = *count;
+    Value a, b, result;
+    int slot, other;
+
+    if (n >= 2 && !out[n - 1].isTarget) {
+        Instruction* last = &out[n - 1];
+        Instruction* prev = &out[n - 2];
+
+        // Value pushed only to be popped right away: literal or local read have no side effects
+        if (last->op == OP_POP && (literalValue(chunk, prev, &a) || localSlot(prev, &slot) || prev->op == OP_GET_UPVALUE)) {
+            *pendingTarget = *pendingTarget || prev->isTarget;
+            *count = n - 2;
+            return true;
+        }
+
+        // Unary operator on literal
+        if (last->op == OP_NOT && literalValue(chunk, prev, &a)) {
+            prev->op = (IS_NIL(a) || (IS_BOOL(a) && !AS_BOOL(a))) ? OP_TRUE : OP_FALSE;
+            prev->wide = false;
+            prev->line = last->line;
+            *count = n - 1;
+            return true;
+        }
+        // Negated constant can't take wider index than the constant it replaces, as code mustn't grow
+        if (last->op == OP_NEGATE && literalValue(chunk, prev, &a) && IS_NUMBER(a)
+            && pushValue(chunk, constants, prev, NUMBER_VAL(-AS_NUMBER(a)), prev->wide)) {
+            prev->line = last->line;
+            *count = n - 1;
+            return true;
+        }
+    }
+
+    // Binary operator on two literals, at least five bytes of constant loads become one load of at most four
+    if (n >= 3 && !out[n - 1].isTarget && !out[n - 2].isTarget) {
+        Instruction* first = &out[n - 3];
+        uint8_t op = out[n - 1].op;
+        if (literalValue(chunk, first, &a) && literalValue(chunk, &out[n - 2], &b)
+            && foldBinary(op, a, b, &result) && pushValue(chunk, constants, first, result, true)) {
+            first->line = out[n - 1].line;
+            *count = n - 2;
+            return true;
+        }
+    }
+
+    /* Superinstructions for hot sequences of numeric kernels.
+    Only the first instruction of the sequence can be a jump target, fused instruction takes its place.
+    Fused opcodes have one byte operands, so sequences with widened slot or constant are left as they are
+    */
+    if (n >= 5 && !out[n - 4].isTarget && !out[n - 3].isTarget && !out[n - 2].isTarget && !out[n - 1].isTarget) {
+        // local = local + number;
+        Instruction* first = &out[n - 5];
+        if (localSlot(first, &slot) && slot <= UINT8_MAX && literalValue(chunk, &out[n - 4], &b) && IS_NUMBER(b)
+            && !out[n - 4].wide && out[n - 3].op == OP_ADD && out[n - 2].op == OP_SET_LOCAL
+            && indexOperand(&out[n - 2]) == slot && out[n - 1].op == OP_POP) {
+            first->op = OP_INCREMENT_LOCAL;
+            first->operands[0] = slot;
+            first->operands[1] = out[n - 4].operands[0];
+            first->line = out[n - 3].line;
+            *count = n - 4;
+            return true;
+        }
+    }
+    if (n >= 4 && !out[n - 3].isTarget && !out[n - 2].isTarget && !out[n - 1].isTarget) {
+        // Loop or if condition comparing local with number
+        Instruction* first = &out[n - 4];
+        uint8_t op = out[n - 2].op;
+        if (localSlot(first, &slot) && slot <= UINT8_MAX && literalValue(chunk, &out[n - 3], &b) && IS_NUMBER(b)
+            && !out[n - 3].wide && (op == OP_LESS || op == OP_GREATER) && out[n - 1].op == OP_JUMP_IF_FALSE_POP) {
+            first->op = op == OP_LESS ? OP_LESS_LOCAL_CONSTANT_JUMP : OP_GREATER_LOCAL_CONSTANT_JUMP;
+            first->operands[0] = slot;
+            first->operands[1] = out[n - 3].operands[0];
+            first->target = out[n - 1].target;
+            first->line = out[n - 2].line;
+            *count = n - 3;
+            return true;
+        }
+    }
+    if (n >= 3 && !out[n - 2].isTarget && !out[n - 1].isTarget) {
+        // local + local
+        Instruction* first = &out[n - 3];
+        if (localSlot(first, &slot) && localSlot(&out[n - 2], &other) && slot <= UINT8_MAX && other <= UINT8_MAX
+            && out[n - 1].op == OP_ADD) {
+            first->op = OP_ADD_LOCAL_LOCAL;
+            first->operands[0] = slot;
+            first->operands[1] = other;
+            first->line = out[n - 1].line;
+            *count = n - 2;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Follow chain of jumps landing on other jumps
+*   Arguments:
+*   - Instruction* code: instructions array
+*   - int index: of the jump to thread
+*
+*   Return index of the final target
+*/
+static int threadJump(Instruction* code, int index) {
+    Instruction* jump = &code[index];
+    int target = jump->target;
+
+    for (int hops = 0; hops < 16; hops++) { // Hops limit guards against jump cycles
+        Instruction* next = &code[target];
+        /* Unconditional jump can be skipped by anything.
+        Conditional jump can be skipped by conditional one, as the tested value is still on the stack
+        */
+        if (next->op != OP_JUMP && !(next->op == OP_JUMP_IF_FALSE && jump->op == OP_JUMP_IF_FALSE)) break;
+        if (next->target == target) break;
+
+        int candidate = next->target;
+        if (jump->op != OP_JUMP && candidate <= index) break; // There is no backward conditional jump
+        // Offset has to fit in two bytes. Rewrites never make code longer, so distance in original code bounds the final one
+        if (abs(code[candidate].offset - jump->offset) > UINT16_MAX - 3) break;
+        target = candidate;
+    }
+    return target;
+}
+
+/* Thread jumps, remove jumps to the next instruction and unreachable code
+*   Arguments:
+*   - Instruction* code: instructions array
+*   - int count: of instructions
+*
+*   Return new number of instructions
+*/
+static int simplifyFlow(Instruction* code, int count) {
+    int capacity = count;
+    bool* removed = ALLOCATE(bool, capacity);
+    int* newIndex = ALLOCATE(int, capacity + 1);
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (int i = 0; i < count; i++) {
+            code[i].isTarget = false;
+            removed[i] = false;
+        }
+        for (int i = 0; i < count; i++) {
+            if (!isJump(&code[i])) continue;
+            code[i].target = threadJump(code, i);
+            code[code[i].target].isTarget = true;
+        }
+
+        bool reachable = true;
+        for (int i = 0; i < count; i++) {
+            if (code[i].isTarget) reachable = true;
+            if (!reachable) { // Nothing jumps here and previous instruction never falls through
+                removed[i] = changed = true;
+                continue;
+            }
+            if ((code[i].op == OP_JUMP || code[i].op == OP_JUMP_IF_FALSE) && code[i].target == i + 1) { // Jump over nothing
+                removed[i] = changed = true;
+                continue;
+            }
+            if (code[i].op == OP_JUMP_IF_FALSE_POP && code[i].target == i + 1) { // Only pop is left when jumping over nothing
+                code[i].op = OP_POP;
+                changed = true;
+            }
+            /* Value kept by "and" is popped by the condition it lands on, while other path pops it right away.
+            Both can be done by popping jump going straight to the condition's target
+            */
+            Instruction* landing = isJump(&code[i]) ? &code[code[i].target] : NULL;
+            if (code[i].op == OP_JUMP_IF_FALSE && landing->op == OP_JUMP_IF_FALSE_POP
+                && i + 1 < count && code[i + 1].op == OP_POP && !code[i + 1].isTarget
+                && abs(code[landing->target].offset - code[i].offset) <= UINT16_MAX - 3) {
+                code[i].op = OP_JUMP_IF_FALSE_POP;
+                code[i].target = landing->target;
+                removed[i + 1] = changed = true;
+                i++;
+                continue;
+            }
+            if (code[i].op == OP_JUMP || code[i].op == OP_RETURN) reachable = false;
+        }
+        if (!changed) break;
+
+        // Compact the array, jumps to removed instruction land on the next kept one
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            newIndex[i] = kept;
+            if (!removed[i]) code[kept++] = code[i];
+        }
+        newIndex[count] = kept;
+        for (int i = 0; i < kept; i++) {
+            if (isJump(&code[i])) code[i].target = newIndex[code[i].target];
+        }
+        count = kept;
+    }
+
+    FREE_ARRAY(bool, removed, capacity);
+    FREE_ARRAY(int, newIndex, capacity + 1);
+    return count;
+}
+
+/* Encode instructions back to the chunk's bytecode
+*   Arguments:
+*   - Chunk* chunk: to write bytecode to
+*   - Instruction* code: instructions array
+*   - int count: of instructions
+*/
+static void encode(Chunk* chunk, Instruction* code, int count) {
+    int* offsets = ALLOCATE(int, count + 1); // New offset of every instruction
+    offsets[0] = 0;
+    for (int i = 0; i < count; i++) {
+        offsets[i + 1] = offsets[i] + (code[i].wide ? 2 : 1) + operandLength(chunk, &code[i]);
+    }
+
+    Chunk out;
+    initChunk(&out);
+    for (int i = 0; i < count; i++) {
+        Instruction* instruction = &code[i];
+        int length = operandLength(chunk, instruction);
+        int line = instruction->line;
+
+        if (isJump(instruction)) {
+            int jump = offsets[instruction->target] - offsets[i + 1];
+            uint8_t op = jump < 0 ? OP_LOOP : instruction->op; // Only unconditional jumps go back, as loops
+            if (jump < 0) jump = -jump;
+            writeChunk(&out, op, line);
+            for (int j = 0; j < length - 2; j++) writeChunk(&out, instruction->operands[j], line);
+            writeChunk(&out, (jump >> 8) & 0xff, line);
+            writeChunk(&out, jump & 0xff, line);
+            continue;
+        }
+
+        if (instruction->wide) writeChunk(&out, OP_WIDE, line);
+        writeChunk(&out, instruction->op, line);
+        if (instruction->op == OP_CLOSURE) {
+            int indexLength = instruction->wide ? 2 : 1;
+            for (int j = 0; j < indexLength; j++) writeChunk(&out, instruction->operands[j], line);
+            for (int j = 0; j < length - indexLength; j++) writeChunk(&out, instruction->upvalues[j], line);
+        } else {
+            for (int j = 0; j < length; j++) writeChunk(&out, instruction->operands[j], line);
+        }
+    }
+    FREE_ARRAY(int, offsets, count + 1);
+
+    // Swap bytecode, constants table stays in place
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    chunk->code = out.code;
+    chunk->lines = out.lines;
+    chunk->lineCount = out.lineCount;
+    chunk->lineCapacity = out.lineCapacity;
+    chunk->count = out.count;
+    chunk->capacity = out.capacity;
+    freeValueArray(&out.constants);
+}
+
+/* Find deepest stack reached by chunk's bytecode
+*   Compiler leaves the same stack depth on every path to an instruction, so one walk in code order is enough
+*   Arguments:
+*   - Chunk* chunk: finished chunk
+*   - int base: stack depth at the chunk's start, slot 0 and parameters
+*
+*   Return maximal stack depth counted from the frame's slot 0
+*/
+int maxStackDepth(Chunk* chunk, int base) {
+    if (chunk->count == 0) return base;
+
+    int capacity = chunk->count;
+    Instruction* code = ALLOCATE(Instruction, capacity);
+    int* depth = ALLOCATE(int, capacity); // Stack depth before instruction, -1 until a path reaches it
+    int count = decode(chunk, code);
+    for (int i = 0; i < count; i++) depth[i] = -1;
+    depth[0] = base;
+
+    int max = base;
+    for (int i = 0; i < count; i++) {
+        if (depth[i] == -1) continue; // Unreachable
+        int after = depth[i] + stackEffect(&code[i]);
+        if (after > max) max = after;
+        if (isJump(&code[i]) && depth[code[i].target] == -1) depth[code[i].target] = after;
+        if (code[i].op != OP_JUMP && code[i].op != OP_RETURN && i + 1 < count && depth[i + 1] == -1) depth[i + 1] = after;
+    }
+
+    FREE_ARRAY(Instruction, code, capacity);
+    FREE_ARRAY(int, depth, capacity);
+    return max;
+}
+
+/* Optimize bytecode of a finished chunk in place
+*   Arguments:
+*   - Chunk* chunk: compiled chunk to rewrite. Constants table can get new folded constants
+*/
+void optimizeChunk(Chunk* chunk) {
+    if (chunk->count == 0) return;
+
+    int capacity = chunk->count;
+    Instruction* code = ALLOCATE(Instruction, capacity);
+    Instruction* out = ALLOCATE(Instruction, capacity);
+    int* newIndex = ALLOCATE(int, capacity + 1);
+    int count = decode(chunk, code);
+
+    /* Peephole pass: append instructions one by one and rewrite the tail until it settles.
+    Rewrites never look past jump target, so every jump still lands on the start of a (possibly rewritten) sequence.
+    */
+    int outCount = 0;
+    bool pendingTarget = false;
+    ConstantMap constants = {NULL, 0, 0};
+    for (int i = 0; i < count; i++) {
+        newIndex[i] = outCount;
+        out[outCount] = code[i];
+        out[outCount].isTarget = code[i].isTarget || pendingTarget;
+        pendingTarget = false;
+        outCount++;
+        while (peephole(chunk, &constants, out, &outCount, &pendingTarget));
+    }
+    newIndex[count] = outCount;
+    FREE_ARRAY(int, constants.slots, constants.capacity);
+    for (int i = 0; i < outCount; i++) {
+        if (isJump(&out[i])) out[i].target = newIndex[out[i].target];
+    }
+
+    outCount = simplifyFlow(out, outCount);
+    encode(chunk, out, outCount);
+
+    FREE_ARRAY(Instruction, code, capacity);
+    FREE_ARRAY(Instruction, out, capacity);
+    FREE_ARRAY(int, newIndex, capacity + 1);
+}
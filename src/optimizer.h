@@ -0,0 +1,21 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+/* Optimize bytecode of a finished chunk in place
+*   Arguments:
+*   - Chunk* chunk: compiled chunk to rewrite. Constants table can get new folded constants
+*/
+void optimizeChunk(Chunk* chunk);
+
+/* Find deepest stack reached by chunk's bytecode
+*   Arguments:
+*   - Chunk* chunk: finished chunk
+*   - int base: stack depth at the chunk's start, slot 0 and parameters
+*
+*   Return maximal stack depth counted from the frame's slot 0
+*/
+int maxStackDepth(Chunk* chunk, int base);
+
+#endif
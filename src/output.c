@@ -0,0 +1,105 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+/* Initialize output buffer
+*   Arguments:
+*   - Output* output: to initialize
+*   - FILE* file: stream to flush to
+*   - char* data: buffer to use, NULL to allocate OUTPUT_BUFFER_SIZE bytes on the first write
+*   - size_t capacity: of data, disregarded when data is NULL
+*/
+void initOutput(Output* output, FILE* file, char* data, size_t capacity) {
+    output->file = file;
+    output->data = data;
+    output->count = 0;
+    output->capacity = data == NULL ? 0 : capacity;
+    output->owned = data == NULL;
+    output->policy = FLUSH_SIZE;
+}
+
+/* Flush output buffer and free its memory
+*   Arguments:
+*   - Output* output: to free
+*/
+void freeOutput(Output* output) {
+    flushOutput(output);
+    if (output->owned) free(output->data);
+    output->data = NULL;
+    output->capacity = 0;
+}
+
+/* Write buffered characters to the stream, which is flushed too so they're visible right away
+*   Arguments:
+*   - Output* output: to flush
+*/
+void flushOutput(Output* output) {
+    // Going through the stream rather than its descriptor keeps order with whatever else prints to it with stdio
+    if (output->count > 0) fwrite(output->data, 1, output->count, output->file);
+    output->count = 0;
+    fflush(output->file);
+}
+
+/* Reserve space for characters at the end of the buffer, flushing it when they don't fit
+*   Arguments:
+*   - Output* output: to write to
+*   - size_t length: of characters to be written
+*
+*   Return where to write characters, which count as written, NULL when length is more than the buffer holds
+*/
+char* reserveOutput(Output* output, size_t length) {
+    if (output->data == NULL) { // VMs that never print don't pay for the buffer
+        output->data = (char*)malloc(OUTPUT_BUFFER_SIZE);
+        if (output->data == NULL) exit(1);
+        output->capacity = OUTPUT_BUFFER_SIZE;
+    }
+    if (length > output->capacity) return NULL;
+    if (output->count + length > output->capacity) flushOutput(output);
+
+    char* chars = output->data + output->count;
+    output->count += length;
+    return chars;
+}
+
+/* Append characters to output buffer. Chunks longer than the buffer go to the stream directly, without being copied
+*   Arguments:
+*   - Output* output: to write to
+*   - const char* chars: to write
+*   - size_t length: of chars
+*/
+void writeOutput(Output* output, const char* chars, size_t length) {
+    char* space = reserveOutput(output, length);
+    if (space != NULL) {
+        memcpy(space, chars, length);
+        return;
+    }
+    flushOutput(output);
+    fwrite(chars, 1, length, output->file);
+}
+
+/* Append number written like printf's %g does
+*   Arguments:
+*   - Output* output: to write to
+*   - double number: to write
+*/
+void writeOutputNumber(Output* output, double number) {
+    // Integers with up to 6 digits are what %g prints unchanged, and they're most of printed numbers
+    if (number > -1e6 && number < 1e6 && number == (double)(int32_t)number && !(number == 0 && signbit(number))) {
+        char digits[8];
+        int length = 0;
+        uint32_t magnitude = number < 0 ? (uint32_t)-(int32_t)number : (uint32_t)number;
+        do {
+            digits[sizeof(digits) - 1 - length++] = (char)('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude > 0);
+        if (number < 0) digits[sizeof(digits) - 1 - length++] = '-';
+        writeOutput(output, digits + sizeof(digits) - length, length);
+        return;
+    }
+
+    char chars[32];
+    int length = snprintf(chars, sizeof(chars), "%g", number);
+    writeOutput(output, chars, length);
+}
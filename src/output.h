@@ -0,0 +1,90 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+#ifndef OUTPUT_BUFFER_SIZE
+#define OUTPUT_BUFFER_SIZE (64 * 1024) // Bytes VM's output buffer holds before it's flushed, build with -DOUTPUT_BUFFER_SIZE=N to change it
+#endif
+
+// When buffered output is written to its stream, besides at exit, before runtime errors and before reading input
+typedef enum {
+    FLUSH_SIZE, // When the buffer is full, for files and pipes
+    FLUSH_LINE  // After every print, for terminals and for output mixed with tracing
+} FlushPolicy;
+
+/* Buffer collecting output in large chunks, so stream sees few large writes instead of one per printed value
+*
+*   Fields:
+*   - FILE* file: stream the buffer is flushed to
+*   - char* data: buffered characters, allocated on the first write when not given
+*   - size_t count: of buffered characters
+*   - size_t capacity: of data
+*   - bool owned: whether data was allocated by the buffer and is freed with it
+*   - FlushPolicy policy: when buffer is flushed
+*/
+typedef struct {
+    FILE* file; // stream the buffer is flushed to
+    char* data; // buffered characters, allocated on the first write when not given
+    size_t count; // of buffered characters
+    size_t capacity; // of data
+    bool owned; // whether data was allocated by the buffer and is freed with it
+    FlushPolicy policy; // when buffer is flushed
+} Output;
+
+/* Initialize output buffer
+*   Arguments:
+*   - Output* output: to initialize
+*   - FILE* file: stream to flush to
+*   - char* data: buffer to use, NULL to allocate OUTPUT_BUFFER_SIZE bytes on the first write
+*   - size_t capacity: of data, disregarded when data is NULL
+*/
+void initOutput(Output* output, FILE* file, char* data, size_t capacity);
+
+/* Flush output buffer and free its memory
+*   Arguments:
+*   - Output* output: to free
+*/
+void freeOutput(Output* output);
+
+/* Write buffered characters to the stream, which is flushed too so they're visible right away
+*   Arguments:
+*   - Output* output: to flush
+*/
+void flushOutput(Output* output);
+
+/* Reserve space for characters at the end of the buffer, flushing it when they don't fit
+*   Arguments:
+*   - Output* output: to write to
+*   - size_t length: of characters to be written
+*
+*   Return where to write characters, which count as written, NULL when length is more than the buffer holds
+*/
+char* reserveOutput(Output* output, size_t length);
+
+/* Append characters to output buffer. Chunks longer than the buffer go to the stream directly, without being copied
+*   Arguments:
+*   - Output* output: to write to
+*   - const char* chars: to write
+*   - size_t length: of chars
+*/
+void writeOutput(Output* output, const char* chars, size_t length);
+
+/* Append number written like printf's %g does
+*   Arguments:
+*   - Output* output: to write to
+*   - double number: to write
+*/
+void writeOutputNumber(Output* output, double number);
+
+/* Finish print, flushing the buffer when its policy asks for that
+*   Arguments:
+*   - Output* output: printed to
+*/
+static inline void endPrint(Output* output) {
+    if (output->policy == FLUSH_LINE) flushOutput(output);
+}
+
+#endif
@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#define PROFILE_TIMER // Sample on SIGPROF from CPU time interval timer, without it profile only counts opcodes
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLE_UNIT "cycles" // Time stamp counter ticks at about the nominal clock rate
+#else
+#define CYCLE_UNIT "ns" // No cycle counter readable from user space everywhere, monotonic clock is used instead
+#endif
+
+#include "debug.h"
+#include "object.h"
+#include "profiler.h"
+#include "vm.h"
+
+volatile sig_atomic_t profileTick = 0;
+
+// Read cycle counter, in CYCLE_UNIT
+static uint64_t profileCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+#endif
+}
+
+#ifdef PROFILE_TIMER
+/* Handle SIGPROF. Only raises the flag, the stack is walked by the run loop between instructions, where it's consistent
+*   Arguments:
+*   - int number: of the signal, unused
+*/
+static void profileSignal(int number) {
+    (void)number;
+    profileTick = 1;
+}
+
+/* Arm or disarm CPU time interval timer
+*   Arguments:
+*   - int interval: between signals in microseconds, 0 to stop the timer
+*/
+static void setProfileTimer(int interval) {
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+#endif
+
+// Allocate empty profile
+Profile* newProfile() {
+    Profile* profile = (Profile*)calloc(1, sizeof(Profile));
+    if (profile == NULL) {
+        fprintf(stderr, "Not enough memory for profile.\n");
+        exit(74);
+    }
+    return profile;
+}
+
+/* Free profile with every callstack it recorded
+*   Arguments:
+*   - Profile* profile: created with newProfile()
+*/
+void freeProfile(Profile* profile) {
+    for (int i = 0; i < profile->stackCapacity; i++) {
+        free(profile->stacks[i].frames);
+    }
+    free(profile->stacks);
+    free(profile);
+}
+
+// Start sampling timer and cycle count of current VM's profile, before profiled loop is entered
+void startProfiling() {
+#ifdef PROFILE_TIMER
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profileSignal;
+    action.sa_flags = SA_RESTART; // Natives doing IO shouldn't see interrupted calls
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+    setProfileTimer(PROFILE_INTERVAL);
+#endif
+    profileTick = 0;
+    vm.profile->start = profileCycles();
+}
+
+// Stop sampling timer and add up cycles of current VM's profile, after profiled loop returned
+void stopProfiling() {
+    vm.profile->cycles += profileCycles() - vm.profile->start;
+#ifdef PROFILE_TIMER
+    setProfileTimer(0);
+#endif
+    profileTick = 0;
+}
+
+/* Find entry of folded callstack, inserting it if seen the first time
+*   Arguments:
+*   - Profile* profile: holding the callstacks
+*   - const char* frames: folded callstack
+*   - int length: of frames
+*
+*   Return entry of the callstack
+*/
+static ProfileStack* findStack(Profile* profile, const char* frames, int length) {
+    uint32_t hash = 2166136261u; // FNV-1a, the same as strings use
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)frames[i];
+        hash *= 16777619;
+    }
+
+    if ((profile->stackCount + 1) * 4 > profile->stackCapacity * 3) { // Keep load under 3/4, so probe sequences stay short
+        int capacity = profile->stackCapacity < 64 ? 64 : profile->stackCapacity * 2;
+        ProfileStack* stacks = (ProfileStack*)calloc(capacity, sizeof(ProfileStack));
+        if (stacks == NULL) return NULL; // Sample is dropped, profile stays usable
+        for (int i = 0; i < profile->stackCapacity; i++) {
+            ProfileStack* old = &profile->stacks[i];
+            if (old->frames == NULL) continue;
+            int index = old->hash & (capacity - 1);
+            while (stacks[index].frames != NULL) index = (index + 1) & (capacity - 1);
+            stacks[index] = *old;
+        }
+        free(profile->stacks);
+        profile->stacks = stacks;
+        profile->stackCapacity = capacity;
+    }
+
+    int index = hash & (profile->stackCapacity - 1);
+    for (;;) {
+        ProfileStack* stack = &profile->stacks[index];
+        if (stack->frames == NULL) { // New callstack
+            stack->frames = (char*)malloc(length + 1);
+            if (stack->frames == NULL) return NULL;
+            memcpy(stack->frames, frames, length);
+            stack->frames[length] = '\0';
+            stack->hash = hash;
+            profile->stackCount++;
+            return stack;
+        }
+        if (stack->hash == hash && strncmp(stack->frames, frames, length) == 0 && stack->frames[length] == '\0') {
+            return stack;
+        }
+        index = (index + 1) & (profile->stackCapacity - 1);
+    }
+}
+
+/* Record callstack of current VM into its profile, called by profiled loop when profileTick is set
+*   Arguments:
+*   - uint8_t instruction: opcode that was executing when the timer fired
+*/
+void sampleProfile(uint8_t instruction) {
+    profileTick = 0;
+    Profile* profile = vm.profile;
+    profile->samples[instruction]++;
+    profile->sampleCount++;
+
+    // Fold the callstack from the outermost frame, skipping the middle of deep recursion like runtime errors do
+    char frames[PROFILE_STACK_MAX];
+    int length = 0;
+    for (int i = 0; i < vm.frameCount && length < PROFILE_STACK_MAX; i++) {
+        if (i == PROFILE_FRAMES && vm.frameCount - PROFILE_FRAMES > i) {
+            length += snprintf(frames + length, PROFILE_STACK_MAX - length, "[%d calls];", vm.frameCount - 2 * PROFILE_FRAMES);
+            i = vm.frameCount - PROFILE_FRAMES;
+            if (length >= PROFILE_STACK_MAX) break;
+        }
+        CallFrame* frame = &vm.frames[i];
+        ObjFunction* function = frame->closure->function;
+        int offset = (int)(frame->ip - function->chunk.code);
+        int line = getLine(&function->chunk, offset > 0 ? offset - 1 : 0); // Callee that was just entered is still at its start
+        length += snprintf(frames + length, PROFILE_STACK_MAX - length, "%s:%d;",
+            function->name == NULL ? "script" : function->name->chars, line);
+    }
+    if (length >= PROFILE_STACK_MAX) length = PROFILE_STACK_MAX - 1; // Cut stack, snprintf returned length it wanted
+    if (length > 0) length--; // Drop trailing ';'
+
+    ProfileStack* stack = findStack(profile, frames, length);
+    if (stack != NULL) stack->samples++;
+}
+
+// Profile being printed, for comparing opcodes while sorting
+static THREAD_LOCAL Profile* sortedProfile;
+
+/* Compare opcodes by samples and then by counts, both descending
+*   Arguments:
+*   - const void* a: pointer to the first opcode
+*   - const void* b: pointer to the second opcode
+*
+*   Return negative number if a goes first, positive if b does
+*/
+static int compareOpcodes(const void* a, const void* b) {
+    uint8_t first = *(const uint8_t*)a;
+    uint8_t second = *(const uint8_t*)b;
+    if (sortedProfile->samples[first] != sortedProfile->samples[second]) {
+        return sortedProfile->samples[first] < sortedProfile->samples[second] ? 1 : -1;
+    }
+    if (sortedProfile->counts[first] != sortedProfile->counts[second]) {
+        return sortedProfile->counts[first] < sortedProfile->counts[second] ? 1 : -1;
+    }
+    return first - second;
+}
+
+/* Print opcode counts and their estimated cycles, ordered by share of samples
+*   Arguments:
+*   - Profile* profile: to print
+*   - FILE* file: to print to
+*/
+void printProfile(Profile* profile, FILE* file) {
+    uint8_t opcodes[OP_COUNT];
+    uint64_t total = 0;
+    for (int i = 0; i < OP_COUNT; i++) {
+        opcodes[i] = (uint8_t)i;
+        total += profile->counts[i];
+    }
+    sortedProfile = profile;
+    qsort(opcodes, OP_COUNT, sizeof(uint8_t), compareOpcodes);
+
+    fprintf(file, "profile: %llu instructions, %llu samples, %llu %s\n", (unsigned long long)total,
+        (unsigned long long)profile->sampleCount, (unsigned long long)profile->cycles, CYCLE_UNIT);
+    fprintf(file, "  %-32s %14s %7s %9s %14s %10s\n", "opcode", "count", "time", "samples", CYCLE_UNIT, "per op");
+    for (int i = 0; i < OP_COUNT; i++) {
+        uint8_t opcode = opcodes[i];
+        if (profile->counts[opcode] == 0 && profile->samples[opcode] == 0) continue;
+        // Samples land on opcodes in proportion to time spent in them, which splits measured cycles between them
+        double share = profile->sampleCount > 0 ? (double)profile->samples[opcode] / profile->sampleCount : 0;
+        double cycles = share * profile->cycles;
+        fprintf(file, "  %-32s %14llu %6.2f%% %9llu %14.0f %10.1f\n", opcodeName(opcode),
+            (unsigned long long)profile->counts[opcode], share * 100, (unsigned long long)profile->samples[opcode],
+            cycles, profile->counts[opcode] > 0 ? cycles / profile->counts[opcode] : 0);
+    }
+}
+
+/* Write sampled callstacks as folded stacks, one "frame;frame;frame count" line per callstack
+*   Arguments:
+*   - Profile* profile: to write
+*   - const char* path: of the file
+*
+*   Return whether file was written
+*/
+bool writeFoldedStacks(Profile* profile, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return false;
+    for (int i = 0; i < profile->stackCapacity; i++) {
+        ProfileStack* stack = &profile->stacks[i];
+        if (stack->frames != NULL) fprintf(file, "%s %llu\n", stack->frames, (unsigned long long)stack->samples);
+    }
+    return fclose(file) == 0;
+}
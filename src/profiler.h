@@ -0,0 +1,94 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include <signal.h>
+#include <stdio.h>
+
+#include "chunk.h"
+
+#ifndef PROFILE_INTERVAL
+#define PROFILE_INTERVAL 1000 // Microseconds of CPU time between samples, build with -DPROFILE_INTERVAL=N to change it
+#endif
+#define PROFILE_FRAMES 32 // Innermost and outermost callframes kept in sampled stack, the ones between are counted
+#define PROFILE_STACK_MAX 4096 // Longest folded stack in characters, longer ones are cut
+#define PROFILE_PATH "clox.folded" // File folded stacks are written to when no path is given
+
+/* Callstack seen by samples, in folded form read by flamegraph tools
+*
+*   Fields:
+*   - char* frames: function names with lines, from the outermost callframe, separated by ';'
+*   - uint32_t hash: of frames
+*   - uint64_t samples: number of samples that saw this callstack
+*/
+typedef struct {
+    char* frames; // function names with lines, from the outermost callframe, separated by ';'
+    uint32_t hash; // of frames
+    uint64_t samples; // number of samples that saw this callstack
+} ProfileStack;
+
+/* Profile collected while VM runs with profiling on
+*
+*   Fields:
+*   - uint64_t counts[OP_COUNT]: executions of every opcode
+*   - uint64_t samples[OP_COUNT]: samples taken while every opcode was executing
+*   - uint64_t sampleCount: number of all samples
+*   - uint64_t cycles: measured while profiled loop was running, in units of profileCycles()
+*   - uint64_t start: profileCycles() when the loop was last entered
+*   - ProfileStack* stacks: hash table of sampled callstacks, open addressing
+*   - int stackCount: number of distinct callstacks
+*   - int stackCapacity: capacity of stacks, power of 2
+*/
+typedef struct Profile {
+    uint64_t counts[OP_COUNT]; // executions of every opcode
+    uint64_t samples[OP_COUNT]; // samples taken while every opcode was executing
+    uint64_t sampleCount; // number of all samples
+    uint64_t cycles; // measured while profiled loop was running, in units of profileCycles()
+    uint64_t start; // profileCycles() when the loop was last entered
+    ProfileStack* stacks; // hash table of sampled callstacks, open addressing
+    int stackCount; // number of distinct callstacks
+    int stackCapacity; // capacity of stacks, power of 2
+} Profile;
+
+/* Set by the timer signal when next sample is due, and cleared once it's taken.
+*   Timer measures CPU time of the whole process, so only one thread should profile at a time
+*/
+extern volatile sig_atomic_t profileTick;
+
+// Allocate empty profile
+Profile* newProfile();
+
+/* Free profile with every callstack it recorded
+*   Arguments:
+*   - Profile* profile: created with newProfile()
+*/
+void freeProfile(Profile* profile);
+
+// Start sampling timer and cycle count of current VM's profile, before profiled loop is entered
+void startProfiling();
+
+// Stop sampling timer and add up cycles of current VM's profile, after profiled loop returned
+void stopProfiling();
+
+/* Record callstack of current VM into its profile, called by profiled loop when profileTick is set
+*   Arguments:
+*   - uint8_t instruction: opcode that was executing when the timer fired
+*/
+void sampleProfile(uint8_t instruction);
+
+/* Print opcode counts and their estimated cycles, ordered by share of samples
+*   Arguments:
+*   - Profile* profile: to print
+*   - FILE* file: to print to
+*/
+void printProfile(Profile* profile, FILE* file);
+
+/* Write sampled callstacks as folded stacks, one "frame;frame;frame count" line per callstack
+*   Arguments:
+*   - Profile* profile: to write
+*   - const char* path: of the file
+*
+*   Return whether file was written
+*/
+bool writeFoldedStacks(Profile* profile, const char* path);
+
+#endif
@@ -0,0 +1,754 @@
+/* Body of VM's run loop, included by vm.c once for every variant of the loop. No include guard on purpose
+*   Every inclusion defines static function named RUN_FUNCTION, and undefines configuration macros afterwards:
+*   - RUN_FUNCTION: name of the function
+*   - RUN_TRACE: print stack and every instruction before executing it, not defined for the fast loop
+*   - RUN_PROFILE: count every executed opcode and sample callstack when profileTick is set, not defined for the fast loop
+*/
+
+/* Main function for running VM's chunk, named RUN_FUNCTION
+*
+*   Return InterpretResult, INTERPRET_OK if everything ok
+*/
+#if defined(COMPUTED_GOTO) && defined(__GNUC__) && !defined(__clang__)
+// Stop GCC from merging handlers' DISPATCH() tails back into a single shared indirect jump
+__attribute__((optimize("no-crossjumping")))
+#endif
+static InterpretResult RUN_FUNCTION() {
+    /* Hot interpreter state is kept in locals, so compiler can hold it in registers across opcodes.
+    It's spilled back to the VM only when something outside run() can observe it: calls, returns, allocations (GC walks the stack) and errors.
+    */
+    CallFrame* frame; // currently executed callframe
+    register uint8_t* ip; // local copy of frame->ip
+    register Value* slots; // local copy of frame->slots
+    register Value* sp; // local copy of vm.stackTop
+    Value* constants; // constants table of currently executed function
+    VM* machine = currentVM; // VM of the thread, read once instead of from thread-local storage on every access
+    #undef vm
+    #define vm (*machine)
+
+    // Write local copies back to the current callframe and VM
+    #define SAVE_STATE() (frame->ip = ip, vm.stackTop = sp)
+    // Reload local copies from the topmost callframe, stack top is left untouched
+    #define LOAD_FRAME() \
+        (frame = &vm.frames[vm.frameCount - 1], \
+        ip = frame->ip, \
+        slots = frame->slots, \
+        constants = frame->closure->function->chunk.constants.values)
+    // Reload all local copies after callstack or stack was changed outside of run()
+    #define LOAD_STATE() (LOAD_FRAME(), sp = vm.stackTop)
+
+    #define PUSH(value) (*sp++ = (value)) // Push value onto the local stack top
+    #define POP() (*--sp) // Pop value from the local stack top
+    #define DROP() ((void)--sp) // Pop value from the local stack top when it is not used
+    #define PEEK(distance) (sp[-1 - (distance)]) // Show value on the local stack without popping
+    #define READ_BYTE() (*ip++) // Read next byte from chunk
+    #define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1])) // Read next two bytes as short number from chunk
+    #define READ_CONSTANT() (constants[READ_BYTE()]) // Read next byte as address and dereference if from constants table
+    #define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()]) // Read next two bytes as inline cache index
+    // Report runtime error with VM state spilled, so the callstack print points to the right lines
+    #define RUNTIME_ERROR(...) \
+        do { \
+            SAVE_STATE(); \
+            runtimeError(__VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+    #ifdef RUN_TRACE
+        // Print stack and opcode before it's executed
+        #define TRACE_EXECUTION() \
+            do { \
+                SAVE_STATE(); \
+                traceExecution(frame); \
+            } while (false)
+    #else
+        #define TRACE_EXECUTION() do { } while (false)
+    #endif
+    #ifdef RUN_PROFILE
+        uint64_t* opcodeCounts = vm.profile->counts; // Read once, so counting is a single increment
+        // Sample callstack if timer fired, charging it to the instruction that just finished
+        #define SAMPLE_EXECUTION() \
+            do { \
+                if (profileTick) { \
+                    SAVE_STATE(); \
+                    sampleProfile(instruction); \
+                } \
+            } while (false)
+        #define COUNT_INSTRUCTION() (opcodeCounts[instruction]++) // Count opcode that is about to execute
+    #else
+        #define SAMPLE_EXECUTION() do { } while (false)
+        #define COUNT_INSTRUCTION() do { } while (false)
+    #endif
+    #ifdef QUICKENING
+        // Rewrite opcode at the address into its other form, which runs from the next execution of the instruction
+        #define QUICKEN(at, opcode) (*(at) = (opcode))
+    #else
+        #define QUICKEN(at, opcode) ((void)0)
+    #endif
+    #if defined(BASELINE_JIT) && !defined(RUN_TRACE) && !defined(RUN_PROFILE)
+        // Continue in machine code of the current function if it can start at ip, until code exits back to the interpreter
+        #define JIT_ENTER() \
+            do { \
+                JitCode* jit = frame->closure->function->jit; \
+                uint32_t entry; \
+                if (jit != NULL && (entry = jitEntry(jit, ip)) != JIT_NO_ENTRY) { \
+                    JitContext context = {slots, sp, vm.globalValues, ip}; \
+                    enterJit(jit, &context, entry); \
+                    ip = context.ip; \
+                    sp = context.sp; \
+                } \
+            } while (false)
+        // Count loop iteration towards compiling the function, then continue in its machine code
+        #define JIT_LOOP() \
+            do { \
+                ObjFunction* function = frame->closure->function; \
+                if (function->hotness >= 0 && vm.jitEnabled && ++function->hotness >= JIT_THRESHOLD) compileJit(function); \
+                JIT_ENTER(); \
+            } while (false)
+    #else
+        // Traced and profiled loops see every instruction, so they never run machine code
+        #define JIT_ENTER() do { } while (false)
+        #define JIT_LOOP() do { } while (false)
+    #endif
+    /* Wrapper around simple binary operators for numbers
+    Pops two topmost numbers from stack and pushes result of operator
+    */
+    #define BINARY_OP(valueType, op) \
+        do { \
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+            double b = AS_NUMBER(POP()); \
+            double a = AS_NUMBER(POP()); \
+            PUSH(valueType(a op b)); \
+        } while (false)
+
+    #ifdef COMPUTED_GOTO
+        /* Threaded dispatch table with address of every opcode's label, indexed by OpCode
+        Every opcode from chunk.h must have its entry here, as missing one would jump to NULL
+        */
+        static void* dispatchTable[] = {
+            [OP_CONSTANT]       = &&op_OP_CONSTANT,
+            [OP_NIL]            = &&op_OP_NIL,
+            [OP_TRUE]           = &&op_OP_TRUE,
+            [OP_FALSE]          = &&op_OP_FALSE,
+            [OP_POP]            = &&op_OP_POP,
+            [OP_GET_LOCAL]      = &&op_OP_GET_LOCAL,
+            [OP_GET_LOCAL_0]    = &&op_OP_GET_LOCAL_0,
+            [OP_GET_LOCAL_1]    = &&op_OP_GET_LOCAL_1,
+            [OP_GET_LOCAL_2]    = &&op_OP_GET_LOCAL_2,
+            [OP_GET_LOCAL_3]    = &&op_OP_GET_LOCAL_3,
+            [OP_SET_LOCAL]      = &&op_OP_SET_LOCAL,
+            [OP_GET_GLOBAL]     = &&op_OP_GET_GLOBAL,
+            [OP_DEFINE_GLOBAL]  = &&op_OP_DEFINE_GLOBAL,
+            [OP_SET_GLOBAL]     = &&op_OP_SET_GLOBAL,
+            [OP_GET_UPVALUE]    = &&op_OP_GET_UPVALUE,
+            [OP_SET_UPVALUE]    = &&op_OP_SET_UPVALUE,
+            [OP_GET_PROPERTY]   = &&op_OP_GET_PROPERTY,
+            [OP_SET_PROPERTY]   = &&op_OP_SET_PROPERTY,
+            [OP_GET_SUPER]      = &&op_OP_GET_SUPER,
+            [OP_BUILD_LIST]     = &&op_OP_BUILD_LIST,
+            [OP_GET_INDEX]      = &&op_OP_GET_INDEX,
+            [OP_SET_INDEX]      = &&op_OP_SET_INDEX,
+            [OP_EQUAL]          = &&op_OP_EQUAL,
+            [OP_GREATER]        = &&op_OP_GREATER,
+            [OP_LESS]           = &&op_OP_LESS,
+            [OP_ADD]            = &&op_OP_ADD,
+            [OP_SUBTRACT]       = &&op_OP_SUBTRACT,
+            [OP_MULTIPLY]       = &&op_OP_MULTIPLY,
+            [OP_DIVIDE]         = &&op_OP_DIVIDE,
+            [OP_NOT]            = &&op_OP_NOT,
+            [OP_NEGATE]         = &&op_OP_NEGATE,
+            [OP_PRINT]          = &&op_OP_PRINT,
+            [OP_JUMP]           = &&op_OP_JUMP,
+            [OP_JUMP_IF_FALSE]  = &&op_OP_JUMP_IF_FALSE,
+            [OP_JUMP_IF_FALSE_POP] = &&op_OP_JUMP_IF_FALSE_POP,
+            [OP_LOOP]           = &&op_OP_LOOP,
+            [OP_CALL]           = &&op_OP_CALL,
+            [OP_TAIL_CALL]      = &&op_OP_TAIL_CALL,
+            [OP_INVOKE]         = &&op_OP_INVOKE,
+            [OP_SUPER_INVOKE]   = &&op_OP_SUPER_INVOKE,
+            [OP_CLOSURE]        = &&op_OP_CLOSURE,
+            [OP_CLOSE_UPVALUE]  = &&op_OP_CLOSE_UPVALUE,
+            [OP_RETURN]         = &&op_OP_RETURN,
+            [OP_CLASS]          = &&op_OP_CLASS,
+            [OP_INHERIT]        = &&op_OP_INHERIT,
+            [OP_METHOD]         = &&op_OP_METHOD,
+            [OP_ADD_LOCAL_LOCAL]    = &&op_OP_ADD_LOCAL_LOCAL,
+            [OP_INCREMENT_LOCAL]    = &&op_OP_INCREMENT_LOCAL,
+            [OP_LESS_LOCAL_CONSTANT_JUMP]       = &&op_OP_LESS_LOCAL_CONSTANT_JUMP,
+            [OP_GREATER_LOCAL_CONSTANT_JUMP]    = &&op_OP_GREATER_LOCAL_CONSTANT_JUMP,
+            [OP_GET_METHOD]     = &&op_OP_GET_METHOD,
+            [OP_CALL_LOCAL]     = &&op_OP_CALL_LOCAL,
+            [OP_GET_BOUND_METHOD]   = &&op_OP_GET_BOUND_METHOD,
+            [OP_ADD_NUMBER]     = &&op_OP_ADD_NUMBER,
+            [OP_EQUAL_NUMBER]   = &&op_OP_EQUAL_NUMBER,
+            [OP_GET_FIELD]      = &&op_OP_GET_FIELD,
+            [OP_INVOKE_METHOD]  = &&op_OP_INVOKE_METHOD,
+            [OP_WIDE]           = &&op_OP_WIDE,
+        };
+        #define CASE(opcode) op_##opcode // Label of the opcode's handler
+        // Jump straight to the next opcode's handler, so every handler ends with its own indirect branch
+        #define DISPATCH() \
+            do { \
+                TRACE_EXECUTION(); \
+                SAMPLE_EXECUTION(); \
+                instruction = READ_BYTE(); \
+                COUNT_INSTRUCTION(); \
+                goto *dispatchTable[instruction]; \
+            } while (false)
+    #else
+        #define CASE(opcode) case opcode // Switch case of the opcode's handler
+        #define DISPATCH() break // Go back to the top of the loop to read next opcode
+    #endif
+
+    LOAD_STATE(); // Start with the topmost callframe
+
+    uint8_t instruction = OP_CALL; // Loop is entered by a call, so a sample taken before the first instruction is charged to it
+    int index; // Constant, frame slot or upvalue operand, read as one byte or as two after OP_WIDE
+    bool wide = false; // Whether OP_CLOSURE was prefixed by OP_WIDE and has two bytes capture indexes
+    bool bind = false; // Whether property read for local by OP_GET_METHOD binds method, set by OP_GET_BOUND_METHOD
+
+    // Opcodes behaviour also documented in chunk.h
+    #ifdef COMPUTED_GOTO
+    DISPATCH(); // Start by jumping to the first opcode
+    {
+    #else
+    for (;;) {
+        TRACE_EXECUTION();
+        SAMPLE_EXECUTION();
+        instruction = READ_BYTE();
+        COUNT_INSTRUCTION();
+        switch (instruction)
+    #endif
+        {
+        CASE(OP_CONSTANT): index = READ_BYTE(); constant: { // Push constant from constants address to stack
+            Value constant = constants[index];
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP): DROP(); DISPATCH();
+        CASE(OP_GET_LOCAL): index = READ_BYTE(); getLocal: { // Push local from chunk's slot index to stack
+            PUSH(slots[index]);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_0): PUSH(slots[0]); DISPATCH();
+        CASE(OP_GET_LOCAL_1): PUSH(slots[1]); DISPATCH();
+        CASE(OP_GET_LOCAL_2): PUSH(slots[2]); DISPATCH();
+        CASE(OP_GET_LOCAL_3): PUSH(slots[3]); DISPATCH();
+        CASE(OP_SET_LOCAL): index = READ_BYTE(); setLocal: { // Update local on the slot from chunk with value from stack
+            slots[index] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): { // Push global from the slot specified by operand to stack
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues[slot];
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+            }
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): { // Define global in its slot, slots are reserved by compiler so nothing allocates
+            uint16_t slot = READ_SHORT();
+            vm.globalValues[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): { // Set global value with value from stack
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globalValues[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+            }
+            vm.globalValues[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): index = READ_BYTE(); getUpvalue: { // Get upvalue from upvalues table location
+            PUSH(*frame->closure->upvalues[index]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): index = READ_BYTE(); setUpvalue: { // Set upvalue value on the location with value from stack
+            writeBarrier(PEEK(0)); // Upvalue can be already closed and blackened
+            *frame->closure->upvalues[index]->location = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY): index = READ_BYTE(); getProperty: { // Get instance property
+            if (!IS_INSTANCE(PEEK(0))) {
+                RUNTIME_ERROR("Only instances have properties.");
+            }
+            ObjInstance* instance = AS_INSTANCE(PEEK(0));
+            ObjString* name = AS_STRING(constants[index]);
+            InlineCache* cache = READ_CACHE();
+            Value value;
+            PropertyKind kind = findProperty(instance, name, cache, &value);
+            if (kind == PROPERTY_FIELD) {
+                // Widened sites stay generic, as opcode's address would depend on the prefix
+                if (index <= UINT8_MAX && monomorphicCache(cache, instance)) QUICKEN(ip - 4, OP_GET_FIELD);
+                DROP(); // Pop instance
+                PUSH(value); // Push property value
+                DISPATCH(); // Finish resolving when found field
+            }
+            if (kind == PROPERTY_NONE) {
+                RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+            }
+
+            // Method found when field was not
+            SAVE_STATE();
+            ObjBoundMethod* bound = newBoundMethod(PEEK(0), AS_CLOSURE(value)); // Create method bound to instance from stack
+            DROP(); // Pop receiver instance
+            PUSH(OBJ_VAL(bound));
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY): index = READ_BYTE(); setProperty: { // Set instance from stack property with value with stack
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERROR("Only instances have fields.");
+            }
+            ObjInstance* instance = AS_INSTANCE(PEEK(1));
+            ObjString* name = AS_STRING(constants[index]);
+            InlineCache* cache = READ_CACHE();
+            writeBarrier(PEEK(0)); // Instance can be already blackened
+            if (!setCachedField(instance, name, cache, PEEK(0))) {
+                SAVE_STATE(); // Fields can grow and trigger GC
+                setField(instance, name, cache, PEEK(0));
+            }
+            Value value = POP(); // Pop value
+            DROP(); // Pop instance
+            PUSH(value); // Push value at the top of the stack as set statements should return what they evaluated to
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER): index = READ_BYTE(); getSuper: { // Get method from superclass
+            ObjString* name = AS_STRING(constants[index]);
+            ObjClass* superclass = AS_CLASS(POP());
+            SAVE_STATE();
+            if (!bindMethod(superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            sp = vm.stackTop;
+            DISPATCH();
+        }
+        CASE(OP_BUILD_LIST): index = READ_BYTE(); buildList: { // Replace elements on the stack with list holding them
+            SAVE_STATE(); // Elements stay on the stack while list allocation can trigger GC
+            ObjList* list = newList(index);
+            if (index > 0) memcpy(list->items.values, sp - index, sizeof(Value) * index); // Empty list has no array
+            sp -= index;
+            PUSH(OBJ_VAL(list));
+            DISPATCH();
+        }
+        CASE(OP_GET_INDEX): { // Replace list and index on the stack with element at the index
+            if (!IS_LIST(PEEK(1))) {
+                RUNTIME_ERROR("Only lists can be indexed.");
+            }
+            ObjList* list = AS_LIST(PEEK(1));
+            const char* error = checkIndex(list, PEEK(0));
+            if (error != NULL) {
+                RUNTIME_ERROR("%s", error);
+            }
+            Value value = list->items.values[(int)AS_NUMBER(POP())];
+            PEEK(0) = value;
+            DISPATCH();
+        }
+        CASE(OP_SET_INDEX): { // Set list element at the index, leaving the value on the stack
+            if (!IS_LIST(PEEK(2))) {
+                RUNTIME_ERROR("Only lists can be indexed.");
+            }
+            ObjList* list = AS_LIST(PEEK(2));
+            const char* error = checkIndex(list, PEEK(1));
+            if (error != NULL) {
+                RUNTIME_ERROR("%s", error);
+            }
+            writeBarrier(PEEK(0)); // List can be already blackened
+            list->items.values[(int)AS_NUMBER(PEEK(1))] = PEEK(0);
+            Value value = POP(); // Pop value
+            DROP(); // Pop index
+            PEEK(0) = value; // Value replaces list, as set expressions evaluate to what they assigned
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): equal: { // Check if values from stack equal
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) QUICKEN(ip - 1, OP_EQUAL_NUMBER);
+            if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1))) { // Ropes are compared by their flat strings
+                SAVE_STATE(); // Flattening allocates
+                flattenSlot(sp - 1);
+                flattenSlot(sp - 2);
+            }
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(OP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(OP_ADD): // Add two values from stack, quickening when they are numbers
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) QUICKEN(ip - 1, OP_ADD_NUMBER);
+        addValues: { // Generic addition, also of superinstructions whose operands weren't numbers
+            if (isString(PEEK(0)) && isString(PEEK(1))) {
+                SAVE_STATE(); // Concatenation allocates and works on VM's stack
+                concatenate();
+                sp = vm.stackTop;
+            } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a+b));
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_NOT): PEEK(0) = BOOL_VAL(isFalsey(PEEK(0))); DISPATCH(); // In place, as PUSH(POP()) would modify sp twice unsequenced
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        CASE(OP_PRINT): {
+            writeValue(&vm.output, POP());
+            writeOutput(&vm.output, "\n", 1);
+            endPrint(&vm.output);
+            DISPATCH();
+        }
+        CASE(OP_JUMP): { // Unconditionally jump over number of instructions
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): { // Jump over instructions if topmost value from stack false
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_POP): { // Pop topmost value from stack and jump over instructions if it was false
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(POP())) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): { // Jump backwards over instructions
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            JIT_LOOP();
+            DISPATCH();
+        }
+        CASE(OP_CALL): { // Call closure specified by adress from chunk
+            int argCount = READ_BYTE();
+            Value callee = PEEK(argCount);
+            SAVE_STATE();
+            if (IS_NATIVE(callee)) { // Natives don't push a frame, so only the stack top has to be reloaded
+                if (!callNative((ObjNative*)AS_OBJ(callee), argCount)) return INTERPRET_RUNTIME_ERROR;
+                sp = vm.stackTop;
+                JIT_ENTER();
+                DISPATCH();
+            }
+            if (!callValue(callee, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_STATE(); // callValue could add frame to the frame-stack, continue in the topmost one
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): { // Call closure in return position, letting its frame take place of the current one
+            int argCount = READ_BYTE();
+            SAVE_STATE();
+            int frameCount = vm.frameCount;
+            if (!callValue(PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (vm.frameCount > frameCount) { // Natives and classes without initializer already left result for OP_RETURN
+                CallFrame* callee = &vm.frames[vm.frameCount - 1];
+                CallFrame* caller = callee - 1;
+                closeUpvalues(caller->slots); // Caller's locals are overwritten, as if it returned
+                int count = (int)(vm.stackTop - callee->slots); // Callee and its arguments
+                memmove(caller->slots, callee->slots, sizeof(Value) * count);
+                vm.stackTop = caller->slots + count;
+                caller->closure = callee->closure;
+                caller->ip = callee->ip;
+                caller->tailCalls++;
+                vm.frameCount--;
+            }
+            LOAD_STATE(); // Continue in the callee reusing the frame
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE): index = READ_BYTE(); invoke: { // Invoke method specified by string from chunk
+            ObjString* method = AS_STRING(constants[index]);
+            int argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            Value receiver = PEEK(argCount);
+            // Cache is checked before the call, so the site is quickened on its second execution with the same receiver class
+            if (index <= UINT8_MAX && IS_INSTANCE(receiver) && monomorphicCache(cache, AS_INSTANCE(receiver))
+                    && cache->entries[0].method != NULL && cache->entries[0].classId == AS_INSTANCE(receiver)->klass->id) {
+                QUICKEN(ip - 5, OP_INVOKE_METHOD);
+            }
+            SAVE_STATE();
+            if (!invoke(method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_STATE(); // invoke could add frame to the frame-stack, continue in the topmost one
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE): index = READ_BYTE(); superInvoke: { // Invoke method specified by string from chunk, from class at the top of the stack
+            ObjString* method = AS_STRING(constants[index]);
+            int argCount = READ_BYTE();
+            ObjClass* superclass = AS_CLASS(POP());
+            SAVE_STATE();
+            if (!invokeFromClass(superclass, method, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_STATE(); // invokeFromClass added frame to the frame-stack, continue in the topmost one
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE): index = READ_BYTE(); wide = false; closure: { // Create closure from function specified in chunk
+            ObjFunction* function = AS_FUNCTION(constants[index]);
+            SAVE_STATE();
+            ObjClosure* closure = newClosure(function);
+            PUSH(OBJ_VAL(closure));
+            vm.stackTop = sp; // Keep closure visible to GC while upvalues are allocated
+
+            // Loop through all upvalues
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                int capture = wide ? READ_SHORT() : READ_BYTE();
+                if (isLocal) { // If local then capture
+                    closure->upvalues[i] = captureUpvalue(slots + capture);
+                } else { // If not local then should be already captured by enclosing function
+                    closure->upvalues[i] = frame->closure->upvalues[capture];
+                }
+            }
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE): // Move necessary upvalues from stack to heap
+            closeUpvalues(sp - 1);
+            DROP();
+            DISPATCH();
+        CASE(OP_RETURN): { // Clean local variables from stack and push function result. End run if outermost function
+                Value result = POP();
+                closeUpvalues(slots);
+                vm.frameCount--;
+                if (vm.frameCount == 0) {
+                    vm.stackTop = slots; // Pop script function
+                    return INTERPRET_OK;
+                }
+
+                sp = slots;
+                PUSH(result);
+                LOAD_FRAME(); // Continue in the caller, keeping the local stack top
+                JIT_ENTER();
+                DISPATCH();
+            }
+        CASE(OP_CLASS): index = READ_BYTE(); class: { // Push new class on stack
+            ObjString* name = AS_STRING(constants[index]);
+            SAVE_STATE();
+            PUSH(OBJ_VAL(newClass(name)));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): { // Add methods from superclass on stack to subclass on stack
+            Value superclass = PEEK(1);
+            if(!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
+            }
+
+            ObjClass* subclass = AS_CLASS(PEEK(0));
+            SAVE_STATE(); // Table can grow and trigger GC
+            writeBarrier(superclass); // Marking superclass keeps all copied methods alive
+            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+            subclass->id = vm.nextClassId++; // Invalidate inline caches holding previous methods
+            DROP(); //Subclass.
+            DISPATCH();
+        }
+        CASE(OP_METHOD): index = READ_BYTE(); method: { // Add method to class from stack
+            ObjString* name = AS_STRING(constants[index]);
+            SAVE_STATE();
+            defineMethod(name);
+            sp = vm.stackTop;
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_LOCAL): { // Push sum of two locals
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                DISPATCH();
+            }
+            // Strings and errors are handled as plain OP_ADD
+            PUSH(a);
+            PUSH(b);
+            goto addValues;
+        }
+        CASE(OP_INCREMENT_LOCAL): { // Add number constant to local in place
+            uint8_t slot = READ_BYTE();
+            Value amount = READ_CONSTANT();
+            if (!IS_NUMBER(slots[slot])) {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            slots[slot] = NUMBER_VAL(AS_NUMBER(slots[slot]) + AS_NUMBER(amount));
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_CONSTANT_JUMP): { // Jump over instructions unless local is less than number constant
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(a)) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            if (!(AS_NUMBER(a) < AS_NUMBER(b))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_GREATER_LOCAL_CONSTANT_JUMP): { // Jump over instructions unless local is greater than number constant
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(a)) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            if (!(AS_NUMBER(a) > AS_NUMBER(b))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_GET_METHOD): index = READ_BYTE(); bind = false; getMethod: { // Get instance property for local that is only called, without binding method
+            if (!IS_INSTANCE(PEEK(0))) {
+                RUNTIME_ERROR("Only instances have properties.");
+            }
+            ObjInstance* instance = AS_INSTANCE(PEEK(0));
+            ObjString* name = AS_STRING(constants[index]);
+            InlineCache* cache = READ_CACHE();
+            Value value;
+            PropertyKind kind = findProperty(instance, name, cache, &value);
+            if (kind == PROPERTY_NONE) {
+                RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+            }
+            if (kind == PROPERTY_FIELD) { // Field value is called as it is, so it takes place of receiver too
+                DROP();
+                PUSH(value);
+            } else if (bind) { // Calls compiled before the local escaped still pass receiver, bound method replaces it with the same one
+                SAVE_STATE();
+                value = OBJ_VAL(newBoundMethod(PEEK(0), AS_CLOSURE(value)));
+            }
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_GET_BOUND_METHOD): index = READ_BYTE(); bind = true; goto getMethod;
+        CASE(OP_CALL_LOCAL): index = READ_BYTE(); callLocal: { // Call value of local, with receiver or callee itself already below arguments
+            Value callee = slots[index];
+            int argCount = READ_BYTE();
+            SAVE_STATE();
+            if (IS_NATIVE(callee)) { // Natives don't push a frame, so only the stack top has to be reloaded
+                if (!callNative((ObjNative*)AS_OBJ(callee), argCount)) return INTERPRET_RUNTIME_ERROR;
+                sp = vm.stackTop;
+                JIT_ENTER();
+                DISPATCH();
+            }
+            if (!callValue(callee, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_STATE(); // callValue could add frame to the frame-stack, continue in the topmost one
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUMBER): // OP_ADD that saw numbers, its guard is all that's left of type dispatch
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                QUICKEN(ip - 1, OP_ADD);
+                goto addValues;
+            }
+            PEEK(1) = NUMBER_VAL(AS_NUMBER(PEEK(1)) + AS_NUMBER(PEEK(0)));
+            DROP();
+            DISPATCH();
+        CASE(OP_EQUAL_NUMBER): // OP_EQUAL that saw numbers, compares them without going through valuesEqual()
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                QUICKEN(ip - 1, OP_EQUAL);
+                goto equal;
+            }
+            PEEK(1) = BOOL_VAL(AS_NUMBER(PEEK(1)) == AS_NUMBER(PEEK(0)));
+            DROP();
+            DISPATCH();
+        CASE(OP_GET_FIELD): index = READ_BYTE(); { // OP_GET_PROPERTY of monomorphic site reading field
+            // Field entry stays first while the opcode is quickened, as only generic opcode fills the cache
+            InlineCacheEntry* entry = &frame->closure->function->chunk.caches[(ip[0] << 8) | ip[1]].entries[0];
+            if (IS_INSTANCE(PEEK(0))) {
+                ObjInstance* instance = AS_INSTANCE(PEEK(0));
+                if (instance->shape != NULL && instance->shape->id == entry->shapeId) {
+                    ip += 2; // Skip cache index
+                    PEEK(0) = instance->fields[entry->slot];
+                    DISPATCH();
+                }
+            }
+            QUICKEN(ip - 2, OP_GET_PROPERTY);
+            goto getProperty; // Generic opcode reads cache index again
+        }
+        CASE(OP_INVOKE_METHOD): index = READ_BYTE(); { // OP_INVOKE of monomorphic site calling method
+            int argCount = ip[0];
+            InlineCacheEntry* entry = &frame->closure->function->chunk.caches[(ip[1] << 8) | ip[2]].entries[0];
+            if (IS_INSTANCE(PEEK(argCount))) {
+                ObjInstance* instance = AS_INSTANCE(PEEK(argCount));
+                // Class id changes with methods, so matching one means the cached closure is still the method
+                if (instance->shape != NULL && instance->shape->id == entry->shapeId && instance->klass->id == entry->classId) {
+                    ip += 3; // Skip arguments count and cache index
+                    SAVE_STATE();
+                    if (!call((ObjClosure*)entry->method, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    LOAD_STATE();
+                    JIT_ENTER();
+                    DISPATCH();
+                }
+            }
+            QUICKEN(ip - 2, OP_INVOKE);
+            goto invoke; // Generic opcode reads arguments count and cache index again
+        }
+        CASE(OP_WIDE): { // Read two bytes index and continue in the handler of the prefixed opcode
+            instruction = READ_BYTE();
+            index = READ_SHORT();
+            switch (instruction) {
+            case OP_CONSTANT: goto constant;
+            case OP_GET_LOCAL: goto getLocal;
+            case OP_SET_LOCAL: goto setLocal;
+            case OP_GET_UPVALUE: goto getUpvalue;
+            case OP_SET_UPVALUE: goto setUpvalue;
+            case OP_GET_PROPERTY: goto getProperty;
+            case OP_SET_PROPERTY: goto setProperty;
+            case OP_GET_SUPER: goto getSuper;
+            case OP_BUILD_LIST: goto buildList;
+            case OP_INVOKE: goto invoke;
+            case OP_SUPER_INVOKE: goto superInvoke;
+            case OP_CLOSURE: wide = true; goto closure;
+            case OP_CLASS: goto class;
+            case OP_METHOD: goto method;
+            case OP_GET_METHOD: bind = false; goto getMethod;
+            case OP_GET_BOUND_METHOD: bind = true; goto getMethod;
+            case OP_CALL_LOCAL: goto callLocal;
+            default: break; // Unreachable, compiler widens only opcodes above
+            }
+            DISPATCH();
+        }
+        }
+    }
+// Clean up the macros
+#undef SAVE_STATE
+#undef LOAD_FRAME
+#undef LOAD_STATE
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_CACHE
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef QUICKEN
+#undef JIT_ENTER
+#undef JIT_LOOP
+#undef TRACE_EXECUTION
+#undef SAMPLE_EXECUTION
+#undef COUNT_INSTRUCTION
+#undef CASE
+#undef DISPATCH
+#undef vm
+#define vm (*currentVM)
+}
+
+#undef RUN_FUNCTION
+#undef RUN_TRACE
+#undef RUN_PROFILE
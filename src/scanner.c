@@ -4,31 +4,36 @@
 #include "common.h"
 #include "scanner.h"
 
-/* Scanner struct
-*
-*   Fields:
-*   - const char* start: start of the current lexeme being scanned
-*   - const char* current: current character
-*   - int line: line number of the scanned lexeme for error logging
-*/
-typedef struct {
-    const char* start; // start of the current lexeme being scanned
-    const char* current; // current character
-    int line; // line number of the scanned lexeme for error logging
-} Scanner;
-
-Scanner scanner;
+THREAD_LOCAL Scanner scanner; // Scanner of the calling thread
 
 /* Initialize global scanner variable
 *   Arguments:
-*   - const char* source: code to be scanned
+*   - const char* source: code to be scanned, doesn't have to be null-terminated
+*   - size_t length: of source
 */
-void initScanner(const char* source) {
+void initScanner(const char* source, size_t length) {
     scanner.start = source;
     scanner.current = source;
+    scanner.end = source + length;
     scanner.line = 1;
 }
 
+/* Get state of scanner, to come back to it after looking ahead
+*
+*   Return copy of the scanner
+*/
+Scanner saveScanner() {
+    return scanner;
+}
+
+/* Restore state of scanner
+*   Arguments:
+*   - Scanner state: saved before looking ahead
+*/
+void restoreScanner(Scanner state) {
+    scanner = state;
+}
+
 /* Check if character is alphanumeric
 *   Arguments:
 *   - char c: character to be checked
@@ -49,7 +54,7 @@ static bool isDigit(char c) {
 
 // Check if scenner reached end of file
 static bool isAtEnd() {
-    return *scanner.current == '\0';
+    return scanner.current >= scanner.end; // Source can be mapped file without terminating character
 }
 
 /* Advance scanner to the next character
@@ -63,12 +68,13 @@ static char advance() {
 
 // Return currently scanned character without advancing scanner
 static char peek() {
+    if (isAtEnd()) return '\0';
     return *scanner.current;
 }
 
 // Return next character without advancing scanner
 static char peekNext() {
-    if (isAtEnd()) return '\0';
+    if (scanner.end - scanner.current < 2) return '\0';
     return scanner.current[1];
 }
 
@@ -136,6 +142,7 @@ static void skipWhitespace() {
             } else {
                 return;
             }
+            break; // Line break or end of file is handled by the next iteration
         default:
             return;
         }
@@ -244,6 +251,8 @@ Token scanToken() {
     case ')': return makeToken(TOKEN_RIGHT_PAREN);
     case '{': return makeToken(TOKEN_LEFT_BRACE);
     case '}': return makeToken(TOKEN_RIGHT_BRACE);
+    case '[': return makeToken(TOKEN_LEFT_BRACKET);
+    case ']': return makeToken(TOKEN_RIGHT_BRACKET);
     case ';': return makeToken(TOKEN_SEMICOLON);
     case ',': return makeToken(TOKEN_COMMA);
     case '.': return makeToken(TOKEN_DOT);
@@ -1,12 +1,16 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include <stddef.h>
+
 typedef enum {
     //Single-character tokens
     TOKEN_LEFT_PAREN,       // (
     TOKEN_RIGHT_PAREN,      // )
     TOKEN_LEFT_BRACE,       // {
     TOKEN_RIGHT_BRACE,      // }
+    TOKEN_LEFT_BRACKET,     // [
+    TOKEN_RIGHT_BRACKET,    // ]
     TOKEN_COMMA,            // ,
     TOKEN_DOT,              // .
     TOKEN_MINUS,            // -
@@ -63,13 +67,41 @@ typedef struct {
     int line; // number of line in source code when token is present
 } Token;
 
+/* Scanner struct
+*
+*   Fields:
+*   - const char* start: start of the current lexeme being scanned
+*   - const char* current: current character
+*   - const char* end: one past the last character of the source
+*   - int line: line number of the scanned lexeme for error logging
+*/
+typedef struct {
+    const char* start; // start of the current lexeme being scanned
+    const char* current; // current character
+    const char* end; // one past the last character of the source
+    int line; // line number of the scanned lexeme for error logging
+} Scanner;
+
 /* Initialize scanner
 *   Arguments:
-*   - const char* source: code to be scanned
+*   - const char* source: code to be scanned, doesn't have to be null-terminated
+*   - size_t length: of source
 */
-void initScanner(const char* source);
+void initScanner(const char* source, size_t length);
 
 // Scan next token
 Token scanToken();
 
+/* Get state of scanner, to come back to it after looking ahead
+*
+*   Return copy of the scanner
+*/
+Scanner saveScanner();
+
+/* Restore state of scanner
+*   Arguments:
+*   - Scanner state: saved before looking ahead
+*/
+void restoreScanner(Scanner state);
+
 #endif
\ No newline at end of file
@@ -6,7 +6,94 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75 // Load percentage threshold that when exceeded table growth will be triggered
+#define TABLE_MAX_LOAD 0.875 // Load percentage threshold that when exceeded table growth will be triggered
+
+#define CONTROL_EMPTY 0x80 // Control byte of entry never used since last resize
+#define CONTROL_DELETED 0xfe // Control byte of deleted entry, probing has to continue past it
+#define HASH_TAG(hash) ((uint8_t)((hash) >> 25)) // Top 7 bits of hash kept in control byte of full entry
+#define ENTRY_SIZE (sizeof(Value) + sizeof(ObjString*) + 1) // Bytes taken by every entry across the three arrays
+
+/* Group probing yields a mask with one set bit (SSE2 and scalar) or nibble (NEON) for every matching entry.
+Entry index within group is the number of trailing zeros divided by MASK_STRIDE
+*/
+#if defined(__SSE2__) && !defined(NO_SIMD)
+    #include <emmintrin.h>
+
+    typedef uint32_t GroupMask;
+    #define MASK_STRIDE 1
+
+    // Mask of entries in group with given control byte
+    static inline GroupMask groupMatch(const uint8_t* group, uint8_t byte) {
+        __m128i control = _mm_loadu_si128((const __m128i*)group);
+        return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+    }
+
+    // Mask of empty or deleted entries in group, which are the only control bytes with high bit set
+    static inline GroupMask groupMatchFree(const uint8_t* group) {
+        return (GroupMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+    }
+#elif defined(__ARM_NEON) && !defined(NO_SIMD)
+    #include <arm_neon.h>
+
+    typedef uint64_t GroupMask;
+    #define MASK_STRIDE 4
+
+    // NEON has no movemask, narrowing shift packs every comparison byte into a nibble instead
+    static inline GroupMask neonMask(uint8x16_t matches) {
+        uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+        return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888ull; // Single bit per nibble
+    }
+
+    // Mask of entries in group with given control byte
+    static inline GroupMask groupMatch(const uint8_t* group, uint8_t byte) {
+        return neonMask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte)));
+    }
+
+    // Mask of empty or deleted entries in group, which are the only control bytes with high bit set
+    static inline GroupMask groupMatchFree(const uint8_t* group) {
+        return neonMask(vcgeq_u8(vld1q_u8(group), vdupq_n_u8(0x80)));
+    }
+#else
+    typedef uint32_t GroupMask;
+    #define MASK_STRIDE 1
+
+    // Mask of entries in group with given control byte
+    static inline GroupMask groupMatch(const uint8_t* group, uint8_t byte) {
+        GroupMask mask = 0;
+        for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+            if (group[i] == byte) mask |= (GroupMask)1 << i;
+        }
+        return mask;
+    }
+
+    // Mask of empty or deleted entries in group, which are the only control bytes with high bit set
+    static inline GroupMask groupMatchFree(const uint8_t* group) {
+        GroupMask mask = 0;
+        for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+            if (group[i] & 0x80) mask |= (GroupMask)1 << i;
+        }
+        return mask;
+    }
+#endif
+
+/* Get index within group of the first entry in mask
+*   Arguments:
+*   - GroupMask mask: non-zero result of group probe
+*
+*   Return entry index within group
+*/
+static inline int maskIndex(GroupMask mask) {
+    #if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(mask) / MASK_STRIDE;
+    #else
+        int bit = 0;
+        while (!(mask & 1)) {
+            mask >>= 1;
+            bit++;
+        }
+        return bit / MASK_STRIDE;
+    #endif
+}
 
 /* Initialize hash table
 *   Arguments:
@@ -15,7 +102,9 @@
 void initTable(Table* table) {
     table->count = 0;
     table->capacity = 0;
-    table->entries = NULL;
+    table->control = NULL;
+    table->keys = NULL;
+    table->values = NULL;
 }
 
 /* Free memory of a hash table
@@ -23,42 +112,72 @@ void initTable(Table* table) {
 *   - Table* table: to be freed
 */
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(uint8_t, table->values, table->capacity * ENTRY_SIZE); // Values start the single allocation
     initTable(table);
 }
 
 /* Find entry within hash table
 *   Arguments:
-*   - Entry* entries: pointer to the first entry of hash table t search in
-*   - int capacity: number of entries within hash table
+*   - Table* table: to search in, has to have non-zero capacity
 *   - ObjString* key: to be found
 *
-*   Return entry if found
-*/
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash & (capacity - 1); //Optimized wrapping around the table
-    Entry* tombstone = NULL;
-
-    for (;;) {
-        Entry* entry = &entries[index];
-
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) { // Truly empty entry found
-                // If tombstone was found previously return it so it ca be reused. Return empty entry otherwise.
-                return tombstone != NULL ? tombstone : entry;
-            } else if (tombstone == NULL) {
-                // First tombstone found, storing in <tombstone>
-                tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            //Key found
-            return entry;
+*   Return index of the entry, -1 if not found
+*/
+static int findEntry(Table* table, ObjString* key) {
+    int groupMask = table->capacity / TABLE_GROUP_SIZE - 1;
+    int group = key->hash & groupMask;
+    uint8_t tag = HASH_TAG(key->hash);
+
+    for (int step = 1;; step++) {
+        const uint8_t* control = &table->control[group * TABLE_GROUP_SIZE];
+        for (GroupMask match = groupMatch(control, tag); match != 0; match &= match - 1) { // Only tag matches load keys
+            int index = group * TABLE_GROUP_SIZE + maskIndex(match);
+            if (table->keys[index] == key) return index; // Key found
         }
+        // Group with empty entry was never full, so key would have been put into it
+        if (groupMatch(control, CONTROL_EMPTY) != 0) return -1;
+
+        group = (group + step) & groupMask; // Triangular probing visits every group once
+    }
+}
+
+/* Find entry where new key can be put
+*   Arguments:
+*   - Table* table: to search in, has to have non-zero capacity
+*   - uint32_t hash: of the key
+*
+*   Return index of the first empty or deleted entry on probe sequence
+*/
+static int findFreeEntry(Table* table, uint32_t hash) {
+    int groupMask = table->capacity / TABLE_GROUP_SIZE - 1;
+    int group = hash & groupMask;
+
+    for (int step = 1;; step++) {
+        GroupMask free = groupMatchFree(&table->control[group * TABLE_GROUP_SIZE]);
+        if (free != 0) return group * TABLE_GROUP_SIZE + maskIndex(free);
 
-        index = (index + 1) & (capacity - 1); //Optimized wrapping around the table
+        group = (group + step) & groupMask; // Triangular probing visits every group once
     }
 }
 
+/* Remove entry at given index
+*   Arguments:
+*   - Table* table: to delete from
+*   - int index: of full entry
+*/
+static void eraseEntry(Table* table, int index) {
+    int group = index / TABLE_GROUP_SIZE;
+    if (groupMatch(&table->control[group * TABLE_GROUP_SIZE], CONTROL_EMPTY) != 0) {
+        // Probing stops at this group anyway, so entry can become empty instead of deleted
+        table->control[index] = CONTROL_EMPTY;
+        table->count--;
+    } else {
+        table->control[index] = CONTROL_DELETED; // Required for hash collision solving
+    }
+    table->keys[index] = NULL;
+    table->values[index] = NIL_VAL;
+}
+
 /* Get entry from hash table
 *   Arguments:
 *   - Table* table: to search in
@@ -68,43 +187,62 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count ==0) return false; // Nothing to look in
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false; // Did not found the key
+    int index = findEntry(table, key);
+    if (index == -1) return false; // Did not found the key
 
-    *value = entry->value;
+    *value = table->values[index];
     return true;
 }
 
+/* Find index of the entry in hash table
+*   Arguments:
+*   - Table* table: to search in
+*   - ObjString* key: to be found
+*
+*   Return index of the entry within keys and values arrays, -1 if not found
+*/
+int tableFindIndex(Table* table, ObjString* key) {
+    if (table->count == 0) return -1; // Nothing to look in
+
+    return findEntry(table, key);
+}
+
 /* Adjust capicity for table entries
 *   Arguments:
 *   - Table* table: to resize
-*   - int capacity: the new capacity
+*   - int capacity: the new capacity, multiple of TABLE_GROUP_SIZE
 */
 static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity); // Allocate memory for the new entries
+    // Values, keys and control bytes share one allocation, values first as they need the strictest alignment
+    uint8_t* memory = ALLOCATE(uint8_t, capacity * ENTRY_SIZE);
+    Table resized;
+    resized.count = 0;
+    resized.capacity = capacity;
+    resized.values = (Value*)memory;
+    resized.keys = (ObjString**)(memory + capacity * sizeof(Value));
+    resized.control = memory + capacity * (sizeof(Value) + sizeof(ObjString*));
 
     // Initialize new entries
+    memset(resized.control, CONTROL_EMPTY, capacity);
     for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+        resized.keys[i] = NULL;
+        resized.values[i] = NIL_VAL;
     }
 
-    // As the capicity is used in calulation of the bucket the entries must be reassigned
-    table->count = 0;
+    // As the capicity is used in calulation of the group the entries must be reassigned, deleted ones are dropped
     for (int i = 0; i < table->capacity; i++) { // For all entries
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue; // Skip over empty entries and tombstones
-
-        Entry* dest = findEntry(entries, capacity, entry->key); // Find to which new bucket entry should be assigned
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        ObjString* key = table->keys[i];
+        if (key == NULL) continue; // Skip over empty and deleted entries
+
+        int dest = findFreeEntry(&resized, key->hash); // Find to which new entry key should be assigned
+        resized.control[dest] = HASH_TAG(key->hash);
+        resized.keys[dest] = key;
+        resized.values[dest] = table->values[i];
+        resized.count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity); // Release memory of the old array
-
-    table->entries = entries;
-    table->capacity = capacity;
+    freeTable(table); // Release memory of the old arrays
+    *table = resized;
 }
 
 /* Update or add entry to hash table
@@ -119,18 +257,23 @@ bool tableSet(Table* table, ObjString* key, Value value) {
 
     // Adjust capacity of the table if capacity would cross TABLE_MAX_LOAD threshold
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
+        int capacity = table->capacity < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE : table->capacity * 2;
         adjustCapacity(table, capacity);
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key); // Find to which bucket entry should be assigned
-    bool isNewKey = entry->key == NULL; // Check if entry with that key already existed
 
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    int index = findEntry(table, key);
+    if (index != -1) { // Entry with that key already existed
+        table->values[index] = value;
+        return false;
+    }
 
-    entry->key = key;
-    entry->value = value;
+    index = findFreeEntry(table, key->hash); // Find to which entry key should be assigned
+    if (table->control[index] == CONTROL_EMPTY) table->count++; // Reused deleted entries are counted already
 
-    return isNewKey;
+    table->control[index] = HASH_TAG(key->hash);
+    table->keys[index] = key;
+    table->values[index] = value;
+    return true;
 }
 
 /* Delete entry from hash table
@@ -143,14 +286,10 @@ bool tableSet(Table* table, ObjString* key, Value value) {
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false; // Nothing to delete
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-
-    if (entry->key == NULL) return false;
-
-    // Following pair of values indicate value is a tombstone, required for hash collision solving
-    entry->key == NULL;
-    entry->value = BOOL_VAL(true);
+    int index = findEntry(table, key);
+    if (index == -1) return false;
 
+    eraseEntry(table, index);
     return true;
 }
 
@@ -161,9 +300,8 @@ bool tableDelete(Table* table, ObjString* key) {
 */
 void tableAddAll(Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) { // For all entries
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+        if (from->keys[i] != NULL) {
+            tableSet(to, from->keys[i], from->values[i]);
         }
     }
 }
@@ -178,18 +316,22 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL; // Nothing to look in
 
-    uint32_t index = hash & (table->capacity - 1); //Optimized wrapping around the table
+    int groupMask = table->capacity / TABLE_GROUP_SIZE - 1;
+    int group = hash & groupMask;
+    uint8_t tag = HASH_TAG(hash);
 
-    for (;;) {
-        Entry* entry = &table->entries[index];
+    for (int step = 1;; step++) {
+        const uint8_t* control = &table->control[group * TABLE_GROUP_SIZE];
+        for (GroupMask match = groupMatch(control, tag); match != 0; match &= match - 1) { // Only tag matches load keys
+            ObjString* key = table->keys[group * TABLE_GROUP_SIZE + maskIndex(match)];
+            if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) { // Found exact entry
+                return key;
+            }
+        }
+        // If group has empty entry then string that we look for does not exist
+        if (groupMatch(control, CONTROL_EMPTY) != 0) return NULL;
 
-        if (entry->key == NULL) { // Tombstone or empty entry found
-            if (IS_NIL(entry->value)) return NULL; // If empty entry then string that we look for does nt exist
-        } else if (entry->key->length == length && entry->key->hash == hash 
-                    && memcmp(entry->key->chars,chars, length) == 0) { // Found exact entry
-                        return entry->key;
-                    }
-        index = (index + 1) & (table->capacity -1); //Optimized wrapping around the table
+        group = (group + step) & groupMask; // Triangular probing visits every group once
     }
 }
 
@@ -199,9 +341,9 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
 */
 void tableRemoveWhite(Table* table) {
     for (int i = 0; i < table->capacity; i++) { // For all entries
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) { // If not marked by GC "mark" stage
-            tableDelete(table, entry->key);
+        ObjString* key = table->keys[i];
+        if (key != NULL && !key->obj.isMarked) { // If not marked by GC "mark" stage
+            eraseEntry(table, i);
         }
     }
 }
@@ -212,8 +354,8 @@ void tableRemoveWhite(Table* table) {
 */
 void markTable(Table* table) {
     for (int i = 0; i < table->capacity; i++) { // For all entries
-        Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
-        markValue(entry->value);
+        if (table->keys[i] == NULL) continue; // Empty and deleted entries hold nil
+        markObject((Obj*)table->keys[i]);
+        markValue(table->values[i]);
     }
-}
\ No newline at end of file
+}
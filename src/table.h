@@ -4,28 +4,25 @@
 #include "common.h"
 #include "value.h"
 
-/* Hash table entry struct
-*
-*   Fields:
-*   - ObjString* key: string object containing hash field
-*   - Value value
-*/
-typedef struct {
-    ObjString* key; // string object containing hash field
-    Value value;
-} Entry;
+#define TABLE_GROUP_SIZE 16 // Number of control bytes probed at once
 
-/* Hash table struct
+/* Hash table struct, laid out as Swiss table. Entries are split into groups of TABLE_GROUP_SIZE. Every entry has
+control byte, that is either empty or deleted marker or 7 bits of key's hash, so whole group is probed at once
+by comparing control bytes, and only entries whose bytes match have their keys loaded
 *
 *   Fields:
-*   - int count: current number of entries
-*   - int capacity: current capacity
-*   - Entry* entries: pointer to first entry
+*   - int count: current number of entries, including deleted ones
+*   - int capacity: current capacity, 0 or multiple of TABLE_GROUP_SIZE
+*   - uint8_t* control: pointer to first control byte
+*   - ObjString** keys: pointer to first key, NULL for empty and deleted entries
+*   - Value* values: pointer to first value
 */
 typedef struct {
-    int count; // current number of entries
-    int capacity; // current capacity
-    Entry* entries; // pointer to first entry
+    int count; // current number of entries, including deleted ones
+    int capacity; // current capacity, 0 or multiple of TABLE_GROUP_SIZE
+    uint8_t* control; // pointer to first control byte
+    ObjString** keys; // pointer to first key, NULL for empty and deleted entries
+    Value* values; // pointer to first value
 } Table;
 
 /* Initialize hash table
@@ -48,6 +45,15 @@ void freeTable(Table* table);
 */
 bool tableGet(Table* table, ObjString* key, Value* value);
 
+/* Find index of the entry in hash table
+*   Arguments:
+*   - Table* table: to search in
+*   - ObjString* key: to be found
+*
+*   Return index of the entry within keys and values arrays, -1 if not found
+*/
+int tableFindIndex(Table* table, ObjString* key);
+
 /* Update or add entry to hash table
 *   Arguments:
 *   - Table* table: pointer to the table to update
@@ -42,31 +42,61 @@ void freeValueArray(ValueArray* array) {
     initValueArray(array);
 }
 
-/* Print value
+/* Append value to output buffer
 *   Arguments:
-*   - Value value: to be printed
+*   - Output* output: to write to
+*   - Value value: to be written
 */
-void printValue(Value value) {
+void writeValue(Output* output, Value value) {
     #ifndef NAN_BOXING
         switch (value.type) {
-            case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
-            case VAL_NIL: printf("nil"); break;
-            case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-            case VAL_OBJ: printObject(value); break;
+            case VAL_BOOL: writeOutput(output, AS_BOOL(value) ? "true" : "false", AS_BOOL(value) ? 4 : 5); break;
+            case VAL_NIL: writeOutput(output, "nil", 3); break;
+            case VAL_NUMBER: writeOutputNumber(output, AS_NUMBER(value)); break;
+            case VAL_OBJ: writeObject(output, value); break;
+            default: break;
         }
     #else
-        if (IS_BOOL(value)) {
-            printf(AS_BOOL(value) ? "true" : "false");
-        } else if (IS_NIL(value)) {
-            printf("nil");
-        } else if (IS_NUMBER(value)) {
-            printf("%g", AS_NUMBER(value));
+        if (IS_NUMBER(value)) {
+            writeOutputNumber(output, AS_NUMBER(value));
         } else if (IS_OBJ(value)) {
-            printObject(value);
+            writeObject(output, value);
+        } else if (IS_BOOL(value)) {
+            writeOutput(output, AS_BOOL(value) ? "true" : "false", AS_BOOL(value) ? 4 : 5);
+        } else if (IS_NIL(value)) {
+            writeOutput(output, "nil", 3);
         }
     #endif
 }
 
+/* Print value to stdout, for debugging output that isn't buffered by VM
+*   Arguments:
+*   - Value value: to be printed
+*/
+void printValue(Value value) {
+    char buffer[256];
+    Output output;
+    initOutput(&output, stdout, buffer, sizeof(buffer));
+    writeValue(&output, value);
+    freeOutput(&output);
+}
+
+/* Check if two different string objects have the same characters
+*   Arguments:
+*   - Value a: first value to be compared
+*   - Value b: second value to be compared
+*
+*   Return whether both values are strings that are not interned and have equal characters
+*/
+static bool longStringsEqual(Value a, Value b) {
+    if (!IS_STRING(a) || !IS_STRING(b)) return false;
+    ObjString* left = AS_STRING(a);
+    ObjString* right = AS_STRING(b);
+    if (left->interned || right->interned) return false; // Interned string is equal only to itself
+    return left->length == right->length && stringHash(left) == stringHash(right) // Hash is cached for next comparisons
+        && memcmp(left->chars, right->chars, left->length) == 0;
+}
+
 /* Check if values are equal
 *   Arguments:
 *   - Value a: first value to be compared
@@ -84,7 +114,7 @@ bool valuesEqual(Value a, Value b) {
             case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
             case VAL_NIL: return true;
             case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-            case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+            case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b) || longStringsEqual(a, b);
             default: return false; //Unreachable
         }
     #else
@@ -92,6 +122,7 @@ bool valuesEqual(Value a, Value b) {
         if (IS_NUMBER(a) && IS_NUMBER(b)) {
             return AS_NUMBER(a) == AS_NUMBER(b);
         }
-        return a == b; // All bytes needs to be equal for values other than numers to be equal
+        // All bytes needs to be equal for values other than numers to be equal, except long strings
+        return a == b || longStringsEqual(a, b);
     #endif
 }
\ No newline at end of file
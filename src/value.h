@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "output.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
@@ -14,7 +15,8 @@ typedef enum {
     VAL_BOOL,   // Boolean
     VAL_NIL,    // Nil
     VAL_NUMBER, // Number
-    VAL_OBJ     // Object
+    VAL_OBJ,    // Object
+    VAL_UNDEFINED // Marker of global slot not defined yet, never visible to Lox code
 } ValueType;
 
 /* Value struct
@@ -36,6 +38,7 @@ typedef struct {
 #define IS_NIL(value)       ((value).type == VAL_NIL)
 #define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_OBJ(value)       ((value).as.obj) // Treat value as object
 #define AS_BOOL(value)      ((value).as.boolean) // Treat value as boolean
@@ -45,6 +48,7 @@ typedef struct {
 #define NIL_VAL             ((Value){VAL_NIL, {.number = 0}}) // Type field is all we care about here
 #define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)     ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #else // do NaN boxing
 
@@ -59,6 +63,7 @@ typedef struct {
 #define TAG_NIL 1   //01
 #define TAG_FALSE 2 //10
 #define TAG_TRUE 3  //11
+#define TAG_UNDEFINED 4 //100, marker of global slot not defined yet, never visible to Lox code
 
 typedef uint64_t Value;
 
@@ -66,6 +71,7 @@ typedef uint64_t Value;
 #define IS_NIL(value)       ((value) == NIL_VAL) // all bits must be the same
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN) // QNAN bits are not set, indicating number
 #define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT)) // No bits inside QNAN and SIGN_BIT are 0, indicating Obj address
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
 #define AS_NUMBER(value)    valueToNum(value)
@@ -75,6 +81,7 @@ typedef uint64_t Value;
 #define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num)     numToValue(num)
 #define OBJ_VAL(obj)        (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj)) // Object address with QNAN and SIGN bits set
 
@@ -145,7 +152,14 @@ void writeValueArray(ValueArray* array, Value value);
 */
 void freeValueArray(ValueArray* array);
 
-/* Print value
+/* Append value to output buffer
+*   Arguments:
+*   - Output* output: to write to
+*   - Value value: to be written
+*/
+void writeValue(Output* output, Value value);
+
+/* Print value to stdout, for debugging output that isn't buffered by VM
 *   Arguments:
 *   - Value value: to be printed
 */
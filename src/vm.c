@@ -1,27 +1,19 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "native.h"
+#include "profiler.h"
 #include "vm.h"
 
-VM vm; // Global VM
-
-/* Native function - Calculate how long did it take since program start
-*   Arguments:
-*   - int argCount - arguments required by native wrapper, disregarded
-*   - Value* args - arguments required by native wrapper, disregarded
-*
-*   Return number of seconds since program start
-*/
-static Value clockNative(int argCount, Value* args) {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
-}
+THREAD_LOCAL VM* currentVM = NULL; // VM the calling thread works with
 
 // Reset global VM stack
 static void resetStack() {
@@ -35,7 +27,9 @@ static void resetStack() {
 *   - const char* format: string to print
 *   - ... - arbitrary number of arguments passed to vfprintf
 */
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
+    flushOutput(&vm.output); // What the program printed before the error goes first
+
     // Handles "..."
     va_list args;
     va_start(args, format);
@@ -45,62 +39,173 @@ static void runtimeError(const char* format, ...) {
 
     fputs("\n", stderr);
 
-    // Print callstack
+    // Print callstack, skipping the middle of deep recursion
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+            fprintf(stderr, "[... %d more calls]\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES - 1;
+        }
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
             fprintf(stderr, "%s()\n", function->name->chars);
         }
+        if (frame->tailCalls > 0) fprintf(stderr, "[... %d tail calls]\n", frame->tailCalls); // Frames reused by callee
     }
     
     resetStack(); // Free memory of stack
 }
 
-/* Define native function in globals table
+/* Find slot of global variable, reserving a new undefined slot for name seen the first time
 *   Arguments:
-*   - const char* name: of the function in Lox
-*   - NativeFn function: that should be wrapped
-*/
-static void defineNative(const char* name, NativeFn function) {
-    // Push function and its name to stack, not to be cleaned by GC duing tableSet
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
+*   - ObjString* name: of the global
+*
+*   Return slot index in globalValues
+*/
+int globalSlot(ObjString* name) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(OBJ_VAL(name)); // Keep name reachable while slots grow and trigger GC
+    if (vm.globalCapacity < vm.globalCount + 1) {
+        int oldCapacity = vm.globalCapacity;
+        vm.globalCapacity = GROW_CAPACITY(oldCapacity);
+        vm.globalValues = GROW_ARRAY(Value, vm.globalValues, oldCapacity, vm.globalCapacity);
+    }
+    vm.globalValues[vm.globalCount] = UNDEFINED_VAL;
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(vm.globalCount));
     pop();
+    return vm.globalCount++;
+}
+
+/* Find name of global variable
+*   Arguments:
+*   - int slot: of the global
+*
+*   Return name the slot was reserved for
+*/
+ObjString* globalName(int slot) {
+    // Reverse lookup is slow, but only needed for error messages and disassembly
+    for (int i = 0; i < vm.globalSlots.capacity; i++) {
+        ObjString* key = vm.globalSlots.keys[i];
+        if (key != NULL && AS_NUMBER(vm.globalSlots.values[i]) == slot) return key;
+    }
+    return NULL;
 }
 
 // Initiaize global VM
 void initVM() {
+    // Stacks start small and grow on calls. C allocator is used, so growing never triggers GC in the middle of a call
+    vm.frameCapacity = FRAMES_INITIAL;
+    vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * vm.frameCapacity);
+    vm.stackCapacity = STACK_INITIAL;
+    vm.stack = (Value*)malloc(sizeof(Value) * vm.stackCapacity);
+    if (vm.frames == NULL || vm.stack == NULL) exit(1);
     resetStack();
-    vm.objects = NULL;
+    for (int i = 0; i < SLAB_SIZE_CLASSES; i++) {
+        vm.slabs[i] = NULL;
+        vm.allocSlabs[i] = NULL;
+    }
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm.gcGrowFactor = GC_HEAP_GROW_FACTOR;
+    vm.gcMinHeap = GC_MIN_HEAP;
+    vm.gcMaxHeap = 0;
+    vm.nextGC = vm.gcMinHeap;
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
-
-    initTable(&vm.globals);
+    vm.gcPhase = GC_IDLE;
+    vm.sweepClass = 0;
+    vm.sweepLink = NULL;
+    vm.gcCollections = 0;
+    vm.gcBytesFreed = 0;
+    vm.gcPeakHeap = 0;
+    vm.gcGrayMax = 0;
+    memset(vm.gcLiveObjects, 0, sizeof(vm.gcLiveObjects));
+    memset(vm.gcLiveBytes, 0, sizeof(vm.gcLiveBytes));
+    memset(vm.gcSurvivors, 0, sizeof(vm.gcSurvivors));
+    memset(vm.gcSurvivorBytes, 0, sizeof(vm.gcSurvivorBytes));
+
+    initOutput(&vm.output, stdout, NULL, 0);
+    vm.traceExecution = false;
+    vm.dumpBytecode = false;
+    vm.profile = NULL;
+#ifdef BASELINE_JIT
+    vm.jitEnabled = true;
+#else
+    vm.jitEnabled = false;
+#endif
+    vm.gcStats = false;
+    memset(vm.gcPauses, 0, sizeof(vm.gcPauses));
+    vm.gcPauseCount = 0;
+    vm.gcPauseTotal = 0;
+    vm.gcPauseMax = 0;
+
+    vm.nextClassId = 1; // 0 marks empty inline cache entry
+    vm.nextShapeId = 1; // 0 stands for instance in dictionary mode in inline caches
+
+    initTable(&vm.globalSlots);
+    vm.globalValues = NULL;
+    vm.globalCount = 0;
+    vm.globalCapacity = 0;
     initTable(&vm.strings);
 
     vm.initString = NULL;
-    vm.initString = copyString("init", 4); // Keep "init" string on heap for quick comparison when used in code
+    vm.initString = internString("init", 4); // Keep "init" string on heap for quick comparison when used in code
 
-    defineNative("clock", clockNative);
+    loadNativeModule("core");
 }
 
 // Free memory after VM
 void freeVM() {
     freeTable(&vm.strings);
-    freeTable(&vm.globals);
+    freeTable(&vm.globalSlots);
+    FREE_ARRAY(Value, vm.globalValues, vm.globalCapacity);
+    vm.globalCount = 0;
+    vm.globalCapacity = 0;
     vm.initString = NULL;
     freeObjects();
+    free(vm.frames);
+    free(vm.stack);
+    if (vm.profile != NULL) freeProfile(vm.profile);
+    vm.profile = NULL;
+    freeOutput(&vm.output); // Flushes what's left, at exit
+}
+
+/* Allocate and initialize VM, making it current for the calling thread
+*
+*   Return new VM
+*/
+VM* newVM() {
+    VM* machine = (VM*)malloc(sizeof(VM));
+    if (machine == NULL) exit(1);
+    currentVM = machine;
+    initVM();
+    return machine;
+}
+
+/* Free VM with everything it allocated. Calling thread has no current VM afterwards
+*   Arguments:
+*   - VM* machine: created with newVM()
+*/
+void destroyVM(VM* machine) {
+    currentVM = machine;
+    freeVM();
+    free(machine);
+    currentVM = NULL;
+}
+
+/* Make VM current for the calling thread
+*   Arguments:
+*   - VM* machine: to use, NULL for none
+*/
+void setCurrentVM(VM* machine) {
+    currentVM = machine;
 }
 
 /* Push value onto VM's stack
@@ -131,6 +236,39 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
+/* Make room for values above stack top, moving the stack when it has to grow
+*   Callframes slots and open upvalues pointing into the old stack are relocated, run() reloads its copies after the call
+*   Arguments:
+*   - int needed: number of slots required above stack top
+*
+*   Return false when stack would get over STACK_MAX
+*/
+static bool ensureStack(int needed) {
+    int required = (int)(vm.stackTop - vm.stack) + needed;
+    if (required <= vm.stackCapacity) return true;
+    if (required > STACK_MAX) return false;
+
+    int capacity = vm.stackCapacity;
+    while (capacity < required) capacity *= 2;
+    if (capacity > STACK_MAX) capacity = STACK_MAX;
+
+    // Copy into new block first, so pointers can be rebased while the old one is still valid
+    Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+    if (stack == NULL) exit(1);
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stackCapacity = capacity;
+    return true;
+}
+
 /* Call function
 *   Arguments:
 *   - ObjClosure* closure: of called function
@@ -143,7 +281,17 @@ static bool call(ObjClosure* closure, int argCount) {
         runtimeError("Expected %d arguments but got %d", closure->function->arity, argCount);
         return false;
     }
-    if (vm.frameCount == FRAMES_MAX) {
+    if (vm.frameCount == vm.frameCapacity) {
+        if (vm.frameCapacity == FRAMES_MAX) {
+            runtimeError("Stack overflow.");
+            return false;
+        }
+        vm.frameCapacity = vm.frameCapacity * 2 > FRAMES_MAX ? FRAMES_MAX : vm.frameCapacity * 2;
+        vm.frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * vm.frameCapacity);
+        if (vm.frames == NULL) exit(1);
+    }
+    // Whole frame is checked once here, so pushes in run() never cross the stack end
+    if (!ensureStack(closure->function->maxSlots - argCount - 1 + STACK_HEADROOM)) {
         runtimeError("Stack overflow.");
         return false;
     }
@@ -151,6 +299,32 @@ static bool call(ObjClosure* closure, int argCount) {
     frame->closure = closure;
     frame->ip = closure->function->chunk.code; // Initialize ip to point to the beginning of the function’s bytecode
     frame->slots = vm.stackTop - argCount - 1; // Point to slots of function being called and arguments
+    frame->tailCalls = 0;
+#ifdef BASELINE_JIT
+    ObjFunction* function = closure->function;
+    if (vm.jitEnabled && function->hotness >= 0 && ++function->hotness >= JIT_THRESHOLD) compileJit(function);
+#endif
+    return true;
+}
+
+/* Call native function, which runs without callframe straight on the caller's stack
+*   Arguments:
+*   - ObjNative* native: to call, placed on the stack before arguments
+*   - int argCount: number of passed arguments
+*
+*   Return whether call successful
+*/
+static inline bool callNative(ObjNative* native, int argCount) {
+    if (argCount != native->arity && native->arity != NATIVE_VARIADIC) {
+        runtimeError("Expected %d arguments but got %d", native->arity, argCount);
+        return false;
+    }
+    Value result = native->function(argCount, vm.stackTop - argCount);
+    if (IS_UNDEFINED(result)) return false; // Native already reported runtime error
+    vm.stackTop -= argCount + 1; // Clean function frame from the stack
+
+    // Function compiled by clox have return operation for pushing result, native functions have to do it by themselves
+    push(result);
     return true;
 }
 
@@ -184,15 +358,8 @@ static bool callValue(Value callee, int argCount) {
         }
         case OBJ_CLOSURE:
             return call(AS_CLOSURE(callee), argCount);
-        case OBJ_NATIVE: {
-            NativeFn native = AS_NATIVE(callee);
-            Value result = native(argCount, vm.stackTop - argCount);
-            vm.stackTop -= argCount + 1; // Clean function frame from the stack
-
-            // Function compiled by clox have return operation for pushing result, native functions have to do it by themselves
-            push(result);
-            return true;
-        }
+        case OBJ_NATIVE:
+            return callNative((ObjNative*)AS_OBJ(callee), argCount);
         default:
             break; //Non-callable object type.
         }
@@ -218,14 +385,187 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
     return call(AS_CLOSURE(method), argCount);
 }
 
+// Kind of property found by lookup
+typedef enum {
+    PROPERTY_NONE,  // Neither field nor method
+    PROPERTY_FIELD, // Field of the instance
+    PROPERTY_METHOD // Method of the instance's class
+} PropertyKind;
+
+/* Remember resolved property in the next entry of inline cache, replacing the oldest one when site is polymorphic beyond cache size
+*   Arguments:
+*   - InlineCache* cache: of the access site
+*   - uint32_t shapeId: of the receiver
+*   - uint32_t classId: of the receiver for method, 0 for field
+*   - int slot: of the field
+*   - Obj* method: resolved method, NULL for field
+*   - Shape* transition: shape after adding the field, NULL if field existed
+*/
+static void fillCache(InlineCache* cache, uint32_t shapeId, uint32_t classId, int slot, Obj* method, Shape* transition) {
+    InlineCacheEntry* entry = &cache->entries[cache->next];
+    cache->next = (cache->next + 1) % INLINE_CACHE_SIZE;
+    entry->shapeId = shapeId;
+    entry->classId = classId;
+    entry->slot = slot;
+    entry->method = method;
+    entry->transition = transition;
+}
+
+/* Find field or method of instance when inline cache probe failed, refilling the cache
+*   Arguments:
+*   - ObjInstance* instance: to look property in
+*   - ObjString* name: of property
+*   - InlineCache* cache: of the access site
+*   - Value* result: pointer to the value that should be updated with field value or method closure
+*
+*   Return what kind of property was found
+*/
+static PropertyKind lookupProperty(ObjInstance* instance, ObjString* name, InlineCache* cache, Value* result) {
+    Shape* shape = instance->shape;
+    ObjClass* klass = instance->klass;
+
+    if (shape != NULL) {
+        int slot = shapeFindSlot(shape, name);
+        if (slot != -1) {
+            fillCache(cache, shape->id, 0, slot, NULL, NULL);
+            *result = instance->fields[slot];
+            return PROPERTY_FIELD;
+        }
+    } else { // Dictionary mode instance, fields are checked before methods using remembered entry index
+        Table* fields = &instance->dictionary;
+        int index = cache->fieldIndex;
+        if (index >= fields->capacity || fields->keys[index] != name) index = tableFindIndex(fields, name);
+        if (index != -1) {
+            cache->fieldIndex = index;
+            *result = fields->values[index];
+            return PROPERTY_FIELD;
+        }
+
+        // Methods of dictionary mode instances are cached under shape id 0
+        for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+            InlineCacheEntry* entry = &cache->entries[i];
+            if (entry->shapeId == 0 && entry->method != NULL && entry->classId == klass->id) {
+                *result = OBJ_VAL(entry->method);
+                return PROPERTY_METHOD;
+            }
+        }
+    }
+
+    if (!tableGet(&klass->methods, name, result)) return PROPERTY_NONE;
+    fillCache(cache, shape != NULL ? shape->id : 0, klass->id, 0, AS_OBJ(*result), NULL);
+    return PROPERTY_METHOD;
+}
+
+/* Find field or method of instance with the access site's inline cache
+*   Arguments:
+*   - ObjInstance* instance: to look property in
+*   - ObjString* name: of property
+*   - InlineCache* cache: of the access site
+*   - Value* result: pointer to the value that should be updated with field value or method closure
+*
+*   Return what kind of property was found
+*/
+static inline PropertyKind findProperty(ObjInstance* instance, ObjString* name, InlineCache* cache, Value* result) {
+    /* Shape tells whether field exists, so entry for shape holds either the field's slot or the method.
+    Class id is renewed whenever methods change, so method hit always returns closure still in the table.
+    Such method is reachable through the class, so cached pointers don't have to be marked by GC
+    */
+    Shape* shape = instance->shape;
+    if (shape != NULL) {
+        for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+            InlineCacheEntry* entry = &cache->entries[i];
+            if (entry->shapeId != shape->id) continue;
+            if (entry->method == NULL) {
+                *result = instance->fields[entry->slot];
+                return PROPERTY_FIELD;
+            }
+            if (entry->classId == instance->klass->id) {
+                *result = OBJ_VAL(entry->method);
+                return PROPERTY_METHOD;
+            }
+        }
+    }
+    return lookupProperty(instance, name, cache, result);
+}
+
+/* Check whether access site's inline cache saw only the given receiver's shape, which is then in its first entry.
+*   Such site is quickened, specialized opcode checks just the first entry and goes back to generic one on any miss.
+*   Sites that saw more shapes stay generic, so receivers taking turns don't keep rewriting the opcode
+*   Arguments:
+*   - InlineCache* cache: of the access site
+*   - ObjInstance* instance: receiver of the access
+*
+*   Return whether the site is monomorphic for the receiver
+*/
+static inline bool monomorphicCache(InlineCache* cache, ObjInstance* instance) {
+    InlineCacheEntry* second = &cache->entries[1];
+    return second->shapeId == 0 && second->method == NULL // Nothing filled the second entry yet
+        && instance->shape != NULL && cache->entries[0].shapeId == instance->shape->id;
+}
+
+/* Set instance field with the access site's inline cache, if that doesn't require allocation
+*   Arguments:
+*   - ObjInstance* instance: to set field of
+*   - ObjString* name: of field
+*   - InlineCache* cache: of the access site
+*   - Value value: to set
+*
+*   Return whether field was set
+*/
+static inline bool setCachedField(ObjInstance* instance, ObjString* name, InlineCache* cache, Value value) {
+    Shape* shape = instance->shape;
+
+    if (shape == NULL) { // Dictionary mode instance, only existing field at remembered entry
+        Table* fields = &instance->dictionary;
+        int index = cache->fieldIndex;
+        if (index >= fields->capacity || fields->keys[index] != name) return false;
+        fields->values[index] = value;
+        return true;
+    }
+
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+        InlineCacheEntry* entry = &cache->entries[i];
+        if (entry->shapeId != shape->id) continue;
+        if (entry->transition == NULL) { // Existing field
+            instance->fields[entry->slot] = value;
+            return true;
+        }
+        if (entry->slot >= instance->fieldCapacity) return false; // Added field doesn't fit
+        instance->fields[entry->slot] = value;
+        instance->shape = entry->transition;
+        return true;
+    }
+    return false;
+}
+
+/* Set instance field and remember in the access site's inline cache how it was done
+*   Arguments:
+*   - ObjInstance* instance: to set field of. Has to be reachable by GC
+*   - ObjString* name: of field
+*   - InlineCache* cache: of the access site
+*   - Value value: to set
+*/
+static void setField(ObjInstance* instance, ObjString* name, InlineCache* cache, Value value) {
+    Shape* shape = instance->shape;
+    instanceSetField(instance, name, value);
+
+    if (instance->shape == NULL) { // Instance is or just went into dictionary mode
+        cache->fieldIndex = tableFindIndex(&instance->dictionary, name);
+        return;
+    }
+    int slot = shapeFindSlot(instance->shape, name);
+    fillCache(cache, shape->id, 0, slot, NULL, instance->shape != shape ? instance->shape : NULL);
+}
+
 /* Invoke method from class
 *   Arguments:
 *   - ObjString* name: of method
 *   - int argCount: number of passed arguments
+*   - InlineCache* cache: of the invocation site
 *
 *   Return whether invocation successful
 */
-static bool invoke(ObjString* name, int argCount) {
+static bool invoke(ObjString* name, int argCount, InlineCache* cache) {
     Value receiver = peek(argCount); // Look for receiver on stack before arguments
 
     if (!IS_INSTANCE(receiver)) {
@@ -235,12 +575,16 @@ static bool invoke(ObjString* name, int argCount) {
     ObjInstance* instance = AS_INSTANCE(receiver);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+    switch (findProperty(instance, name, cache, &value)) {
+        case PROPERTY_FIELD: // Field holding callable value
+            vm.stackTop[-argCount - 1] = value;
+            return callValue(value, argCount);
+        case PROPERTY_METHOD:
+            return call(AS_CLOSURE(value), argCount);
+        default:
+            runtimeError("Undefined property '%s'.", name->chars);
+            return false;
     }
-
-    return invokeFromClass(instance->klass, name, argCount);
 }
 
 /* Find method in class and push it to stack
@@ -309,6 +653,7 @@ static void closeUpvalues(Value* last) {
     while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location; // Copy the variable’s value into the closed field
+        writeBarrier(upvalue->closed); // Value leaves the stack, where marking would find it
         upvalue->location = &upvalue->closed; // Update that location to the address of the ObjUpvalue’s own closed field.
         vm.openUpvalues = upvalue->next; // Move to next open upvalue in the linked list
     }
@@ -324,10 +669,27 @@ static void closeUpvalues(Value* last) {
 static void defineMethod(ObjString* name) {
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
+    writeBarrier(method);
     tableSet(&klass->methods, name, method);
+    klass->id = vm.nextClassId++; // Invalidate inline caches holding previous methods
     pop();
 }
 
+/* Check whether value can index list
+*   Arguments:
+*   - ObjList* list: to be indexed
+*   - Value index: to check
+*
+*   Return error message, NULL when index is integer within the list
+*/
+static inline const char* checkIndex(ObjList* list, Value index) {
+    if (!IS_NUMBER(index)) return "List index must be a number.";
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < list->items.count)) return "List index out of range."; // Negated, so NaN is out of range too
+    if (number != (int)number) return "List index must be an integer.";
+    return NULL;
+}
+
 /* Check if value is falsey
 *   Arguments:
 *   - Value value: to check
@@ -339,322 +701,125 @@ static bool isFalsey(Value value) {
 }
 
 /* Concatenate two top values from stack
+Short results are copied into flat string, longer ones become rope deferring copying, hashing and interning
 *
 *   Stack in:   value a, value b
 *   Stack out:  result
 */
 static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+    Obj* b = AS_OBJ(peek(0));
+    Obj* a = AS_OBJ(peek(1));
+
+    int length = stringLength(a) + stringLength(b);
+    Obj* result;
+    if (length >= ROPE_MIN_LENGTH) {
+        result = (Obj*)newRope(a, b);
+    } else {
+        // Ropes are never shorter than ROPE_MIN_LENGTH, so both parts are flat here
+        ObjString* left = (ObjString*)a;
+        ObjString* right = (ObjString*)b;
 
-    int length = a->length + b->length; // Calculate how much memory needs to be allocated
-    char* chars = ALLOCATE(char, length+1); 
-    memcpy(chars, a->chars, a->length); // Copy first string
-    memcpy(chars + a->length, b->chars, b->length); // Copy second string
-    chars[length] = '\0'; // Terminate string
+        char chars[ROPE_MIN_LENGTH]; // Built on C stack, string object is the only allocation
+        memcpy(chars, left->chars, left->length); // Copy first string
+        memcpy(chars + left->length, right->chars, right->length); // Copy second string
 
-    ObjString* result = takeString(chars, length); // Take ownership of the string, as we've already allocated memory
+        result = (Obj*)copyString(chars, length); // Copied inline into the object, nothing if already interned
+    }
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
-/* Main function for running VM's chunk
-*
-*   Return InterpretResult, INTERPRET_OK if everything ok
-*/
-static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1]; // Set current frame to the first element of frames array
-    #define READ_BYTE() (*frame->ip++) // Read next byte from chunk
-    #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1])) // Read next two bytes as short number from chunk
-    #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()]) // Read next byte as address and dereference if from constants table
-    #define READ_STRING() AS_STRING(READ_CONSTANT()) // Read next byte as string address in constants table
-    /* Wrapper around simple binary operators for numbers
-    Pops two topmost numbers from stack and pushes result of operator
-    */
-    #define BINARY_OP(valueType, op) \
-        do { \
-            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-                runtimeError("Operands must be numbers."); \
-                return INTERPRET_RUNTIME_ERROR; \
-            } \
-            double b = AS_NUMBER(pop()); \
-            double a = AS_NUMBER(pop()); \
-            push(valueType(a op b)); \
-        } while (false)
-
-    for (;;) {
-    #ifdef DEBUG_TRACE_EXECUTION
-        // Debug printing execution
-
-        // Print stack before operation
-        printf("          ");
-        for(Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
+/* Replace rope on stack with its flat string
+*   Arguments:
+*   - Value* slot: pointer to stack slot holding the value
+*/
+static void flattenSlot(Value* slot) {
+    if (IS_ROPE(*slot)) *slot = OBJ_VAL(flattenRope(AS_ROPE(*slot)));
+}
 
-        // Print operation that will be executed
-        disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
-    #endif
-        uint8_t instruction;
+/* Debug print stack and the operation that will be executed
+*   Arguments:
+*   - CallFrame* frame: currently executed callframe
+*/
+static void traceExecution(CallFrame* frame) {
+    // Print stack before operation
+    printf("          ");
+    for(Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
 
-        // Opcodes behaviour also documented in chunk.h
-        switch (instruction=READ_BYTE())
-        {
-        case OP_CONSTANT: { // Push constant from constants address to stack
-            Value constant = READ_CONSTANT();
-            push(constant);
-            break;
-        }
-        case OP_NIL: push(NIL_VAL); break;
-        case OP_TRUE: push(BOOL_VAL(true)); break;
-        case OP_FALSE: push(BOOL_VAL(false)); break;
-        case OP_POP: pop(); break;
-        case OP_GET_LOCAL: { // Push local from chunk's slot index to stack
-            uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
-            break;
-        }
-        case OP_SET_LOCAL: { // Update local on the slot from chunk with value from stack
-            uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
-            break;
-        }
-        case OP_GET_GLOBAL: { // Push global from globals table to stack
-            ObjString* name = READ_STRING(); // Get string object from address specified by operand
-            Value value;
-            if (!tableGet(&vm.globals, name, &value)) { // Get value with name from globals hash table
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(value);
-            break;
-        }
-        case OP_DEFINE_GLOBAL: { // Define global in globals table
-            ObjString* name = READ_STRING();
-            tableSet(&vm.globals, name, peek(0)); // Peek rather than pop right away to not be freed by GC
-            pop();
-            break;
-        }
-        case OP_SET_GLOBAL: { // Set global value with value from stack
-            ObjString* name = READ_STRING();
-            if (tableSet(&vm.globals, name, peek(0))) {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_GET_UPVALUE: { // Get upvalue from upvalues table location
-            uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
-            break;
-        }
-        case OP_SET_UPVALUE: { // Set upvalue value on the location with value from stack
-            uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
-        }
-        case OP_GET_PROPERTY: { // Get instance property
-            if (!IS_INSTANCE(peek(0))) {
-                runtimeError("Only instances have properties.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            ObjInstance* instance = AS_INSTANCE(peek(0));
-            ObjString* name = READ_STRING();
-            Value value;
-            if (tableGet(&instance->fields, name, &value)) {
-                pop(); // Pop instance
-                push(value); // Push property value
-                break; // Finish resolving when found field
-            }
+    // Print operation that will be executed
+    disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+}
 
-            // Try finding method if field was not found
-            if (!bindMethod(instance->klass, name)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_SET_PROPERTY: { // Set instance from stack property with value with stack
-            if (!IS_INSTANCE(peek(1))) {
-                runtimeError("Only instances have fields.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            ObjInstance* instance = AS_INSTANCE(peek(1));
-            tableSet(&instance->fields, READ_STRING(), peek(0));
-            Value value = pop(); // Pop value
-            pop(); // Pop instance
-            push(value); // Push value at the top of the stack as set statements should return what they evaluated to
-            break;
-        }
-        case OP_GET_SUPER: { // Get method from superclass
-            ObjString* name = READ_STRING();
-            ObjClass* superclass = AS_CLASS(pop());
-            if (!bindMethod(superclass, name)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_EQUAL: { // Check if values from stack equal
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
-            break;
-        }
-        case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-        case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-        case OP_ADD: { // Add two values from stack
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                concatenate();
-            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a+b));
-            } else {
-                runtimeError("Operands must be two numbers or two strings.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-        case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-        case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-        case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0))) {
-                runtimeError("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_PRINT: {
-            printValue(pop());
-            printf("\n");
-            break;
-        }
-        case OP_JUMP: { // Unconditionally jump over number of instructions
-            uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
-        }
-        case OP_JUMP_IF_FALSE: { // Jump over instructions if topmost value from stack false
-            uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0))) frame->ip += offset;
-            break;
-        }
-        case OP_LOOP: { // Jump backwards over instructions
-            uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
-        }
-        case OP_CALL: { // Call closure specified by adress from chunk
-            int argCount = READ_BYTE();
-            if (!callValue(peek(argCount), argCount)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &vm.frames[vm.frameCount - 1]; // callValue added frame to the frame-stack. Decreasing it back after call
-            break;
-        }
-        case OP_INVOKE: { // Invoke method specified by string from chunk
-            ObjString* method = READ_STRING();
-            int argCount = READ_BYTE();
-            if (!invoke(method, argCount)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &vm.frames[vm.frameCount-1]; // invoke added frame to the frame-stack. Decreasing it back after call
-            break;
-        }
-        case OP_SUPER_INVOKE: { // Invoke method specified by string from chunk, from class at the top of the stack
-            ObjString* method = READ_STRING();
-            int argCount = READ_BYTE();
-            ObjClass* superclass = AS_CLASS(pop());
-            if (!invokeFromClass(superclass, method, argCount)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &vm.frames[vm.frameCount - 1]; // invokeFromClass added frame to the frame-stack. Decreasing it back after call
-            break;
-        }
-        case OP_CLOSURE: { // Create closure from function specified in chunk
-            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-            ObjClosure* closure = newClosure(function);
-            push(OBJ_VAL(closure));
-
-            // Loop through all upvalues
-            for (int i = 0; i < closure->upvalueCount; i++) {
-                uint8_t isLocal = READ_BYTE();
-                uint8_t index = READ_BYTE();
-                if (isLocal) { // If local then capture
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                } else { // If not local then should be already captured by enclosing function
-                    closure->upvalues[i] = frame->closure->upvalues[index];
-                }
-            }
-            break;
-        }
-        case OP_CLOSE_UPVALUE: // Move necessary upvalues from stack to heap
-            closeUpvalues(vm.stackTop - 1);
-            pop();
-            break;
-        case OP_RETURN: { // Clean local variables from stack and push function result. End run if outermost function
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
-
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-        case OP_CLASS: // Push new class on stack
-            push(OBJ_VAL(newClass(READ_STRING())));
-            break;
-        case OP_INHERIT: { // Add methods from superclass on stack to subclass on stack
-            Value superclass = peek(1);
-            if(!IS_CLASS(superclass)) {
-                runtimeError("Superclass must be a class.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
+// Fast loop, with nothing but the program in the dispatch path
+#define RUN_FUNCTION run
+#include "run.h"
 
-            ObjClass* subclass = AS_CLASS(peek(0));
-            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-            pop(); //Subclass.
-            break;
-        }
-        case OP_METHOD: // Add method to class from stack
-            defineMethod(READ_STRING());
-            break;
-        }
-    }
-// Clean up the macros
-#undef READ_BYTE
-#undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
-#undef BINARY_OP
-}
+// Instrumented loop, used when VM traces execution
+#define RUN_FUNCTION runTraced
+#define RUN_TRACE
+#include "run.h"
+
+// Profiled loop, counting opcodes and sampling callstacks when profiling timer fires
+#define RUN_FUNCTION runProfiled
+#define RUN_PROFILE
+#include "run.h"
 
 /* Compile and run source code
 *   Arguments:
-*   - const char* source: code to interpret
+*   - const char* source: code to interpret, doesn't have to be null-terminated
+*   - size_t length: of source code
 *
 *   Return interpreting result
 */
-InterpretResult interpret(const char* source) {
-    ObjFunction* function = compile(source);
+InterpretResult interpret(const char* source, size_t length) {
+    flushOutput(&vm.output); // Compile errors and disassembly come after what earlier code printed
+    ObjFunction* function = compile(source, length);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(function);
+}
+
+/* Compile and run source code in given VM, which becomes current for the calling thread
+*   Arguments:
+*   - VM* machine: to run in
+*   - const char* source: code to interpret, doesn't have to be null-terminated
+*   - size_t length: of source code
+*
+*   Return interpreting result
+*/
+InterpretResult interpretIn(VM* machine, const char* source, size_t length) {
+    currentVM = machine;
+    return interpret(source, length);
+}
 
+/* Run already compiled script
+*   Arguments:
+*   - ObjFunction* function: top-level function of the script
+*
+*   Return interpreting result
+*/
+InterpretResult interpretFunction(ObjFunction* function) {
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
     call(closure, 0);
 
+    // Loop is chosen once, so the fast one never checks the flags
+    if (vm.traceExecution) {
+        vm.output.policy = FLUSH_LINE; // Trace goes to stdout directly, prints have to keep their place in it
+        return runTraced();
+    }
+    if (vm.profile != NULL) {
+        startProfiling();
+        InterpretResult result = runProfiled();
+        stopProfiling();
+        return result;
+    }
     return run();
 }
\ No newline at end of file
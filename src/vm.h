@@ -5,8 +5,30 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64 // Maksimum depth of callstack
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT) // Maximum depth of stack
+#ifndef FRAMES_MAX
+#define FRAMES_MAX (1 << 16) // Hard limit of callstack depth, build with -DFRAMES_MAX=N to change it
+#endif
+#ifndef STACK_MAX
+#define STACK_MAX (1 << 20) // Hard limit of values on the stack, build with -DSTACK_MAX=N to change it
+#endif
+#define FRAMES_INITIAL 16 // Callstack capacity VM starts with, doubled when full
+#define STACK_INITIAL 256 // Stack capacity VM starts with, doubled when called function needs more
+#define STACK_HEADROOM 8 // Slots kept above function's deepest stack for values pushed by VM itself, like GC guards
+#define TRACE_FRAMES 16 // Innermost and outermost callframes printed with runtime error, the ones between are counted
+#define SLAB_SIZE_CLASSES 8 // Object size classes, N-th class holds objects up to (N + 1) * 16 bytes. Largest object type has to fit
+#define GC_HEAP_GROW_FACTOR 2 // Default of gcGrowFactor, next collection starts when heap is N times what survived the last one
+#define GC_MIN_HEAP (1024 * 1024) // Default of gcMinHeap, no collection starts before heap grows past it
+#define GC_PAUSE_BUCKETS 24 // Buckets of GC pause histogram, bucket N counts pauses shorter than 2^N microseconds, the last one all longer
+
+typedef struct Slab Slab; // Block of equally sized object slots, defined by allocator in memory.c
+typedef struct Profile Profile; // Opcode counts and sampled callstacks, defined by profiler.h
+
+// Phase of garbage collection cycle, only incremental collector stays in a phase between allocations
+typedef enum {
+    GC_IDLE,    // No collection in progress
+    GC_MARK,    // Tracing gray objects, write barriers active
+    GC_SWEEP    // Freeing objects left white
+} GCPhase;
 
 /* Callframe struct for single ongoing function call
 *
@@ -14,49 +36,116 @@
 *   - ObjClosure* closure: pointer to function being called
 *   - uint8_t* ip: instruction pointer
 *   - Value* slots: pointer into VM's value stack that function can use
+*   - int tailCalls: number of callframes this one replaced by tail calls, reported in stack traces
 */
 typedef struct {
     ObjClosure* closure; // pointer to function being called
     uint8_t* ip; // instruction pointer
     Value* slots; // pointer into VM's value stack that function can use
+    int tailCalls; // number of callframes this one replaced by tail calls, reported in stack traces
 } CallFrame;
 
 /* Main VM that process opcodes during runtime
 *
 *   Fields:
-*   - CallFrame frames[FRAMES_MAX]: callstack of currently executed function
+*   - CallFrame* frames: callstack of currently executed function
 *   - int frameCount: depth of current callstack
-*   - Value stack[STACK_MAX]: main stack of the VM
+*   - int frameCapacity: allocated length of frames
+*   - Value* stack: main stack of the VM, moved when it grows
 *   - Value* stackTop: pointer to current top of the stack
-*   - Table globals: hash table of global variables
+*   - int stackCapacity: allocated length of stack
+*   - Table globalSlots: slot index of every global variable name, used by compiler and for error messages
+*   - Value* globalValues: values of global variables indexed by slot, UNDEFINED_VAL until defined
+*   - int globalCount: number of reserved global slots
+*   - int globalCapacity: capacity of globalValues
 *   - Table strings: hash table of interned strings
 *   - ObjString* initString: just "init", so comparison will be fast
 *   - ObjUpvalue* openUpvalues: pointer to the start of linked list of open upvalues
+*   - uint32_t nextClassId: id for the next created or modified class
+*   - uint32_t nextShapeId: id for the next created shape
 *   - size_t bytesAllocated: all bytes allocated for memory, for GC purposes
 *   - size_t nextGC: threshold of allocated memory to trigger garbage collection
-*   - Obj* objects: pointer to the start of linked list of objects owned by VM
+*   - Slab* slabs[SLAB_SIZE_CLASSES]: linked list of slabs holding objects of every size class
+*   - Slab* allocSlabs[SLAB_SIZE_CLASSES]: slab of every size class to allocate from, slabs before it are full
 *   - int grayCount: number of currently grayed objects, for GC purposes
 *   - int grayCapacity: capacity of grayStack, for GC purposes
 *   - Obj** grayStack: stack of pointers to grayed objects, for GC purposes
+*   - GCPhase gcPhase: phase of the current garbage collection cycle
+*   - int sweepClass: size class being swept in the current cycle
+*   - Slab** sweepLink: list link holding the next slab to sweep in the current cycle
+*   - double gcGrowFactor: next collection starts when heap grows to this multiple of bytes that survived the last one
+*   - size_t gcMinHeap: heap size below which no collection starts
+*   - size_t gcMaxHeap: heap size at which program fails when even full collection can't get under it, 0 for no limit
+*   - uint64_t gcCollections: number of finished collection cycles
+*   - uint64_t gcBytesFreed: bytes freed by sweeping
+*   - size_t gcPeakHeap: most bytes allocated at once, sampled whenever collector runs
+*   - int gcGrayMax: most objects grayStack held at once
+*   - uint64_t gcLiveObjects[OBJ_TYPE_COUNT]: objects of every type that survived the last collection
+*   - uint64_t gcLiveBytes[OBJ_TYPE_COUNT]: bytes of those objects, with arrays they own
+*   - uint64_t gcSurvivors[OBJ_TYPE_COUNT]: objects of every type that survived sweep of the current cycle so far
+*   - uint64_t gcSurvivorBytes[OBJ_TYPE_COUNT]: bytes of those objects, with arrays they own
+*   - Output output: buffer of what the program prints, flushed to stdout
+*   - bool traceExecution: whether stack and every instruction are printed before they execute
+*   - bool dumpBytecode: whether compiler disassembles every compiled function
+*   - Profile* profile: opcode counts and sampled callstacks, NULL unless VM is profiled
+*   - bool jitEnabled: whether hot functions are compiled to machine code, cleared when platform doesn't allow it
+*   - bool gcStats: whether GC pauses should be measured and reported
+*   - uint64_t gcPauses[GC_PAUSE_BUCKETS]: histogram of GC pauses
+*   - uint64_t gcPauseCount: number of GC pauses
+*   - uint64_t gcPauseTotal: sum of GC pauses in nanoseconds
+*   - uint64_t gcPauseMax: longest GC pause in nanoseconds
 */
 typedef struct {
-    CallFrame frames[FRAMES_MAX]; // callstack of currently executed function
+    CallFrame* frames; // callstack of currently executed function
     int frameCount; // depth of current callstack
+    int frameCapacity; // allocated length of frames
 
-    Value stack[STACK_MAX]; // main stack of the VM
+    Value* stack; // main stack of the VM, moved when it grows
     Value* stackTop; // pointer to current top of the stack
-    Table globals; // hash table of global variables
+    int stackCapacity; // allocated length of stack
+    Table globalSlots; // slot index of every global variable name, used by compiler and for error messages
+    Value* globalValues; // values of global variables indexed by slot, UNDEFINED_VAL until defined
+    int globalCount; // number of reserved global slots
+    int globalCapacity; // capacity of globalValues
     Table strings; // hash table of interned strings
     ObjString* initString; // just "init", so comparison will be fast
     ObjUpvalue* openUpvalues; // pointer to the start of linked list of open upvalues
+    uint32_t nextClassId; // id for the next created or modified class
+    uint32_t nextShapeId; // id for the next created shape
 
     size_t bytesAllocated; //  all bytes allocated for memory, for GC purposes
     size_t nextGC; // threshold of allocated memory to trigger garbage collection
-    Obj* objects; // pointer to the start of linked list of objects owned by VM
+    Slab* slabs[SLAB_SIZE_CLASSES]; // linked list of slabs holding objects of every size class
+    Slab* allocSlabs[SLAB_SIZE_CLASSES]; // slab of every size class to allocate from, slabs before it are full
 
     int grayCount; // number of currently grayed objects, for GC purposes
     int grayCapacity; // capacity of grayStack, for GC purposes
     Obj** grayStack; //stack of pointers to grayed objects, for GC purposes
+    GCPhase gcPhase; // phase of the current garbage collection cycle
+    int sweepClass; // size class being swept in the current cycle
+    Slab** sweepLink; // list link holding the next slab to sweep in the current cycle
+    double gcGrowFactor; // next collection starts when heap grows to this multiple of bytes that survived the last one
+    size_t gcMinHeap; // heap size below which no collection starts
+    size_t gcMaxHeap; // heap size at which program fails when even full collection can't get under it, 0 for no limit
+    uint64_t gcCollections; // number of finished collection cycles
+    uint64_t gcBytesFreed; // bytes freed by sweeping
+    size_t gcPeakHeap; // most bytes allocated at once, sampled whenever collector runs
+    int gcGrayMax; // most objects grayStack held at once
+    uint64_t gcLiveObjects[OBJ_TYPE_COUNT]; // objects of every type that survived the last collection
+    uint64_t gcLiveBytes[OBJ_TYPE_COUNT]; // bytes of those objects, with arrays they own
+    uint64_t gcSurvivors[OBJ_TYPE_COUNT]; // objects of every type that survived sweep of the current cycle so far
+    uint64_t gcSurvivorBytes[OBJ_TYPE_COUNT]; // bytes of those objects, with arrays they own
+
+    Output output; // buffer of what the program prints, flushed to stdout
+    bool traceExecution; // whether stack and every instruction are printed before they execute
+    bool dumpBytecode; // whether compiler disassembles every compiled function
+    Profile* profile; // opcode counts and sampled callstacks, NULL unless VM is profiled
+    bool jitEnabled; // whether hot functions are compiled to machine code, cleared when platform doesn't allow it
+    bool gcStats; // whether GC pauses should be measured and reported
+    uint64_t gcPauses[GC_PAUSE_BUCKETS]; // histogram of GC pauses
+    uint64_t gcPauseCount; // number of GC pauses
+    uint64_t gcPauseTotal; // sum of GC pauses in nanoseconds
+    uint64_t gcPauseMax; // longest GC pause in nanoseconds
 } VM;
 
 typedef enum {
@@ -65,7 +154,8 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR // Runtime error
 } InterpretResult;
 
-extern VM vm; // Global VM
+extern THREAD_LOCAL VM* currentVM; // VM the calling thread works with
+#define vm (*currentVM) // Current VM of the thread, every part of the interpreter works on it
 
 // Init VM that will hold opcodes and runtime objects
 void initVM();
@@ -73,13 +163,75 @@ void initVM();
 // Free VM's memory
 void freeVM();
 
+/* Allocate and initialize VM, making it current for the calling thread.
+*   Every VM has its own heap, interned strings and globals. It can move between threads,
+*   but can be used by one thread at a time
+*
+*   Return new VM
+*/
+VM* newVM();
+
+/* Free VM with everything it allocated. Calling thread has no current VM afterwards
+*   Arguments:
+*   - VM* machine: created with newVM()
+*/
+void destroyVM(VM* machine);
+
+/* Make VM current for the calling thread
+*   Arguments:
+*   - VM* machine: to use, NULL for none
+*/
+void setCurrentVM(VM* machine);
+
+/* Compile and run source code in given VM, which becomes current for the calling thread
+*   Arguments:
+*   - VM* machine: to run in
+*   - const char* source: code to interpret, doesn't have to be null-terminated
+*   - size_t length: of source code
+*
+*   Return interpreting result
+*/
+InterpretResult interpretIn(VM* machine, const char* source, size_t length);
+
+/* Report runtime error and print callstack, arguments behave like in printf
+*   Arguments:
+*   - const char* format: string to print
+*   - ... - arbitrary number of arguments passed to vfprintf
+*/
+void runtimeError(const char* format, ...);
+
 /* Compile and run source code
 *   Arguments:
-*   - const char* source: code to interpret
+*   - const char* source: code to interpret, doesn't have to be null-terminated
+*   - size_t length: of source code
+*
+*   Return interpreting result
+*/
+InterpretResult interpret(const char* source, size_t length);
+
+/* Run already compiled script
+*   Arguments:
+*   - ObjFunction* function: top-level function of the script
 *
 *   Return interpreting result
 */
-InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
+
+/* Find slot of global variable, reserving a new undefined slot for name seen the first time
+*   Arguments:
+*   - ObjString* name: of the global
+*
+*   Return slot index in globalValues
+*/
+int globalSlot(ObjString* name);
+
+/* Find name of global variable
+*   Arguments:
+*   - int slot: of the global
+*
+*   Return name the slot was reserved for
+*/
+ObjString* globalName(int slot);
 
 /* Push value onto VM's stack
 *   Arguments: